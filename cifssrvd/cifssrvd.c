@@ -20,21 +20,92 @@
  */
 
 #include "cifssrv.h"
+#include "ntlmssp.h"
 
 struct list_head cifssrv_share_list;
 int cifssrv_num_shares;
+/* bumped on every change of cifssrv_share_list */
+unsigned int cifssrv_share_gen;
+/* bumped on every change of workgroup and server_string */
+unsigned int cifssrv_global_gen;
 
 char workgroup[MAX_SERVER_WRKGRP_LEN];
 char server_string[MAX_SERVER_NAME_LEN];
+char netbios_name[MAX_NETBIOS_NAME_LEN];
+
+/* accounts imported by config_users(), for NTLMSSP on the rpc pipes */
+static LIST_HEAD(cifssrv_usr_list);
 
 void usage(void)
 {
 	fprintf(stderr,
 		"Usage: cifssrvd [-h|--help] [-v|--version] [-d |--debug]\n"
-		"       [-c smb.conf|--configure=smb.conf] [-i usrs-db|--import-users=cifspwd.db\n");
+		"       [-c smb.conf|--configure=smb.conf] [-i usrs-db|--import-users=cifspwd.db\n"
+		"       [-r registry.db] [-R import.reg]\n");
 	exit(0);
 }
 
+/**
+ * add_user() - remember a user account imported from the database
+ * @name:	user name
+ * @passkey:	NT hash of the password
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+static int add_user(const char *name, const char *passkey)
+{
+	struct cifssrv_usr *usr;
+
+	usr = calloc(1, sizeof(struct cifssrv_usr));
+	if (!usr)
+		return -ENOMEM;
+
+	usr->name = strdup(name);
+	if (!usr->name) {
+		free(usr);
+		return -ENOMEM;
+	}
+	memcpy(usr->passkey, passkey, CIFS_NTHASH_SIZE);
+	list_add_tail(&usr->list, &cifssrv_usr_list);
+	return 0;
+}
+
+/**
+ * lookup_user() - find an imported user account
+ * @name:	user name, compared case insensitively
+ *
+ * Return:	user account, or NULL if there is none
+ */
+struct cifssrv_usr *lookup_user(const char *name)
+{
+	struct cifssrv_usr *usr;
+	struct list_head *tmp;
+
+	list_for_each(tmp, &cifssrv_usr_list) {
+		usr = list_entry(tmp, struct cifssrv_usr, list);
+		if (!strcasecmp(usr->name, name))
+			return usr;
+	}
+	return NULL;
+}
+
+/**
+ * exit_user_config() - destroy user list
+ */
+static void exit_user_config(void)
+{
+	struct cifssrv_usr *usr;
+
+	while (!list_empty(&cifssrv_usr_list)) {
+		usr = list_entry(cifssrv_usr_list.next,
+				struct cifssrv_usr, list);
+		list_del(&usr->list);
+		memset(usr->passkey, 0, CIFS_NTHASH_SIZE);
+		free(usr->name);
+		free(usr);
+	}
+}
+
 /**
  * config_users() - function to configure cifssrv with user accounts from
  *		local database file. cifssrv should be live in kernel
@@ -89,6 +160,8 @@ int config_users(char *dbpath)
 				cifssrv_err("cifssrv is not available\n");
 				goto out;
 			}
+			if (add_user(usr, pwd))
+				goto out;
 			free(usr);
 			free(pwd);
 			free(construct);
@@ -139,15 +212,290 @@ static struct cifssrv_share *alloc_new_share(void)
 	}
 
 	INIT_LIST_HEAD(&share->list);
+	INIT_LIST_HEAD(&share->utf16_list);
 	return share;
 }
 
+/**
+ * free_share_utf16() - free pre-encoded UTF-16 strings of a share
+ * @share:	share to release encodings for
+ */
+static void free_share_utf16(struct cifssrv_share *share)
+{
+	struct cifssrv_share_utf16 *u16;
+	struct list_head *tmp, *t;
+
+	list_for_each_safe(tmp, t, &share->utf16_list) {
+		u16 = list_entry(tmp, struct cifssrv_share_utf16, list);
+		list_del(&u16->list);
+		free(u16->name);
+		free(u16->comment);
+		free(u16->path);
+		free(u16);
+	}
+}
+
+/**
+ * share_dos_path() - build DOS style path of a share for clients
+ * @share:	share to build path for
+ *
+ * Windows clients expect a drive letter and backslashes, so a share on
+ * /srv/data is reported as C:\srv\data. IPC$ and shares without a path
+ * get an empty string.
+ *
+ * Return:	allocated path string on success, otherwise NULL
+ */
+char *share_dos_path(struct cifssrv_share *share)
+{
+	char *path, *p;
+
+	if (!share->path || !strcmp(share->sharename, STR_IPC))
+		return strdup("");
+
+	path = (char *)malloc(strlen(share->path) + 3);
+	if (!path)
+		return NULL;
+
+	sprintf(path, "C:%s", share->path);
+	for (p = path; *p; p++) {
+		if (*p == '/')
+			*p = '\\';
+	}
+	return path;
+}
+
+/**
+ * get_share_utf16() - get share name, comment and path encoded in UTF-16LE
+ * @share:	share to look up encodings for
+ * @codepage:	codepage of the client pipe
+ *
+ * Encodings are built once per codepage and then kept with the share,
+ * so dcerpc responses copy the bytes instead of converting each time.
+ *
+ * Return:	UTF-16 encodings on success, otherwise error pointer
+ */
+struct cifssrv_share_utf16 *get_share_utf16(struct cifssrv_share *share,
+		const char *codepage)
+{
+	struct cifssrv_share_utf16 *u16;
+	struct list_head *tmp;
+	char *comment, *path;
+
+	list_for_each(tmp, &share->utf16_list) {
+		u16 = list_entry(tmp, struct cifssrv_share_utf16, list);
+		if (!strcasecmp(u16->codepage, codepage))
+			return u16;
+	}
+
+	u16 = (struct cifssrv_share_utf16 *)calloc(1,
+			sizeof(struct cifssrv_share_utf16));
+	if (!u16)
+		return ERR_PTR(-ENOMEM);
+
+	strncpy(u16->codepage, codepage, CIFSSRV_CODEPAGE_LEN - 1);
+	u16->name = smb_utf16_encode(share->sharename, codepage,
+			&u16->name_len);
+	if (IS_ERR(u16->name)) {
+		free(u16);
+		return ERR_PTR(-EINVAL);
+	}
+
+	/* Windows expect comment to be non-null */
+	if (!strcmp(share->sharename, STR_IPC))
+		comment = "IPC SHARE";
+	else if (share->config.comment)
+		comment = share->config.comment;
+	else
+		comment = share->sharename;
+
+	u16->comment = smb_utf16_encode(comment, codepage, &u16->comment_len);
+	if (IS_ERR(u16->comment)) {
+		free(u16->name);
+		free(u16);
+		return ERR_PTR(-EINVAL);
+	}
+
+	path = share_dos_path(share);
+	if (!path) {
+		free(u16->comment);
+		free(u16->name);
+		free(u16);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	u16->path = smb_utf16_encode(path, codepage, &u16->path_len);
+	free(path);
+	if (IS_ERR(u16->path)) {
+		free(u16->comment);
+		free(u16->name);
+		free(u16);
+		return ERR_PTR(-EINVAL);
+	}
+
+	list_add_tail(&u16->list, &share->utf16_list);
+	return u16;
+}
+
+/*
+ * Share lookup index: open addressing hash table over the share list,
+ * keyed by the case-folded share name, since Windows share names are
+ * case-insensitive. A new table is built whenever the share list changes
+ * and then published with a single pointer store. Names that were asked
+ * for but do not exist are remembered in a small direct-mapped negative
+ * cache that lives and dies with the table.
+ */
+#define SHARE_NEG_CACHE_SIZE	128
+
+struct share_neg_entry {
+	unsigned int	hash;
+	char		name[SHARE_MAX_NAME_LEN];
+};
+
+struct share_index {
+	unsigned int		gen;
+	unsigned int		mask;
+	struct cifssrv_share	**slots;
+	unsigned int		*hashes;
+	struct share_neg_entry	neg[SHARE_NEG_CACHE_SIZE];
+};
+
+static struct share_index *share_index;
+
+/**
+ * share_name_hash() - case-insensitive FNV-1a hash of a share name
+ * @name:	share name
+ *
+ * Return:	hash value
+ */
+static unsigned int share_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	for (; *name; name++) {
+		hash ^= (unsigned char)toupper((unsigned char)*name);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * build_share_index() - build a lookup index over the current share list
+ *
+ * Return:	new index on success, otherwise NULL
+ */
+static struct share_index *build_share_index(void)
+{
+	struct share_index *index;
+	struct cifssrv_share *share;
+	struct list_head *tmp;
+	unsigned int size = 16, hash, i;
+
+	/* keep the load factor at or below one half */
+	while (size < cifssrv_num_shares * 2)
+		size <<= 1;
+
+	index = (struct share_index *)calloc(1, sizeof(struct share_index));
+	if (!index)
+		return NULL;
+
+	index->slots = (struct cifssrv_share **)calloc(size,
+			sizeof(struct cifssrv_share *));
+	index->hashes = (unsigned int *)calloc(size, sizeof(unsigned int));
+	if (!index->slots || !index->hashes) {
+		free(index->slots);
+		free(index->hashes);
+		free(index);
+		return NULL;
+	}
+
+	index->gen = cifssrv_share_gen;
+	index->mask = size - 1;
+	list_for_each(tmp, &cifssrv_share_list) {
+		share = list_entry(tmp, struct cifssrv_share, list);
+		hash = share_name_hash(share->sharename);
+		for (i = hash; index->slots[i & index->mask]; i++)
+			;
+		index->slots[i & index->mask] = share;
+		index->hashes[i & index->mask] = hash;
+	}
+	return index;
+}
+
+static void free_share_index(struct share_index *index)
+{
+	if (!index)
+		return;
+	free(index->slots);
+	free(index->hashes);
+	free(index);
+}
+
+/**
+ * update_share_index() - rebuild the share index if the share list changed
+ *
+ * The new index is fully built before it replaces the old one, so a
+ * lookup sees either the old or the new table, never a partial one.
+ */
+void update_share_index(void)
+{
+	struct share_index *index, *old;
+
+	if (share_index && share_index->gen == cifssrv_share_gen)
+		return;
+
+	index = build_share_index();
+	if (!index) {
+		cifssrv_err("failed to build share index\n");
+		return;
+	}
+
+	old = __atomic_exchange_n(&share_index, index, __ATOMIC_ACQ_REL);
+	free_share_index(old);
+}
+
+/**
+ * lookup_share() - find a share by name, ignoring case
+ * @name:	share name to look up
+ *
+ * Return:	matching share, or NULL if there is none
+ */
+struct cifssrv_share *lookup_share(const char *name)
+{
+	struct share_index *index;
+	struct share_neg_entry *neg;
+	struct cifssrv_share *share;
+	unsigned int hash, i;
+
+	update_share_index();
+	index = __atomic_load_n(&share_index, __ATOMIC_ACQUIRE);
+	if (!index)
+		return NULL;
+
+	hash = share_name_hash(name);
+	neg = &index->neg[hash % SHARE_NEG_CACHE_SIZE];
+	if (neg->hash == hash && !strcasecmp(neg->name, name))
+		return NULL;
+
+	for (i = hash; (share = index->slots[i & index->mask]); i++) {
+		if (index->hashes[i & index->mask] == hash &&
+				!strcasecmp(share->sharename, name))
+			return share;
+	}
+
+	if (strlen(name) < SHARE_MAX_NAME_LEN) {
+		neg->hash = hash;
+		strcpy(neg->name, name);
+	}
+	return NULL;
+}
+
 /**
  * add_new_share() - add newly allocated share in global share list
  * @sharename:	share name string
  * @comment:	comment decribing share
+ * @path:	share path on local filesystem
  */
-static void add_new_share(char *sharename, char *comment)
+static void add_new_share(char *sharename, char *comment, char *path)
 {
 	struct cifssrv_share *share;
 
@@ -158,11 +506,19 @@ static void add_new_share(char *sharename, char *comment)
 	if (sharename)
 		memcpy(share->sharename, sharename, strlen(sharename));
 
-	if (share->config.comment)
+	if (share->config.comment && comment)
 		memcpy(share->config.comment, comment, strlen(comment));
 
+	if (path)
+		share->path = strdup(path);
+
+	/* encode for the common codepage up front, others on first use */
+	if (IS_ERR(get_share_utf16(share, CIFSSRV_DEFAULT_CODEPAGE)))
+		cifssrv_err("failed to encode share %s\n", share->sharename);
+
 	list_add(&share->list, &cifssrv_share_list);
 	cifssrv_num_shares++;
+	cifssrv_share_gen++;
 }
 
 /**
@@ -177,10 +533,40 @@ static void exit_share_config(void)
 		share = list_entry(tmp, struct cifssrv_share, list);
 		list_del(&share->list);
 		cifssrv_num_shares--;
+		free_share_utf16(share);
 		free(share->config.comment);
 		free(share->sharename);
+		free(share->path);
 		free(share);
 	}
+	cifssrv_share_gen++;
+
+	free_share_index(share_index);
+	share_index = NULL;
+}
+
+/**
+ * set_netbios_name() - set netbios name of the server
+ * @name:	configured name, or NULL to use the host name
+ *
+ * The name is upper cased and cut at the first dot and at 15 characters.
+ */
+static void set_netbios_name(char *name)
+{
+	char host[256];
+	int i;
+
+	if (!name) {
+		if (gethostname(host, sizeof(host) - 1))
+			strcpy(host, STR_SRV_NAME);
+		host[sizeof(host) - 1] = '\0';
+		name = host;
+	}
+
+	for (i = 0; i < MAX_NETBIOS_NAME_LEN - 1 && name[i] &&
+			name[i] != '.'; i++)
+		netbios_name[i] = toupper(name[i]);
+	netbios_name[i] = '\0';
 }
 
 /**
@@ -190,9 +576,11 @@ static void exit_share_config(void)
 static void init_share_config(void)
 {
 	INIT_LIST_HEAD(&cifssrv_share_list);
-	add_new_share(STR_IPC, "IPC$ share");
+	add_new_share(STR_IPC, "IPC$ share", NULL);
 	strncpy(workgroup, STR_WRKGRP, strlen(STR_WRKGRP));
 	strncpy(server_string, STR_SRV_NAME, strlen(STR_SRV_NAME));
+	set_netbios_name(NULL);
+	cifssrv_global_gen++;
 }
 
 /**
@@ -208,6 +596,7 @@ static void parse_global_config(char *src)
 	char *val;
 	char *sstring = NULL;
 	char *workgrp = NULL;
+	char *nbname = NULL;
 
 	if (!src)
 		return;
@@ -228,6 +617,11 @@ static void parse_global_config(char *src)
 			if (val)
 				workgrp = val + 2;
 		}
+		else if (!strncasecmp("netbios name =", conf, 14)) {
+			val = strchr(conf, '=');
+			if (val)
+				nbname = val + 2;
+		}
 	}while((conf = strtok(NULL, "<")));
 
 	if (sstring)
@@ -236,13 +630,19 @@ static void parse_global_config(char *src)
 	if (workgrp)
 		strncpy(workgroup, workgrp, MAX_SERVER_WRKGRP_LEN - 1);
 
+	if (nbname)
+		set_netbios_name(nbname);
+
+	if (sstring || workgrp || nbname)
+		cifssrv_global_gen++;
+
 out:
 	free(tmp);
 }
 
 /**
- * parse_share_config() - parse share config entry for sharename and
- *			comment for dcerpc
+ * parse_share_config() - parse share config entry for sharename,
+ *			comment and path for dcerpc
  *
  * @src:	source string to be scanned
  */
@@ -254,6 +654,7 @@ static void parse_share_config(char *src)
 	char *val;
 	char *sharename = NULL;
 	char *comment = NULL;
+	char *path = NULL;
 
 	if (!src)
 		return;
@@ -281,10 +682,15 @@ static void parse_share_config(char *src)
 			if (val)
 				comment = val + 2;
 		}
+		else if (!strncasecmp("path =", conf, 6)) {
+			val = strchr(conf, '=');
+			if (val)
+				path = val + 2;
+		}
 	}while((conf = strtok(NULL, "<")));
 
 	if (sharename)
-		add_new_share(sharename, comment);
+		add_new_share(sharename, comment, path);
 
 out:
 	free(tmp);
@@ -583,12 +989,14 @@ int main(int argc, char**argv)
 {
 	char *cifspwd = PATH_PWDDB;
 	char *cifsconf = PATH_SHARECONF;
+	char *cifsreg = NULL;
+	char *cifsreg_import = NULL;
 	int c;
 	int ret;
 
 	/* Parse the command line options and arguments. */
 	opterr = 0;
-	while ((c = getopt(argc, argv, "c:i:vh")) != EOF)
+	while ((c = getopt(argc, argv, "c:i:r:R:vh")) != EOF)
 		switch (c) {
 		case 'c':
 			cifsconf = strdup(optarg);
@@ -596,6 +1004,12 @@ int main(int argc, char**argv)
 		case 'i':
 			cifspwd = strdup(optarg);
 			break;
+		case 'r':
+			cifsreg = strdup(optarg);
+			break;
+		case 'R':
+			cifsreg_import = strdup(optarg);
+			break;
 		case 'v':
 			if (argc <= 2) {
 				printf("[option] needed with verbose\n");
@@ -621,12 +1035,37 @@ int main(int argc, char**argv)
 	if (ret != CIFS_SUCCESS)
 		goto out;
 
+	update_share_index();
+
+	/* winreg keys, in memory only unless -r names a registry file */
+	ret = cifssrv_init_registry(cifsreg);
+	if (ret) {
+		cifssrv_err("failed to load registry %s: %d\n",
+				cifsreg ? cifsreg : "(in memory)", ret);
+		goto out;
+	}
+
+	/* provisioned keys, lines that cannot be imported are skipped */
+	if (cifsreg_import) {
+		ret = cifssrv_import_registry(cifsreg_import);
+		if (ret == -ENOMEM)
+			goto out;
+		if (ret)
+			cifssrv_err("failed to import registry file %s: %d\n",
+					cifsreg_import, ret);
+	}
+
 	//cifssrv_debug("cifssrvd version : %d\n", cifssrvd_version);
 
 	/* netlink communication loop */
 	cifssrvd_netlink_setup();
 
 	exit_share_config();
+	exit_user_config();
+	exit_conversion();
+	exit_ntlmssp();
+	exit_dcerpc();
+	cifssrv_free_registry();
 
 out:
 	cifssrv_debug("cifssrvd terminated\n");
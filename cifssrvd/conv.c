@@ -24,6 +24,12 @@
 #include "ntlmssp.h"
 #include <stdlib.h>
 #include <time.h>
+#include <sys/syscall.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define COPY_UCS2_CHAR(dest, src) (((unsigned char *)(dest))[0] =\
 		((unsigned char *)(src))[0], ((unsigned char *)(dest))[1] =\
@@ -45,20 +51,133 @@ size_t strlen_w(const unsigned short *src)
 	return len;
 }
 
-void get_random_bytes(void *buf, size_t bytes)
+/*
+ * Server challenges take their bytes from a per-thread pool filled from
+ * getrandom(2) in bulk, so a challenge costs a memcpy rather than a
+ * system call. Bytes are wiped from the pool once handed out. A forked
+ * child inherits the pool and must not draw from it.
+ */
+#define RANDOM_POOL_SIZE	512
+
+static __thread struct random_pool {
+	unsigned char	buf[RANDOM_POOL_SIZE];
+	int		avail;	/* unused bytes at the end of buf */
+} random_pool;
+
+/**
+ * fill_random() - read bytes from the kernel random source
+ * @buf:	buffer to fill
+ * @bytes:	number of bytes
+ *
+ * Falls back to /dev/urandom when getrandom(2) is not available.
+ *
+ * Return:	0 on success, otherwise error number
+ */
+static int fill_random(void *buf, size_t bytes)
 {
-	int i;
-	char *ch = (char*) buf;
+	char *p = buf;
+	ssize_t ret;
+	int fd;
+
+#ifdef SYS_getrandom
+	while (bytes) {
+		ret = syscall(SYS_getrandom, p, bytes, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS)
+				break;
+			return -errno;
+		}
+		p += ret;
+		bytes -= ret;
+	}
+	if (!bytes)
+		return 0;
+#endif
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0)
+		return -errno;
 
-	srand(time(NULL));
-	for (i = 0; i < bytes; i++)
-		ch[i] = rand()%127;
+	while (bytes) {
+		ret = read(fd, p, bytes);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			close(fd);
+			return -EIO;
+		}
+		p += ret;
+		bytes -= ret;
+	}
+	close(fd);
+	return 0;
 }
 
-static iconv_t init_conversion(const char *codepage, int fromUTF16)
+/**
+ * get_random_bytes() - get cryptographically strong random bytes
+ * @buf:	buffer to fill
+ * @bytes:	number of bytes
+ *
+ * Return:	0 on success, otherwise error number
+ */
+int get_random_bytes(void *buf, size_t bytes)
+{
+	struct random_pool *pool = &random_pool;
+	unsigned char *src;
+	int ret;
+
+	/* large requests would just drain the pool */
+	if (bytes > RANDOM_POOL_SIZE / 4)
+		return fill_random(buf, bytes);
+
+	if (pool->avail < bytes) {
+		ret = fill_random(pool->buf, RANDOM_POOL_SIZE);
+		if (ret) {
+			pool->avail = 0;
+			cifssrv_err("failed to read random bytes %d\n", ret);
+			return ret;
+		}
+		pool->avail = RANDOM_POOL_SIZE;
+	}
+
+	src = pool->buf + RANDOM_POOL_SIZE - pool->avail;
+	memcpy(buf, src, bytes);
+	memset(src, 0, bytes);
+	pool->avail -= bytes;
+	return 0;
+}
+
+/*
+ * iconv_open() is expensive, so opened descriptors are kept in a small
+ * per-thread cache keyed by codepage and direction. A failed open is
+ * cached as well, so an unknown codepage is not retried on every string.
+ */
+#define CONV_CACHE_SIZE	8
+
+struct conv_cache_entry {
+	char	codepage[CIFSSRV_CODEPAGE_LEN];
+	int	fromUTF16;
+	int	ucs2;		/* UTF16LE was not available, UCS-2LE used */
+	iconv_t	conv;
+};
+
+static __thread struct conv_cache_entry conv_cache[CONV_CACHE_SIZE];
+static __thread int conv_cache_used;
+static __thread int conv_cache_victim;
+static __thread struct conv_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} conv_stats;
+
+static iconv_t open_conversion(const char *codepage, int fromUTF16,
+		int *ucs2)
 {
 	iconv_t conv;
 
+	*ucs2 = 0;
 	if (fromUTF16)
 		conv = iconv_open(codepage, "UTF16LE");
 	else
@@ -77,6 +196,7 @@ static iconv_t init_conversion(const char *codepage, int fromUTF16)
 						errno, codepage);
 				return (iconv_t) -1;
 			}
+			*ucs2 = 1;
 		} else {
 			cifssrv_err("failed to open conversion for"
 					" UTF16LE to %s\n", codepage);
@@ -86,9 +206,169 @@ static iconv_t init_conversion(const char *codepage, int fromUTF16)
 	return conv;
 }
 
-static void close_conversion(iconv_t conv)
+/**
+ * init_conversion() - get a conversion descriptor from the cache
+ * @codepage:	character codepage of the client
+ * @fromUTF16:	1 to convert from UTF-16LE, 0 to convert to UTF-16LE
+ *
+ * The returned descriptor stays owned by the cache, callers must not
+ * close it. It is reset to the initial shift state before returning.
+ *
+ * Return:	conversion descriptor, or (iconv_t)-1 on failure
+ */
+static iconv_t init_conversion(const char *codepage, int fromUTF16)
+{
+	struct conv_cache_entry *entry;
+	int i;
+
+	for (i = 0; i < conv_cache_used; i++) {
+		entry = &conv_cache[i];
+		if (entry->fromUTF16 == fromUTF16 &&
+				!strcmp(entry->codepage, codepage)) {
+			conv_stats.hits++;
+			if (entry->conv != (iconv_t)-1)
+				iconv(entry->conv, NULL, NULL, NULL, NULL);
+			return entry->conv;
+		}
+	}
+
+	conv_stats.misses++;
+	if (conv_cache_used < CONV_CACHE_SIZE) {
+		entry = &conv_cache[conv_cache_used++];
+	} else {
+		entry = &conv_cache[conv_cache_victim];
+		conv_cache_victim = (conv_cache_victim + 1) % CONV_CACHE_SIZE;
+		if (entry->conv != (iconv_t)-1)
+			iconv_close(entry->conv);
+		conv_stats.evictions++;
+	}
+
+	strncpy(entry->codepage, codepage, CIFSSRV_CODEPAGE_LEN - 1);
+	entry->codepage[CIFSSRV_CODEPAGE_LEN - 1] = '\0';
+	entry->fromUTF16 = fromUTF16;
+	entry->conv = open_conversion(codepage, fromUTF16, &entry->ucs2);
+	if (entry->ucs2)
+		cifssrv_debug("using UCS-2LE conversion for %s\n", codepage);
+	return entry->conv;
+}
+
+/**
+ * exit_conversion() - close cached conversion descriptors of this thread
+ */
+void exit_conversion(void)
+{
+	int i;
+
+	cifssrv_debug("iconv cache hits %lu misses %lu evictions %lu\n",
+			conv_stats.hits, conv_stats.misses,
+			conv_stats.evictions);
+
+	for (i = 0; i < conv_cache_used; i++) {
+		if (conv_cache[i].conv != (iconv_t)-1)
+			iconv_close(conv_cache[i].conv);
+	}
+	conv_cache_used = 0;
+	conv_cache_victim = 0;
+}
+
+
+/*
+ * Share, registry and netbios names are nearly always plain ASCII, which
+ * maps 1:1 onto UTF-16LE code units. ascii_to_utf16() and utf16_to_ascii()
+ * convert such strings directly, vectorized when SSE2/AVX2 is available,
+ * and report failure as soon as a non-ASCII character shows up so that
+ * the caller can hand the whole string to iconv instead.
+ */
+
+/**
+ * ascii_to_utf16() - widen an ASCII string to UTF-16LE
+ * @dst:	destination buffer of at least 2 * @len bytes
+ * @src:	source string
+ * @len:	number of bytes in @src
+ *
+ * Return:	1 if @src was pure ASCII and got converted, otherwise 0
+ */
+static int ascii_to_utf16(char *dst, const char *src, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+
+		if (_mm256_movemask_epi8(v))
+			return 0;
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i),
+			_mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i + 32),
+			_mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i zero = _mm_setzero_si128();
+
+		if (_mm_movemask_epi8(v))
+			return 0;
+		_mm_storeu_si128((__m128i *)(dst + 2 * i),
+				_mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i + 16),
+				_mm_unpackhi_epi8(v, zero));
+	}
+#endif
+	for (; i < len; i++) {
+		if ((unsigned char)src[i] & 0x80)
+			return 0;
+		dst[2 * i] = src[i];
+		dst[2 * i + 1] = 0;
+	}
+	return 1;
+}
+
+/**
+ * utf16_to_ascii() - narrow an UTF-16LE string holding only ASCII
+ * @dst:	destination buffer of at least @len bytes
+ * @src:	source UTF-16LE string, need not be aligned
+ * @len:	number of UTF-16 code units in @src
+ *
+ * Return:	1 if @src was pure ASCII and got converted, otherwise 0
+ */
+static int utf16_to_ascii(char *dst, const char *src, size_t len)
 {
-	iconv_close(conv);
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+		/* values above 0x7fff saturate to 0, so test the sign bits too */
+		__m256i p = _mm256_packus_epi16(a, b);
+
+		if (_mm256_movemask_epi8(_mm256_or_si256(p,
+					_mm256_or_si256(a, b))))
+			return 0;
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				_mm256_permute4x64_epi64(p, 0xd8));
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+		__m128i p = _mm_packus_epi16(a, b);
+
+		if (_mm_movemask_epi8(_mm_or_si128(p, _mm_or_si128(a, b))))
+			return 0;
+		_mm_storeu_si128((__m128i *)(dst + i), p);
+	}
+#endif
+	for (; i < len; i++) {
+		if (src[2 * i + 1] || ((unsigned char)src[2 * i] & 0x80))
+			return 0;
+		dst[i] = src[2 * i];
+	}
+	return 1;
 }
 
 char *smb_strndup_from_utf16(char *src, const int maxlen,
@@ -101,27 +381,35 @@ char *smb_strndup_from_utf16(char *src, const int maxlen,
 	srclen = maxlen;
 
 	if (is_unicode) {
+		dst = (char*) malloc(maxlen + 1);
+		if (!dst)
+			return ERR_PTR(-ENOMEM);
+		if (utf16_to_ascii(dst, src, maxlen)) {
+			dst[maxlen] = '\0';
+			return dst;
+		}
+		free(dst);
+
 		srclen = maxlen * 2;
 		conv = init_conversion(codepage, 1);
 		if (conv == (iconv_t) -1)
 			return ERR_PTR(-EINVAL);
 
+		/* terminated like the fast path, @src need not end in a NUL */
 		dstlen = UNICODE_LEN(srclen);
-		dst = (char*) malloc(dstlen);
-		if (!dst) {
-			close_conversion(conv);
+		dst = (char*) malloc(dstlen + 1);
+		if (!dst)
 			return ERR_PTR(-ENOMEM);
-		}
+
 		start_dst = dst;
 		ret = iconv(conv, &src, &srclen, &dst, &dstlen);
 		if (ret == -1) {
 			cifssrv_err("Error in conversion of string, errno %d\n",
 					errno);
 			free(start_dst);
-			close_conversion(conv);
 			return ERR_PTR(-EINVAL);
 		}
-		close_conversion(conv);
+		*dst = '\0';
 		dst = start_dst;
 	} else {
 		dstlen = strnlen(src, srclen);
@@ -143,7 +431,10 @@ int smbConvertToUTF16(__le16 *target, char *source, int slen,
 	char *tmp = (char*) target;
 
 	srclen = slen;
-	dstlen = targetlen;	
+	dstlen = targetlen;
+
+	if (srclen * 2 <= dstlen && ascii_to_utf16(tmp, source, srclen))
+		return 0;
 
 	conv = init_conversion(codepage, 0);
 	if (conv == (iconv_t) -1)
@@ -152,82 +443,205 @@ int smbConvertToUTF16(__le16 *target, char *source, int slen,
 	ret = iconv(conv, &source, &srclen, &tmp, &dstlen);
 	if (ret == -1) {
 		cifssrv_err("Error in conversion of string\n");
-		close_conversion(conv);
 		return -EINVAL;
 	}
-	close_conversion(conv);	
 	return 0;
 }
 
 /**
- * build_ntlmssp_challenge_blob() - helper function to construct challenge blob
- * @chgblob:	challenge blob source pointer to initialize
+ * smb_utf16_encode() - allocate an UTF-16LE copy of a string
+ * @src:	NUL terminated source string
+ * @codepage:	character codepage of @src
+ * @len:	returns encoded length in UTF-16 code units, including NUL
+ *
+ * Return:	allocated UTF-16LE string on success, otherwise error pointer
+ */
+__le16 *smb_utf16_encode(char *src, const char *codepage, int *len)
+{
+	iconv_t conv;
+	size_t ret;
+	size_t srclen, dstlen, bufsize;
+	__le16 *target;
+	char *tmp;
+
+	srclen = strlen(src);
+	/* every source byte yields at most one UTF-16 code unit */
+	bufsize = (srclen + 1) * sizeof(__le16);
+	target = (__le16 *)calloc(1, bufsize);
+	if (!target)
+		return ERR_PTR(-ENOMEM);
+
+	if (ascii_to_utf16((char *)target, src, srclen)) {
+		*len = srclen + 1;
+		return target;
+	}
+
+	conv = init_conversion(codepage, 0);
+	if (conv == (iconv_t) -1) {
+		free(target);
+		return ERR_PTR(-EINVAL);
+	}
+
+	tmp = (char *)target;
+	dstlen = bufsize - sizeof(__le16);
+	ret = iconv(conv, &src, &srclen, &tmp, &dstlen);
+	if (ret == -1) {
+		cifssrv_err("Error in conversion of string, errno %d\n", errno);
+		free(target);
+		return ERR_PTR(-EINVAL);
+	}
+
+	*len = (tmp - (char *)target) / sizeof(__le16) + 1;
+	return target;
+}
+
+/*
+ * CHALLENGE_MESSAGE with everything but the server challenge filled in,
+ * one per client codepage. It only depends on the netbios name, so it is
+ * rebuilt when cifssrv_global_gen moves on.
+ */
+struct ntlmssp_template {
+	struct list_head list;
+	char codepage[CIFSSRV_CODEPAGE_LEN];
+	unsigned int gen;
+	unsigned int len;
+	char blob[0];
+};
+
+static LIST_HEAD(ntlmssp_templates);
+
+/**
+ * ntlmssp_build_template() - encode challenge message for a codepage
  * @codepage:	character codepage type
  *
+ * Return:	template on success, otherwise error pointer
  */
-unsigned int build_ntlmssp_challenge_blob(CHALLENGE_MESSAGE *chgblob, char *codepage)
+static struct ntlmssp_template *ntlmssp_build_template(const char *codepage)
 {
+	struct ntlmssp_template *tmpl;
+	CHALLENGE_MESSAGE *chgblob;
 	TargetInfo *tinfo;
-	__le16 name[8];
-	__u8 *target_name;
-	unsigned int len, flags, blob_len, type;
-	char cryptkey[CIFS_CRYPTO_KEY_SIZE] = {0};
-	int ret;
+	__le16 *name;
+	unsigned int len, flags, blob_len, info_len, type;
+	int units;
+
+	name = smb_utf16_encode(netbios_name, codepage, &units);
+	if (IS_ERR(name))
+		return (struct ntlmssp_template *)name;
+	len = (units - 1) * sizeof(__le16);
+
+	/* four name pairs and the terminator */
+	info_len = 4 * (sizeof(TargetInfo) + len) + sizeof(TargetInfo);
+	blob_len = sizeof(CHALLENGE_MESSAGE) + len + info_len;
+	tmpl = calloc(1, sizeof(struct ntlmssp_template) + blob_len);
+	if (!tmpl) {
+		free(name);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	strncpy(tmpl->codepage, codepage, CIFSSRV_CODEPAGE_LEN - 1);
+	tmpl->gen = cifssrv_global_gen;
+	tmpl->len = blob_len;
+	chgblob = (CHALLENGE_MESSAGE *)tmpl->blob;
 
 	memcpy(chgblob->Signature, NTLMSSP_SIGNATURE, 8);
-	chgblob->MessageType = NtLmChallenge;
+	chgblob->MessageType = cpu_to_le32(NtLmChallenge);
 
 	flags = NTLMSSP_NEGOTIATE_UNICODE | NTLMSSP_REQUEST_TARGET |
 		NTLMSSP_NEGOTIATE_NTLM | NTLMSSP_TARGET_TYPE_SERVER |
 		NTLMSSP_NEGOTIATE_TARGET_INFO |
 		NTLMSSP_NEGOTIATE_128 | NTLMSSP_NEGOTIATE_56;
-
 	chgblob->NegotiateFlags = cpu_to_le32(flags);
 
-	ret = smbConvertToUTF16(name, netbios_name, strlen(netbios_name), 8,
-			codepage);
-	if (ret < 0 )
-		return -EINVAL;
-
-	len = strlen_w(name) * sizeof(__le16);
 	chgblob->TargetName.Length = cpu_to_le16(len);
 	chgblob->TargetName.MaximumLength = cpu_to_le16(len);
 	chgblob->TargetName.BufferOffset =
 		cpu_to_le32(sizeof(CHALLENGE_MESSAGE));
+	memcpy(tmpl->blob + sizeof(CHALLENGE_MESSAGE), name, len);
 
-	/* Initialize random server challenge */
-	get_random_bytes(cryptkey, sizeof(__u64));
-	memcpy(chgblob->Challenge, cryptkey,
-			CIFS_CRYPTO_KEY_SIZE);
-
-	/* Add Target Information to security buffer */
-	chgblob->TargetInfoArray.BufferOffset =
-		chgblob->TargetName.BufferOffset + len;
-
-	target_name = (__u8 *)chgblob + chgblob->TargetName.BufferOffset;
-	memcpy(target_name, name, len);
-	blob_len = cpu_to_le16(sizeof(CHALLENGE_MESSAGE) + len);
-	tinfo = (TargetInfo *)(target_name + len);
-
-	chgblob->TargetInfoArray.Length = 0;
 	/* Add target info list for NetBIOS/DNS settings */
+	chgblob->TargetInfoArray.Length = cpu_to_le16(info_len);
+	chgblob->TargetInfoArray.MaximumLength = cpu_to_le16(info_len);
+	chgblob->TargetInfoArray.BufferOffset =
+		cpu_to_le32(sizeof(CHALLENGE_MESSAGE) + len);
+	tinfo = (TargetInfo *)(tmpl->blob + sizeof(CHALLENGE_MESSAGE) + len);
 	for (type = NTLMSSP_AV_NB_COMPUTER_NAME;
 			type <= NTLMSSP_AV_DNS_DOMAIN_NAME; type++) {
-		tinfo->Type = type;
-		tinfo->Length = len;
+		tinfo->Type = cpu_to_le16(type);
+		tinfo->Length = cpu_to_le16(len);
 		memcpy(tinfo->Content, name, len);
-		tinfo = (TargetInfo *)((char *)tinfo + 4 + len);
-		chgblob->TargetInfoArray.Length += cpu_to_le16(4 + len);
+		tinfo = (TargetInfo *)((char *)tinfo + sizeof(TargetInfo) +
+				len);
 	}
+	/* terminator subblock is already zeroed */
 
-	/* Add terminator subblock */
-	tinfo->Type = 0;
-	tinfo->Length = 0;
-	chgblob->TargetInfoArray.Length += cpu_to_le16(4);
+	free(name);
+	cifssrv_debug("NTLMSSP challenge template for %s, %u bytes\n",
+			codepage, blob_len);
+	return tmpl;
+}
 
-	chgblob->TargetInfoArray.MaximumLength =
-		chgblob->TargetInfoArray.Length;
-	blob_len += chgblob->TargetInfoArray.Length;
-	cifssrv_debug("NTLMSSP SecurityBufferLength %d\n", blob_len);
-	return blob_len;
+/**
+ * build_ntlmssp_challenge_blob() - helper function to construct challenge blob
+ * @codepage:	character codepage type
+ * @len:	returns length of the challenge blob
+ *
+ * Copies the template of @codepage and fills in a fresh server challenge.
+ *
+ * Return:	allocated challenge blob on success, otherwise error pointer
+ */
+CHALLENGE_MESSAGE *build_ntlmssp_challenge_blob(char *codepage,
+		unsigned int *len)
+{
+	struct ntlmssp_template *tmpl = NULL;
+	CHALLENGE_MESSAGE *chgblob;
+	struct list_head *tmp;
+
+	list_for_each(tmp, &ntlmssp_templates) {
+		tmpl = list_entry(tmp, struct ntlmssp_template, list);
+		if (!strcasecmp(tmpl->codepage, codepage))
+			break;
+		tmpl = NULL;
+	}
+
+	if (tmpl && tmpl->gen != cifssrv_global_gen) {
+		list_del(&tmpl->list);
+		free(tmpl);
+		tmpl = NULL;
+	}
+
+	if (!tmpl) {
+		tmpl = ntlmssp_build_template(codepage);
+		if (IS_ERR(tmpl))
+			return (CHALLENGE_MESSAGE *)tmpl;
+		list_add(&tmpl->list, &ntlmssp_templates);
+	}
+
+	chgblob = malloc(tmpl->len);
+	if (!chgblob)
+		return ERR_PTR(-ENOMEM);
+
+	memcpy(chgblob, tmpl->blob, tmpl->len);
+	/* Initialize random server challenge */
+	if (get_random_bytes(chgblob->Challenge, CIFS_CRYPTO_KEY_SIZE)) {
+		free(chgblob);
+		return ERR_PTR(-EIO);
+	}
+	*len = tmpl->len;
+	return chgblob;
+}
+
+/**
+ * exit_ntlmssp() - drop NTLMSSP challenge templates
+ */
+void exit_ntlmssp(void)
+{
+	struct ntlmssp_template *tmpl;
+
+	while (!list_empty(&ntlmssp_templates)) {
+		tmpl = list_entry(ntlmssp_templates.next,
+				struct ntlmssp_template, list);
+		list_del(&tmpl->list);
+		free(tmpl);
+	}
 }
@@ -0,0 +1,313 @@
+/*
+ *   cifssrv-tools/cifssrvd/crypto.c
+ *
+ *   MD5 Message Digest Algorithm (RFC1321), HMAC-MD5 (RFC2104) and the
+ *   RC4 stream cipher, as needed by NTLMSSP session security.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "crypto.h"
+
+/* sine derived additive constants, one per step */
+static const __u32 md5_t[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+/* message word used by each step */
+static const __u8 md5_idx[64] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	1, 6, 11, 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12,
+	5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2,
+	0, 7, 14, 5, 12, 3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9,
+};
+
+#define F1(x, y, z)	(z ^ (x & (y ^ z)))
+#define F2(x, y, z)	F1(z, x, y)
+#define F3(x, y, z)	(x ^ y ^ z)
+#define F4(x, y, z)	(y ^ (x | ~z))
+
+#define MD5STEP(f, w, x, y, z, i, s)					\
+	do {								\
+		w += f(x, y, z) + in[md5_idx[i]] + md5_t[i];		\
+		w = ((w << s) | (w >> (32 - s))) + x;			\
+	} while (0)
+
+/*
+ * Each round is four groups of four steps with fixed rotations; the
+ * loops have constant bounds and unroll into straight line code.
+ */
+static void md5_transform(__u32 *hash, const __u32 *in)
+{
+	__u32 a, b, c, d;
+	int i;
+
+	a = hash[0];
+	b = hash[1];
+	c = hash[2];
+	d = hash[3];
+
+	for (i = 0; i < 16; i += 4) {
+		MD5STEP(F1, a, b, c, d, i, 7);
+		MD5STEP(F1, d, a, b, c, i + 1, 12);
+		MD5STEP(F1, c, d, a, b, i + 2, 17);
+		MD5STEP(F1, b, c, d, a, i + 3, 22);
+	}
+	for (; i < 32; i += 4) {
+		MD5STEP(F2, a, b, c, d, i, 5);
+		MD5STEP(F2, d, a, b, c, i + 1, 9);
+		MD5STEP(F2, c, d, a, b, i + 2, 14);
+		MD5STEP(F2, b, c, d, a, i + 3, 20);
+	}
+	for (; i < 48; i += 4) {
+		MD5STEP(F3, a, b, c, d, i, 4);
+		MD5STEP(F3, d, a, b, c, i + 1, 11);
+		MD5STEP(F3, c, d, a, b, i + 2, 16);
+		MD5STEP(F3, b, c, d, a, i + 3, 23);
+	}
+	for (; i < 64; i += 4) {
+		MD5STEP(F4, a, b, c, d, i, 6);
+		MD5STEP(F4, d, a, b, c, i + 1, 10);
+		MD5STEP(F4, c, d, a, b, i + 2, 15);
+		MD5STEP(F4, b, c, d, a, i + 3, 21);
+	}
+
+	hash[0] += a;
+	hash[1] += b;
+	hash[2] += c;
+	hash[3] += d;
+}
+
+static inline void md5_transform_helper(struct md5_ctx *mctx)
+{
+	int i;
+
+	for (i = 0; i < MD5_BLOCK_WORDS; i++)
+		mctx->block[i] = le32_to_cpu(mctx->block[i]);
+	md5_transform(mctx->hash, mctx->block);
+}
+
+void md5_init(struct md5_ctx *mctx)
+{
+	mctx->hash[0] = 0x67452301;
+	mctx->hash[1] = 0xefcdab89;
+	mctx->hash[2] = 0x98badcfe;
+	mctx->hash[3] = 0x10325476;
+	mctx->byte_count = 0;
+}
+
+void md5_update(struct md5_ctx *mctx, const void *data, unsigned int len)
+{
+	const __u8 *p = data;
+	const unsigned int avail = MD5_BLOCK_SIZE - (mctx->byte_count & 0x3f);
+
+	mctx->byte_count += len;
+
+	if (avail > len) {
+		memcpy((char *)mctx->block + (MD5_BLOCK_SIZE - avail), p, len);
+		return;
+	}
+
+	memcpy((char *)mctx->block + (MD5_BLOCK_SIZE - avail), p, avail);
+	md5_transform_helper(mctx);
+	p += avail;
+	len -= avail;
+
+	while (len >= MD5_BLOCK_SIZE) {
+		memcpy(mctx->block, p, MD5_BLOCK_SIZE);
+		md5_transform_helper(mctx);
+		p += MD5_BLOCK_SIZE;
+		len -= MD5_BLOCK_SIZE;
+	}
+
+	memcpy(mctx->block, p, len);
+}
+
+void md5_final(struct md5_ctx *mctx, __u8 *out)
+{
+	const unsigned int offset = mctx->byte_count & 0x3f;
+	char *p = (char *)mctx->block + offset;
+	int padding = 56 - (offset + 1);
+	int i;
+
+	*p++ = 0x80;
+	if (padding < 0) {
+		memset(p, 0x00, padding + sizeof(__u64));
+		md5_transform_helper(mctx);
+		p = (char *)mctx->block;
+		padding = 56;
+	}
+
+	memset(p, 0, padding);
+	for (i = 0; i < MD5_BLOCK_WORDS - 2; i++)
+		mctx->block[i] = le32_to_cpu(mctx->block[i]);
+	mctx->block[14] = mctx->byte_count << 3;
+	mctx->block[15] = mctx->byte_count >> 29;
+	md5_transform(mctx->hash, mctx->block);
+	for (i = 0; i < MD5_HASH_WORDS; i++)
+		mctx->hash[i] = cpu_to_le32(mctx->hash[i]);
+	memcpy(out, mctx->hash, sizeof(mctx->hash));
+	memset(mctx, 0, sizeof(*mctx));
+}
+
+/**
+ * hmac_md5_setkey() - precompute HMAC-MD5 inner and outer states
+ * @hkey:	key schedule to fill
+ * @key:	HMAC key
+ * @len:	length of the key
+ */
+void hmac_md5_setkey(struct hmac_md5_key *hkey, const __u8 *key,
+		unsigned int len)
+{
+	__u8 pad[MD5_BLOCK_SIZE];
+	__u8 digest[MD5_DIGEST_SIZE];
+	int i;
+
+	if (len > MD5_BLOCK_SIZE) {
+		md5_init(&hkey->inner);
+		md5_update(&hkey->inner, key, len);
+		md5_final(&hkey->inner, digest);
+		key = digest;
+		len = MD5_DIGEST_SIZE;
+	}
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, key, len);
+	for (i = 0; i < MD5_BLOCK_SIZE; i++)
+		pad[i] ^= 0x36;
+	md5_init(&hkey->inner);
+	md5_update(&hkey->inner, pad, MD5_BLOCK_SIZE);
+
+	for (i = 0; i < MD5_BLOCK_SIZE; i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	md5_init(&hkey->outer);
+	md5_update(&hkey->outer, pad, MD5_BLOCK_SIZE);
+
+	memset(pad, 0, sizeof(pad));
+	memset(digest, 0, sizeof(digest));
+}
+
+/**
+ * hmac_md5_init() - start a MAC under a precomputed key
+ * @mctx:	MD5 context to feed the message to with md5_update()
+ * @hkey:	key schedule from hmac_md5_setkey()
+ */
+void hmac_md5_init(struct md5_ctx *mctx, const struct hmac_md5_key *hkey)
+{
+	*mctx = hkey->inner;
+}
+
+/**
+ * hmac_md5_final() - finish a MAC started by hmac_md5_init()
+ * @mctx:	MD5 context the message was fed to
+ * @hkey:	key schedule from hmac_md5_setkey()
+ * @out:	16 byte MAC
+ */
+void hmac_md5_final(struct md5_ctx *mctx, const struct hmac_md5_key *hkey,
+		__u8 *out)
+{
+	__u8 digest[MD5_DIGEST_SIZE];
+
+	md5_final(mctx, digest);
+	*mctx = hkey->outer;
+	md5_update(mctx, digest, MD5_DIGEST_SIZE);
+	md5_final(mctx, out);
+	memset(digest, 0, sizeof(digest));
+}
+
+/**
+ * hmac_md5() - one shot HMAC-MD5
+ * @key:	HMAC key
+ * @key_len:	length of the key
+ * @data:	message
+ * @len:	length of the message
+ * @out:	16 byte MAC
+ */
+void hmac_md5(const __u8 *key, unsigned int key_len, const void *data,
+		unsigned int len, __u8 *out)
+{
+	struct hmac_md5_key hkey;
+	struct md5_ctx mctx;
+
+	hmac_md5_setkey(&hkey, key, key_len);
+	hmac_md5_init(&mctx, &hkey);
+	md5_update(&mctx, data, len);
+	hmac_md5_final(&mctx, &hkey, out);
+	memset(&hkey, 0, sizeof(hkey));
+}
+
+void arc4_setkey(struct arc4_ctx *ctx, const __u8 *key, unsigned int len)
+{
+	__u8 j = 0, a;
+	int i;
+
+	ctx->x = 0;
+	ctx->y = 0;
+
+	for (i = 0; i < 256; i++)
+		ctx->S[i] = i;
+
+	for (i = 0; i < 256; i++) {
+		a = ctx->S[i];
+		j += a + key[i % len];
+		ctx->S[i] = ctx->S[j];
+		ctx->S[j] = a;
+	}
+}
+
+/**
+ * arc4_crypt() - encrypt or decrypt a buffer in place
+ * @ctx:	cipher state, carried over to the next call
+ * @buf:	data
+ * @len:	length of data
+ *
+ * The key stream depends on the previous byte of state, so this is a
+ * strictly serial loop; the state is kept in locals for its duration.
+ */
+void arc4_crypt(struct arc4_ctx *ctx, __u8 *buf, unsigned int len)
+{
+	__u8 *S = ctx->S;
+	__u8 x = ctx->x;
+	__u8 y = ctx->y;
+	__u8 a, b;
+
+	while (len--) {
+		x++;
+		a = S[x];
+		y += a;
+		b = S[y];
+		S[x] = b;
+		S[y] = a;
+		*buf++ ^= S[(__u8)(a + b)];
+	}
+
+	ctx->x = x;
+	ctx->y = y;
+}
@@ -0,0 +1,66 @@
+/*
+ *   cifssrv-tools/cifssrvd/crypto.h
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSSRV_CRYPTO_H
+#define __CIFSSRV_CRYPTO_H
+
+#include "cifssrv.h"
+
+#define MD5_DIGEST_SIZE		16
+#define MD5_BLOCK_WORDS		16
+#define MD5_HASH_WORDS		4
+#define MD5_BLOCK_SIZE		(MD5_BLOCK_WORDS * 4)
+
+struct md5_ctx {
+	__u32 hash[MD5_HASH_WORDS];
+	__u32 block[MD5_BLOCK_WORDS];
+	__u64 byte_count;
+};
+
+/*
+ * HMAC key schedule. The inner and outer states are MD5 contexts that
+ * already absorbed the padded key, so a MAC under a long lived key costs
+ * no compressions for the key itself.
+ */
+struct hmac_md5_key {
+	struct md5_ctx inner;
+	struct md5_ctx outer;
+};
+
+struct arc4_ctx {
+	__u8 S[256];
+	__u8 x;
+	__u8 y;
+};
+
+void md5_init(struct md5_ctx *mctx);
+void md5_update(struct md5_ctx *mctx, const void *data, unsigned int len);
+void md5_final(struct md5_ctx *mctx, __u8 *out);
+
+void hmac_md5_setkey(struct hmac_md5_key *hkey, const __u8 *key,
+		unsigned int len);
+void hmac_md5_init(struct md5_ctx *mctx, const struct hmac_md5_key *hkey);
+void hmac_md5_final(struct md5_ctx *mctx, const struct hmac_md5_key *hkey,
+		__u8 *out);
+void hmac_md5(const __u8 *key, unsigned int key_len, const void *data,
+		unsigned int len, __u8 *out);
+
+void arc4_setkey(struct arc4_ctx *ctx, const __u8 *key, unsigned int len);
+void arc4_crypt(struct arc4_ctx *ctx, __u8 *buf, unsigned int len);
+
+#endif /* __CIFSSRV_CRYPTO_H */
@@ -22,6 +22,8 @@
 #include"dcerpc.h"
 #include"winreg.h"
 #include"ntlmssp.h"
+#include"ndr.h"
+#include"netlink.h"
 
 struct cifssrv_pipe_table cifssrv_pipes[] = {
 	{"\\srvsvc", SRVSVC},
@@ -33,6 +35,29 @@ struct cifssrv_pipe_table cifssrv_pipes[] = {
 };
 unsigned int npipes = sizeof(cifssrv_pipes)/sizeof(cifssrv_pipes[0]);
 
+/* NetrWkstaGetInfo responses, one per client codepage */
+static LIST_HEAD(wkssvc_rsp_cache);
+
+/*
+ * NetShareEnum data of one info level, rebuilt when the share list
+ * changes. The entries are followed by their strings in share order, and
+ * string offsets are kept relative to the start of the strings. So the
+ * first n entries and the strings they refer to are both prefixes, and
+ * a truncated response only needs its offsets moved.
+ */
+struct rap_share_enum {
+	int valid;
+	unsigned int gen;
+	int num_entries;
+	int entry_size;
+	char *entries;
+	char *strings;
+	/* end of the strings of each entry */
+	int *str_end;
+};
+
+static struct rap_share_enum rap_share_enum[INFO_2 + 1];
+
 /**
  * get_pipe_type() - get the type of the pipe from the string name
  * @name:      string name for representation of pipe, need to be searched
@@ -54,30 +79,400 @@ unsigned int get_pipe_type(char *pipename)
 	return pipetype;
 }
 
+/*
+ * Requests larger than the client's max_xmit_frag arrive as several
+ * RPC_REQUEST fragments, one per pipe write. Fragments of a call are
+ * collected in a per-pipe buffer and the request handler only runs once
+ * the LAST fragment is in. Memory is bounded per request and across all
+ * pipes, so a client cannot make the daemon grow without limit.
+ */
+static struct {
+	unsigned long	reassembled;	/* requests completed from fragments */
+	unsigned long	fragments;	/* fragments received */
+	unsigned long	dropped;	/* partial requests thrown away */
+	unsigned long	oversize;	/* requests refused for size */
+	unsigned long	bytes;		/* reassembly memory in use */
+	unsigned long	peak_bytes;
+} rpc_frag_stats;
+
+/**
+ * rpc_frag_release() - drop partial request reassembled on a pipe
+ * @pipe:	pipe to release reassembly buffer of
+ */
+void rpc_frag_release(struct cifssrv_pipe *pipe)
+{
+	if (!pipe->frag_buf)
+		return;
+
+	rpc_frag_stats.bytes -= pipe->frag_size;
+	free(pipe->frag_buf);
+	pipe->frag_buf = NULL;
+	pipe->frag_len = 0;
+	pipe->frag_size = 0;
+}
+
+/**
+ * rpc_frag_reserve() - make room for more request data on a pipe
+ * @pipe:	pipe reassembling a request
+ * @size:	total request size needed
+ *
+ * Return:      0 on success, otherwise error number
+ */
+static int rpc_frag_reserve(struct cifssrv_pipe *pipe, int size)
+{
+	char *buf;
+	int new_size = pipe->frag_size;
+
+	if (size <= pipe->frag_size)
+		return 0;
+
+	if (size > RPC_MAX_REQ_SIZE) {
+		rpc_frag_stats.oversize++;
+		cifssrv_err("rpc request of %d bytes is too large\n", size);
+		return -E2BIG;
+	}
+
+	/* alloc_hint normally sized the buffer, grow if it was too small */
+	while (new_size < size)
+		new_size = new_size ? new_size * 2 : size;
+	if (new_size > RPC_MAX_REQ_SIZE)
+		new_size = RPC_MAX_REQ_SIZE;
+
+	if (rpc_frag_stats.bytes + new_size - pipe->frag_size >
+			RPC_MAX_FRAG_TOTAL) {
+		rpc_frag_stats.oversize++;
+		cifssrv_err("rpc reassembly memory exhausted (%lu bytes)\n",
+				rpc_frag_stats.bytes);
+		return -ENOMEM;
+	}
+
+	buf = realloc(pipe->frag_buf, new_size);
+	if (!buf)
+		return -ENOMEM;
+
+	rpc_frag_stats.bytes += new_size - pipe->frag_size;
+	if (rpc_frag_stats.bytes > rpc_frag_stats.peak_bytes)
+		rpc_frag_stats.peak_bytes = rpc_frag_stats.bytes;
+	pipe->frag_buf = buf;
+	pipe->frag_size = new_size;
+	return 0;
+}
+
+/**
+ * rpc_stub_len() - get length of stub data in a request pdu
+ * @req:	RPC request pdu, frag_len already checked against the buffer
+ *
+ * Return:      stub data length, or -EINVAL if the auth trailer does not fit
+ */
+static int rpc_stub_len(RPC_REQUEST_REQ *req)
+{
+	RPC_AUTH_INFO *auth;
+	int stub_len;
+
+	stub_len = req->hdr.frag_len - sizeof(RPC_REQUEST_REQ);
+	if (req->hdr.auth_len) {
+		if (req->hdr.auth_len + sizeof(RPC_AUTH_INFO) > stub_len)
+			return -EINVAL;
+		auth = (RPC_AUTH_INFO *)((char *)req + req->hdr.frag_len -
+				req->hdr.auth_len - sizeof(RPC_AUTH_INFO));
+		stub_len -= req->hdr.auth_len + sizeof(RPC_AUTH_INFO) +
+				auth->auth_pad_len;
+	}
+	return stub_len < 0 ? -EINVAL : stub_len;
+}
+
+/**
+ * rpc_auth_required() - check if pdus on the pipe are signed or sealed
+ * @pipe:	pipe of the pdu
+ *
+ * Return:	true when the bind asked for packet integrity or privacy
+ */
+static inline int rpc_auth_required(struct cifssrv_pipe *pipe)
+{
+	return pipe->ntlmssp &&
+		pipe->auth_level >= RPC_C_AUTHN_LEVEL_PKT_INTEGRITY;
+}
+
+/**
+ * rpc_auth_verify() - verify and decrypt a request pdu in place
+ * @pipe:	pipe the pdu was written to
+ * @data:	RPC request pdu, frag_len already checked against the buffer
+ *
+ * Each fragment carries its own verifier, so this runs before reassembly.
+ * The stub data is plain text afterwards and the trailer is left as is.
+ *
+ * Return:      0 on success, otherwise error number
+ */
+static int rpc_auth_verify(struct cifssrv_pipe *pipe, char *data)
+{
+	RPC_REQUEST_REQ *req = (RPC_REQUEST_REQ *)data;
+	RPC_AUTH_INFO *auth;
+	int stub_len, signed_len;
+
+	if (!rpc_auth_required(pipe))
+		return 0;
+
+	if (req->hdr.auth_len != NTLMSSP_SIGNATURE_SIZE)
+		return -EACCES;
+
+	stub_len = rpc_stub_len(req);
+	if (stub_len < 0)
+		return stub_len;
+
+	signed_len = req->hdr.frag_len - req->hdr.auth_len;
+	auth = (RPC_AUTH_INFO *)(data + signed_len - sizeof(RPC_AUTH_INFO));
+	if (auth->auth_type != RPC_C_AUTHN_WINNT ||
+	    auth->auth_level != pipe->auth_level ||
+	    auth->auth_ctx_id != pipe->auth_ctx_id)
+		return -EACCES;
+
+	return ntlmssp_unseal(pipe->ntlmssp,
+			pipe->auth_level == RPC_C_AUTHN_LEVEL_PKT_PRIVACY,
+			data + sizeof(RPC_REQUEST_REQ),
+			stub_len + auth->auth_pad_len,
+			data, signed_len, data + signed_len);
+}
+
+/**
+ * rpc_auth_seal() - append verifier to a response pdu and seal it
+ * @pipe:	pipe the response is read from
+ * @buf:	RPC response pdu
+ * @len:	length of response
+ * @size:	size of response buffer
+ *
+ * Return:      new response length on success, otherwise error number
+ */
+static int rpc_auth_seal(struct cifssrv_pipe *pipe, char *buf, int len,
+		int size)
+{
+	RPC_REQUEST_RSP *rsp = (RPC_REQUEST_RSP *)buf;
+	RPC_AUTH_INFO *auth;
+	int stub_len, pad, signed_len, ret;
+
+	if (len <= 0 || !rpc_auth_required(pipe))
+		return len;
+
+	stub_len = len - sizeof(RPC_REQUEST_RSP);
+	pad = -stub_len & (RPC_AUTH_PAD_ALIGN - 1);
+	signed_len = len + pad + sizeof(RPC_AUTH_INFO);
+	if (signed_len + NTLMSSP_SIGNATURE_SIZE > size)
+		return -E2BIG;
+
+	memset(buf + len, 0, pad);
+	auth = (RPC_AUTH_INFO *)(buf + len + pad);
+	auth->auth_type = RPC_C_AUTHN_WINNT;
+	auth->auth_level = pipe->auth_level;
+	auth->auth_pad_len = pad;
+	auth->auth_reserved = 0;
+	auth->auth_ctx_id = pipe->auth_ctx_id;
+
+	rsp->hdr.frag_len = signed_len + NTLMSSP_SIGNATURE_SIZE;
+	rsp->hdr.auth_len = NTLMSSP_SIGNATURE_SIZE;
+
+	ret = ntlmssp_seal(pipe->ntlmssp,
+			pipe->auth_level == RPC_C_AUTHN_LEVEL_PKT_PRIVACY,
+			buf + sizeof(RPC_REQUEST_RSP), stub_len + pad,
+			buf, signed_len, buf + signed_len);
+	if (ret)
+		return ret;
+	return rsp->hdr.frag_len;
+}
+
+/**
+ * rpc_auth_space() - room rpc_auth_seal() needs after a response
+ * @pipe:	pipe the response is read from
+ *
+ * Return:      bytes to keep free at the end of the response buffer
+ */
+static int rpc_auth_space(struct cifssrv_pipe *pipe)
+{
+	if (!rpc_auth_required(pipe))
+		return 0;
+	return RPC_AUTH_PAD_ALIGN - 1 + sizeof(RPC_AUTH_INFO) +
+		NTLMSSP_SIGNATURE_SIZE;
+}
+
+/**
+ * rpc_frag_add() - add a request fragment to the pipe reassembly buffer
+ * @pipe:	pipe the fragment was written to
+ * @data:	RPC request fragment
+ *
+ * Return:      1 when the request is complete and in pipe->frag_buf,
+ *		0 when more fragments are expected, otherwise error number
+ */
+static int rpc_frag_add(struct cifssrv_pipe *pipe, char *data)
+{
+	RPC_REQUEST_REQ *req = (RPC_REQUEST_REQ *)data;
+	RPC_REQUEST_REQ *whole;
+	int stub_len, ret;
+	__u32 hint;
+
+	rpc_frag_stats.fragments++;
+	stub_len = rpc_stub_len(req);
+	if (stub_len < 0)
+		return stub_len;
+
+	if (req->hdr.flags & RPC_FLAG_FIRST) {
+		if (pipe->frag_buf) {
+			cifssrv_debug("dropping partial call %u\n",
+					pipe->frag_call_id);
+			rpc_frag_stats.dropped++;
+			rpc_frag_release(pipe);
+		}
+
+		hint = req->alloc_hint ? req->alloc_hint : stub_len;
+		if (hint > RPC_MAX_REQ_SIZE) {
+			rpc_frag_stats.oversize++;
+			cifssrv_err("rpc alloc_hint %u is too large\n", hint);
+			return -E2BIG;
+		}
+
+		ret = rpc_frag_reserve(pipe, sizeof(RPC_REQUEST_REQ) + hint);
+		if (ret)
+			return ret;
+
+		memcpy(pipe->frag_buf, req, sizeof(RPC_REQUEST_REQ));
+		pipe->frag_len = sizeof(RPC_REQUEST_REQ);
+		pipe->frag_call_id = req->hdr.call_id;
+	} else if (!pipe->frag_buf || pipe->frag_call_id != req->hdr.call_id) {
+		cifssrv_debug("unexpected fragment of call %u\n",
+				req->hdr.call_id);
+		rpc_frag_stats.dropped++;
+		rpc_frag_release(pipe);
+		return -EINVAL;
+	}
+
+	ret = rpc_frag_reserve(pipe, pipe->frag_len + stub_len);
+	if (ret) {
+		rpc_frag_stats.dropped++;
+		rpc_frag_release(pipe);
+		return ret;
+	}
+
+	memcpy(pipe->frag_buf + pipe->frag_len,
+			data + sizeof(RPC_REQUEST_REQ), stub_len);
+	pipe->frag_len += stub_len;
+
+	if (!(req->hdr.flags & RPC_FLAG_LAST))
+		return 0;
+
+	/*
+	 * present the whole request to handlers as one unauthenticated pdu,
+	 * its length is pipe->frag_len as it may not fit in frag_len
+	 */
+	whole = (RPC_REQUEST_REQ *)pipe->frag_buf;
+	whole->hdr.flags = RPC_FLAG_FIRST | RPC_FLAG_LAST;
+	whole->hdr.auth_len = 0;
+	whole->alloc_hint = pipe->frag_len - sizeof(RPC_REQUEST_REQ);
+	rpc_frag_stats.reassembled++;
+	return 1;
+}
+
+/**
+ * rpc_rsp_cache_put() - drop a reference to a pre-encoded response
+ * @rsp:	cached response
+ */
+static void rpc_rsp_cache_put(struct rpc_rsp_cache *rsp)
+{
+	if (--rsp->refcount == 0)
+		free(rsp);
+}
+
+/**
+ * exit_dcerpc() - report rpc fragment reassembly counters and drop
+ *		pre-encoded responses
+ */
+void exit_dcerpc(void)
+{
+	struct rpc_rsp_cache *rsp;
+	int i;
+
+	cifssrv_debug("rpc fragments %lu reassembled %lu dropped %lu "
+			"oversize %lu peak bytes %lu\n",
+			rpc_frag_stats.fragments, rpc_frag_stats.reassembled,
+			rpc_frag_stats.dropped, rpc_frag_stats.oversize,
+			rpc_frag_stats.peak_bytes);
+
+	for (i = 0; i <= INFO_2; i++) {
+		free(rap_share_enum[i].entries);
+		free(rap_share_enum[i].strings);
+		free(rap_share_enum[i].str_end);
+	}
+
+	while (!list_empty(&wkssvc_rsp_cache)) {
+		rsp = list_entry(wkssvc_rsp_cache.next,
+				struct rpc_rsp_cache, list);
+		list_del(&rsp->list);
+		rpc_rsp_cache_put(rsp);
+	}
+}
+
 /**
  * process_rpc() - process a RPC request
  * @server:     TCP server instance of connection
  * @data:	RPC request packet - data
+ * @len:	length of data
+ *
+ * A fragmented request is only handled when its last fragment arrives,
+ * until then pipe->frag_buf holds the partial request.
  *
  * Return:      0 on success, error number on error
  */
-int process_rpc(struct cifssrv_pipe *pipe, char *data)
+int process_rpc(struct cifssrv_pipe *pipe, char *data, int len)
 {
 	RPC_HDR *rpc_hdr;
 	int ret = 0;
 
 	rpc_hdr = (RPC_HDR *)data;
+	if (len < sizeof(RPC_HDR) || rpc_hdr->frag_len > len) {
+		cifssrv_debug("short rpc pdu, %d bytes\n", len);
+		return -EINVAL;
+	}
 
 	cifssrv_debug("DCERPC pktype = %u\n", rpc_hdr->pkt_type);
 
 	switch (rpc_hdr->pkt_type) {
 	case RPC_REQUEST:
 		cifssrv_debug("GOT RPC_REQUEST\n");
-		ret = rpc_request(pipe, data);
+		if (rpc_hdr->frag_len < sizeof(RPC_REQUEST_REQ))
+			return -EINVAL;
+
+		/* winreg is only served to an authenticated client */
+		if (pipe->pipe_type == WINREG &&
+		    !ntlmssp_established(pipe->ntlmssp)) {
+			cifssrv_err("winreg request without authentication\n");
+			return -EACCES;
+		}
+
+		ret = rpc_auth_verify(pipe, data);
+		if (ret)
+			return ret;
+
+		if ((rpc_hdr->flags & (RPC_FLAG_FIRST | RPC_FLAG_LAST)) ==
+				(RPC_FLAG_FIRST | RPC_FLAG_LAST) &&
+				!pipe->frag_buf) {
+			ret = rpc_stub_len((RPC_REQUEST_REQ *)data);
+			if (ret < 0)
+				return ret;
+			ret = rpc_request(pipe, data,
+					sizeof(RPC_REQUEST_REQ) + ret);
+			break;
+		}
+
+		ret = rpc_frag_add(pipe, data);
+		if (ret <= 0)
+			return ret;
+
+		ret = rpc_request(pipe, pipe->frag_buf, pipe->frag_len);
+		rpc_frag_release(pipe);
 		break;
 	case RPC_BIND:
 		cifssrv_debug("GOT RPC_BIND\n");
-		ret = rpc_bind(pipe, data);
+		ret = rpc_bind(pipe, data, rpc_hdr->frag_len);
+		break;
+	case RPC_AUTH3:
+		cifssrv_debug("GOT RPC_AUTH3\n");
+		ret = rpc_auth3(pipe, data, rpc_hdr->frag_len);
 		break;
 	default:
 		cifssrv_debug("rpc type = %d Not Implemented\n",
@@ -119,10 +514,14 @@ int process_rpc_rsp(struct cifssrv_pipe *pipe, char *data_buf, int size)
 				pipe->pipe_type);
 			return -EINVAL;
 		}
+		nbytes = rpc_auth_seal(pipe, data_buf, nbytes, size);
 		break;
 	case RPC_BIND:
 		nbytes = rpc_read_bind_data(pipe, data_buf);
 		break;
+	case RPC_AUTH3:
+		/* AUTH3 has no response pdu */
+		break;
 	default:
 		cifssrv_debug("rpc type = %d Not Implemented\n",
 					pipe->pkt_type);
@@ -134,225 +533,283 @@ int process_rpc_rsp(struct cifssrv_pipe *pipe, char *data_buf, int size)
 
 
 
-int rpc_read_winreg_data(struct cifssrv_pipe *pipe, char *outdata, int buf_len)
+/**
+ * ndr_push_query_value_rsp() - copy winreg QueryValue response
+ * @buf:	buffer to copy to
+ * @buf_len:	size of @buf
+ * @winreg_rsp:	response filled by winreg_query_value()
+ *
+ * The response is a single pdu, data that does not fit in @buf is not
+ * sent and the client is told to retry with more room.
+ *
+ * Return:      size of the response, otherwise error number
+ */
+static int ndr_push_query_value_rsp(char *buf, int buf_len,
+		QUERY_VALUE_RSP *winreg_rsp)
 {
-	RPC_REQUEST_RSP *rpc_request_rsp = (RPC_REQUEST_RSP *)outdata;
-	int offset = 0;
-
-	if (pipe->opnum == WINREG_OPENHKCR ||
-			pipe->opnum == WINREG_OPENHKCU ||
-			pipe->opnum == WINREG_OPENHKLM ||
-			pipe->opnum == WINREG_OPENHKU ||
-			pipe->opnum == WINREG_OPENKEY ||
-			pipe->opnum == WINREG_CLOSEKEY) {
-
-		OPENHKEY_RSP *winreg_rsp;
-
-		winreg_rsp = (OPENHKEY_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->key_handle,
-						sizeof(KEY_HANDLE));
-		offset += sizeof(KEY_HANDLE);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
+	QUERY_INFO *info = winreg_rsp->query_val_info;
+	int offset = 0, size = 0, room;
+	__u32 werror = winreg_rsp->werror;
+
+	/* everything but the data */
+	room = buf_len - (int)(sizeof(RPC_REQUEST_RSP) +
+			3 * sizeof(DATA_INFO) + sizeof(__u32) +
+			sizeof(UNISTR_INFO) + sizeof(__u32));
+	if (room < 0) {
+		offset = -E2BIG;
+		goto out_free;
 	}
 
-	if (pipe->opnum == WINREG_GETVERSION) {
-		GET_VERSION_RSP *winreg_rsp;
+	memcpy(buf, &winreg_rsp->rpc_request_rsp, sizeof(RPC_REQUEST_RSP));
+	offset += sizeof(RPC_REQUEST_RSP);
 
-		winreg_rsp = (GET_VERSION_RSP *)pipe->data;
+	if (!info) {
+		memset(buf + offset, 0, sizeof(__u32) * 4);
+		offset += sizeof(__u32) * 4;
+		goto out;
+	}
 
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
+	/* no buffer means the client asked for the size only */
+	if (info->Buffer) {
+		size = (info->size_info.info + 3) & ~3;
+		if (size > room) {
+			free(info->Buffer);
+			info->Buffer = NULL;
+			werror = cpu_to_le32(WERR_MORE_DATA);
+		}
+	}
 
-		memcpy(outdata + offset, &winreg_rsp->version, sizeof(__u32));
+	memcpy(buf + offset, &info->type_info, sizeof(DATA_INFO));
+	offset += sizeof(DATA_INFO);
+	if (info->Buffer) {
+		memcpy(buf + offset, &info->data_ref_id, sizeof(__u32));
 		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
+		memcpy(buf + offset, &info->data_info, sizeof(UNISTR_INFO));
+		offset += sizeof(UNISTR_INFO);
+		memcpy(buf + offset, info->Buffer, info->size_info.info);
+		memset(buf + offset + info->size_info.info, 0,
+				size - info->size_info.info);
+		offset += size;
+	} else {
+		memset(buf + offset, 0, sizeof(__u32));
 		offset += sizeof(__u32);
-		free(winreg_rsp);
 	}
 
-	if (pipe->opnum == WINREG_DELETEKEY ||
-			pipe->opnum == WINREG_FLUSHKEY ||
-			pipe->opnum == WINREG_SETVALUE ||
-			pipe->opnum == WINREG_NOTIFYCHANGEKEYVALUE ||
-			pipe->opnum == WINREG_DELETEVALUE) {
-		WINREG_COMMON_RSP *winreg_rsp;
+	memcpy(buf + offset, &info->size_info, sizeof(DATA_INFO));
+	offset += sizeof(DATA_INFO);
+	memcpy(buf + offset, &info->length_info, sizeof(DATA_INFO));
+	offset += sizeof(DATA_INFO);
+out:
+	memcpy(buf + offset, &werror, sizeof(__u32));
+	offset += sizeof(__u32);
+out_free:
+	if (info) {
+		free(info->Buffer);
+		free(info);
+	}
+	return offset;
+}
 
-		winreg_rsp = (WINREG_COMMON_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
+static int ndr_put_u32(char *buf, int offset, __u32 val)
+{
+	__le32 v = cpu_to_le32(val);
+
+	memcpy(buf + offset, &v, sizeof(v));
+	return offset + sizeof(v);
+}
+
+/**
+ * ndr_put_string_buf() - copy a length/size/pointer UTF-16 string
+ * @buf:	buffer to copy to
+ * @offset:	4 byte aligned offset in @buf
+ * @str:	string, may be NULL if @len is 0
+ * @len:	length of the string in bytes
+ * @size:	size of the client buffer in bytes
+ * @ref_id:	referent id of the string
+ *
+ * Return:	offset after the string and its padding
+ */
+static int ndr_put_string_buf(char *buf, int offset, __le16 *str, __u16 len,
+		__u16 size, __u32 ref_id)
+{
+	__le16 v;
+
+	v = cpu_to_le16(len);
+	memcpy(buf + offset, &v, sizeof(v));
+	v = cpu_to_le16(size);
+	memcpy(buf + offset + 2, &v, sizeof(v));
+	offset = ndr_put_u32(buf, offset + 4, ref_id);
+	offset = ndr_put_u32(buf, offset, size / 2);
+	offset = ndr_put_u32(buf, offset, 0);
+	offset = ndr_put_u32(buf, offset, len / 2);
+	if (len)
+		memcpy(buf + offset, str, len);
+	offset += len;
+	while (offset % 4)
+		buf[offset++] = 0;
+	return offset;
+}
+
+/**
+ * ndr_push_enum_key_rsp() - copy winreg EnumKey response
+ * @buf:	buffer to copy to
+ * @buf_len:	size of @buf
+ * @winreg_rsp:	response filled by winreg_enum_key()
+ *
+ * A name that does not fit in @buf is not sent, as if the client buffer
+ * was too small.
+ *
+ * Return:      size of the response, otherwise error number
+ */
+static int ndr_push_enum_key_rsp(char *buf, int buf_len,
+		ENUM_KEY_RSP *winreg_rsp)
+{
+	int offset = sizeof(RPC_REQUEST_RSP), room;
+
+	/* two string headers, the pointers and werror */
+	room = buf_len - (int)(sizeof(RPC_REQUEST_RSP) + 15 * sizeof(__u32));
+	if (room < 0) {
+		free(winreg_rsp->name);
+		return -E2BIG;
+	}
+	if (((winreg_rsp->name_len + 3) & ~3) > room) {
+		free(winreg_rsp->name);
+		winreg_rsp->name = NULL;
+		winreg_rsp->name_len = 0;
+		winreg_rsp->werror = WERR_MORE_DATA;
 	}
 
-	if (pipe->opnum == WINREG_CREATEKEY) {
-		CREATE_KEY_RSP *winreg_rsp;
+	memcpy(buf, &winreg_rsp->rpc_request_rsp, sizeof(RPC_REQUEST_RSP));
+	offset = ndr_put_string_buf(buf, offset, winreg_rsp->name,
+			winreg_rsp->name_len, winreg_rsp->name_size,
+			0x00020000);
+
+	/* keys have no class, and no last write time is kept */
+	offset = ndr_put_u32(buf, offset,
+			winreg_rsp->class_ptr ? 0x00020004 : 0);
+	if (winreg_rsp->class_ptr)
+		offset = ndr_put_string_buf(buf, offset, NULL, 0,
+				winreg_rsp->class_size, 0x00020008);
+	offset = ndr_put_u32(buf, offset,
+			winreg_rsp->time_ptr ? 0x0002000c : 0);
+	if (winreg_rsp->time_ptr) {
+		offset = ndr_put_u32(buf, offset, 0);
+		offset = ndr_put_u32(buf, offset, 0);
+	}
 
-		winreg_rsp = (CREATE_KEY_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->key_handle,
-						sizeof(KEY_HANDLE));
-		offset += sizeof(KEY_HANDLE);
-		memcpy(outdata + offset, &winreg_rsp->ref_id, sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->action_taken,
-								sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
+	offset = ndr_put_u32(buf, offset, winreg_rsp->werror);
+	free(winreg_rsp->name);
+	return offset;
+}
+
+/**
+ * ndr_push_enum_value_rsp() - copy winreg EnumValue response
+ * @buf:	buffer to copy to
+ * @buf_len:	size of @buf
+ * @winreg_rsp:	response filled by winreg_enum_value()
+ *
+ * The response is a single pdu. Data, and then the name, that do not fit
+ * in @buf are not sent, as if the client buffer was too small.
+ *
+ * Return:      size of the response, otherwise error number
+ */
+static int ndr_push_enum_value_rsp(char *buf, int buf_len,
+		ENUM_VALUE_RSP *winreg_rsp)
+{
+	int offset = sizeof(RPC_REQUEST_RSP), room, name_size;
+
+	/* the string and array headers, the pointers, the sizes and werror */
+	room = buf_len - (int)(sizeof(RPC_REQUEST_RSP) + 16 * sizeof(__u32));
+	if (room < 0) {
+		free(winreg_rsp->name);
+		free(winreg_rsp->data);
+		return -E2BIG;
 	}
 
-	if (pipe->opnum == WINREG_ENUMKEY) {
-		ENUM_KEY_RSP *winreg_rsp;
+	name_size = (winreg_rsp->name_len + 3) & ~3;
+	if (winreg_rsp->data_len &&
+	    name_size + ((winreg_rsp->data_len + 3) & ~3) > room) {
+		free(winreg_rsp->data);
+		winreg_rsp->data = NULL;
+		winreg_rsp->data_len = 0;
+		winreg_rsp->data_size = winreg_rsp->value_size;
+		winreg_rsp->werror = WERR_MORE_DATA;
+	}
+	if (name_size > room) {
+		free(winreg_rsp->name);
+		winreg_rsp->name = NULL;
+		winreg_rsp->name_len = 0;
+		winreg_rsp->werror = WERR_MORE_DATA;
+	}
 
-		winreg_rsp = (ENUM_KEY_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->key_name,
-						sizeof(CLASSNAME_INFO));
-		offset += sizeof(CLASSNAME_INFO);
-		memcpy(outdata + offset, &winreg_rsp->key_class_ref_id,
-							sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->key_class,
-						sizeof(NAME_INFO));
-		offset += sizeof(NAME_INFO);
-		memcpy(outdata + offset, &winreg_rsp->last_changed_time_ref_id,
-								sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->last_changed_time,
-						sizeof(__u64));
-		offset += sizeof(__u64);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
-
-	if (pipe->opnum == WINREG_ENUMVALUE) {
-		ENUM_VALUE_RSP *winreg_rsp;
-
-		winreg_rsp = (ENUM_VALUE_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->name_len, sizeof(__u16));
-		offset += sizeof(__u16);
-		memcpy(outdata + offset, &winreg_rsp->name_size,
-								sizeof(__u16));
-		offset += sizeof(__u16);
-		memcpy(outdata + offset, &winreg_rsp->name_ref_id,
-								sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->name_str_info,
-							sizeof(UNISTR_INFO));
-		offset += sizeof(UNISTR_INFO);
-		memcpy(outdata + offset, &winreg_rsp->type_info,
-							sizeof(DATA_INFO));
-		offset += sizeof(DATA_INFO);
-		memcpy(outdata + offset, &winreg_rsp->value_ptr,
-								sizeof(__u32));
-		offset += sizeof(__u32);
-		memcpy(outdata + offset, &winreg_rsp->size_info,
-							sizeof(DATA_INFO));
-		offset += sizeof(DATA_INFO);
-		memcpy(outdata + offset, &winreg_rsp->length_info,
-							sizeof(DATA_INFO));
-		offset += sizeof(DATA_INFO);
-		memcpy(outdata + offset, &winreg_rsp->werror,
-							sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
-	}
-
-	if (pipe->opnum == WINREG_QUERYINFOKEY) {
-		QUERY_INFO_KEY_RSP *winreg_rsp;
-
-		winreg_rsp = (QUERY_INFO_KEY_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-		memcpy(outdata + offset, &winreg_rsp->class_info,
-						sizeof(CLASSNAME_INFO));
-		offset += sizeof(CLASSNAME_INFO);
-		memcpy(outdata + offset, &winreg_rsp->key_info,
-							sizeof(KEY_INFO));
-		offset += sizeof(KEY_INFO);
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
+	memcpy(buf, &winreg_rsp->rpc_request_rsp, sizeof(RPC_REQUEST_RSP));
+	offset = ndr_put_string_buf(buf, offset, winreg_rsp->name,
+			winreg_rsp->name_len, winreg_rsp->name_size,
+			0x00020000);
+
+	offset = ndr_put_u32(buf, offset,
+			winreg_rsp->type_ptr ? 0x00020004 : 0);
+	if (winreg_rsp->type_ptr)
+		offset = ndr_put_u32(buf, offset, winreg_rsp->type);
+
+	offset = ndr_put_u32(buf, offset,
+			winreg_rsp->data_ptr ? 0x00020008 : 0);
+	if (winreg_rsp->data_ptr) {
+		offset = ndr_put_u32(buf, offset, winreg_rsp->data_size);
+		offset = ndr_put_u32(buf, offset, 0);
+		offset = ndr_put_u32(buf, offset, winreg_rsp->data_len);
+		if (winreg_rsp->data_len)
+			memcpy(buf + offset, winreg_rsp->data,
+					winreg_rsp->data_len);
+		offset += winreg_rsp->data_len;
+		while (offset % 4)
+			buf[offset++] = 0;
 	}
 
-	if (pipe->opnum == WINREG_QUERYVALUE) {
-		QUERY_VALUE_RSP *winreg_rsp;
+	offset = ndr_put_u32(buf, offset,
+			winreg_rsp->size_ptr ? 0x0002000c : 0);
+	if (winreg_rsp->size_ptr)
+		offset = ndr_put_u32(buf, offset, winreg_rsp->value_size);
+	offset = ndr_put_u32(buf, offset,
+			winreg_rsp->length_ptr ? 0x00020010 : 0);
+	if (winreg_rsp->length_ptr)
+		offset = ndr_put_u32(buf, offset, winreg_rsp->data_ptr ?
+				winreg_rsp->data_len : winreg_rsp->value_size);
+
+	offset = ndr_put_u32(buf, offset, winreg_rsp->werror);
+	free(winreg_rsp->name);
+	free(winreg_rsp->data);
+	return offset;
+}
 
-		winreg_rsp = (QUERY_VALUE_RSP *)pipe->data;
-		memcpy(outdata + offset, &winreg_rsp->rpc_request_rsp,
-					sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
+#define WINREG_PUSH_RSP(opnum, handler, rsp)				\
+	case opnum:							\
+		offset = ndr_push_##rsp(outdata, buf_len,		\
+				(void *)pipe->data);			\
+		break;
 
-		if (winreg_rsp->query_val_info == NULL) {
-			memset(outdata + offset, 0, (sizeof(__u32)*4));
-			offset += (sizeof(__u32)*4);
-		} else {
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->type_info,
-				sizeof(DATA_INFO));
-			offset += sizeof(DATA_INFO);
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->data_ref_id,
-				sizeof(__u32));
-			offset += sizeof(__u32);
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->data_info,
-				sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-			if (winreg_rsp->query_val_info->size_info.info <
-								sizeof(__u32)) {
-				memcpy(outdata + offset,
-					winreg_rsp->query_val_info->Buffer,
-					sizeof(__u32));
-				offset += sizeof(__u32);
-			} else if ((winreg_rsp->query_val_info->size_info.info
-								%2) == 1) {
-				memcpy(outdata + offset,
-				winreg_rsp->query_val_info->Buffer,
-				(winreg_rsp->query_val_info->size_info.info+1));
-				offset +=
-				(winreg_rsp->query_val_info->size_info.info+1);
-			} else {
-				memcpy(outdata + offset,
-				winreg_rsp->query_val_info->Buffer,
-				winreg_rsp->query_val_info->size_info.info);
-				offset +=
-				winreg_rsp->query_val_info->size_info.info;
-			}
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->size_info,
-				sizeof(DATA_INFO));
-			offset += sizeof(DATA_INFO);
-			memcpy(outdata + offset,
-				&winreg_rsp->query_val_info->length_info,
-				sizeof(DATA_INFO));
-			offset += sizeof(DATA_INFO);
-			free(winreg_rsp->query_val_info->Buffer);
-			free(winreg_rsp->query_val_info);
-		}
+/**
+ * rpc_read_winreg_data() - create RPC response buffer for winreg request
+ * @pipe:	winreg pipe
+ * @outdata:	RPC response out buffer
+ * @buf_len:	RPC response buffer length
+ *
+ * Return:      response length on success, otherwise error number
+ */
+int rpc_read_winreg_data(struct cifssrv_pipe *pipe, char *outdata, int buf_len)
+{
+	RPC_REQUEST_RSP *rpc_request_rsp = (RPC_REQUEST_RSP *)outdata;
+	int offset = 0;
 
-		memcpy(outdata + offset, &winreg_rsp->werror, sizeof(__u32));
-		offset += sizeof(__u32);
-		free(winreg_rsp);
+	buf_len -= rpc_auth_space(pipe);
+	switch (pipe->opnum) {
+	WINREG_IDL(WINREG_PUSH_RSP)
+	default:
+		return -EOPNOTSUPP;
 	}
+	free(pipe->data);
+	if (offset < 0)
+		return offset;
 
 	rpc_request_rsp->hdr.frag_len = offset;
 	rpc_request_rsp->alloc_hint = offset - sizeof(RPC_REQUEST_RSP);
@@ -424,6 +881,75 @@ int rpc_read_bind_data(struct cifssrv_pipe *pipe, char *out_data)
 	return offset;
 }
 
+#define SRVSVC_SHARE_INFO_PUSH(level, tag, NAME)			\
+	case level:							\
+		if (buf)						\
+			ndr_push_##tag(buf, NDR_SIZE(NAME), ptr);	\
+		return NDR_SIZE(NAME);
+
+/**
+ * srvsvc_share_ptr_copy() - copy fixed part of a share info entry
+ * @buf:	buffer to copy to, or NULL to only get the size
+ * @ptr:	fixed part of share info
+ * @level:	share info level requested by client
+ *
+ * Return:      size of the fixed part at given info level
+ */
+static int srvsvc_share_ptr_copy(char *buf, PTR_INFO *ptr, __u32 level)
+{
+	switch (level) {
+	SRVSVC_SHARE_INFO_LEVELS(SRVSVC_SHARE_INFO_PUSH)
+	}
+	return 0;
+}
+
+/**
+ * srvsvc_unistr_copy() - copy a conformant varying UTF-16 string
+ * @buf:	buffer to copy to, or NULL to only get the size
+ * @info:	string header
+ * @str:	UTF-16 string
+ *
+ * Return:      size of header and string, padded to 4 bytes
+ */
+static int srvsvc_unistr_copy(char *buf, UNISTR_INFO *info, __le16 *str)
+{
+	int string_len = info->actual_count * 2;
+
+	if (buf) {
+		memcpy(buf, info, sizeof(UNISTR_INFO));
+		memcpy(buf + sizeof(UNISTR_INFO), str, string_len);
+	}
+	return sizeof(UNISTR_INFO) + ((string_len + 3) & ~3);
+}
+
+/**
+ * srvsvc_share_str_copy() - copy strings referred by a share info entry
+ * @buf:	buffer to copy to, or NULL to only get the size
+ * @share:	share info strings
+ * @level:	share info level requested by client
+ *
+ * Password and security descriptor pointers are always null, so only
+ * name, remark and path have referents on the wire.
+ *
+ * Return:      size of the strings at given info level
+ */
+static int srvsvc_share_str_copy(char *buf, SRVSVC_SHARE_INFO *share,
+				 __u32 level)
+{
+	int offset = 0;
+
+	offset += srvsvc_unistr_copy(buf, &share->str_info1, share->sharename);
+	if (level == INFO_0)
+		return offset;
+
+	offset += srvsvc_unistr_copy(buf ? buf + offset : NULL,
+			&share->str_info2, share->comment);
+	if (level == INFO_2 || level == INFO_502)
+		offset += srvsvc_unistr_copy(buf ? buf + offset : NULL,
+				&share->str_info3, share->path);
+	return offset;
+}
+
 /**
  * rpc_read_srvsvc_data() - create RPC response buffer for RPC_REQUEST
  * @server:     TCP server instance of connection
@@ -435,8 +961,9 @@ int rpc_read_bind_data(struct cifssrv_pipe *pipe, char *out_data)
 int rpc_read_srvsvc_data(struct cifssrv_pipe *pipe, char *outdata, int buf_len)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp = (RPC_REQUEST_RSP *)outdata;
-	int offset = 0, string_len = 0;
-	int i = 0, resume_handle = 0, data_sent = 0, datasize = 0;
+	int offset = 0;
+	int resume_handle = 0, data_sent = 0, datasize = 0;
+	__u32 level;
 	SRVSVC_SHARE_INFO_CTR *sharectr;
 	SRVSVC_SHARE_GETINFO *shareinfo;
 	WKSSVC_SHARE_GETINFO *wkssvc_info;
@@ -451,46 +978,20 @@ int rpc_read_srvsvc_data(struct cifssrv_pipe *pipe, char *outdata, int buf_len)
 	if (pipe->opnum == SRV_NET_SHARE_GETINFO) {
 		shareinfo = (SRVSVC_SHARE_GETINFO *)pipe->data;
 
-		memcpy(outdata + offset, &shareinfo->info_level,
-				sizeof(shareinfo->info_level));
-		offset += sizeof(shareinfo->info_level);
-		memcpy(outdata + offset, &shareinfo->switch_value,
-				sizeof(shareinfo->switch_value));
-		offset += sizeof(shareinfo->switch_value);
+		offset = ndr_push_srvsvc_share_getinfo_hdr(outdata, buf_len,
+				shareinfo);
+		if (offset < 0)
+			goto out_free;
 		if (shareinfo->status == WERR_INVALID_NAME)
 			goto out;
-		memcpy(outdata + offset, shareinfo->ptrs,
-				sizeof(PTR_INFO1));
-		offset += sizeof(PTR_INFO1);
-
-		for (i = 0; i < 1; i++) {
-			memcpy(outdata + offset,
-			&shareinfo->shares[i].str_info1, sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-
-			string_len =
-				shareinfo->shares[i].str_info1.actual_count * 2;
-
-			memcpy(outdata + offset, shareinfo->shares[i].sharename,
-					string_len);
-			offset += ((string_len + 3) & ~3);
-
-			memcpy(outdata + offset,
-			       &shareinfo->shares[i].str_info2,
-			       sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-
-			string_len =
-				shareinfo->shares[i].str_info2.actual_count * 2;
-
-			memcpy(outdata + offset, shareinfo->shares[i].comment,
-					string_len);
-			offset += ((string_len + 3) & ~3);
-		}
+		level = le32_to_cpu(shareinfo->info_level);
+		offset += srvsvc_share_ptr_copy(outdata + offset,
+				shareinfo->ptrs, level);
+		offset += srvsvc_share_str_copy(outdata + offset,
+				shareinfo->shares, level);
 out:
-		memcpy(outdata + offset, &shareinfo->status,
-				sizeof(shareinfo->status));
-		offset += sizeof(shareinfo->status);
+		offset += ndr_push_srvsvc_share_getinfo_tail(outdata + offset,
+				NDR_SIZE(SRVSVC_SHARE_GETINFO_TAIL), shareinfo);
 
 		rpc_request_rsp->hdr.frag_len = offset;
 		rpc_request_rsp->alloc_hint = offset - sizeof(RPC_REQUEST_RSP);
@@ -499,6 +1000,7 @@ out:
 			       rpc_request_rsp->hdr.frag_len,
 			       rpc_request_rsp->alloc_hint);
 
+out_free:
 		free(shareinfo->shares);
 		free(shareinfo->ptrs);
 		free(shareinfo);
@@ -553,61 +1055,11 @@ finish:
 	if (pipe->opnum == 0) {
 		wkssvc_info = (WKSSVC_SHARE_GETINFO *)pipe->data;
 
-		memcpy(outdata + offset, &wkssvc_info->info_level,
-				sizeof(wkssvc_info->info_level));
-		offset += sizeof(wkssvc_info->info_level);
-
-		memcpy(outdata + offset, &wkssvc_info->platform_id,
-					sizeof(wkssvc_info->platform_id));
-		offset += sizeof(wkssvc_info->platform_id);
-
-		memcpy(outdata + offset, &wkssvc_info->refid,
-						sizeof(wkssvc_info->refid));
-		offset += sizeof(wkssvc_info->refid);
-
-		memcpy(outdata + offset, &wkssvc_info->ref_id1,
-						sizeof(wkssvc_info->ref_id1));
-		offset += sizeof(wkssvc_info->ref_id1);
-
-		memcpy(outdata + offset, &wkssvc_info->ref_id2,
-						sizeof(wkssvc_info->ref_id2));
-		offset += sizeof(wkssvc_info->ref_id2);
-
-		memcpy(outdata + offset, &wkssvc_info->maj,
-						sizeof(wkssvc_info->maj));
-		offset += sizeof(wkssvc_info->maj);
-
-		memcpy(outdata + offset, &wkssvc_info->min,
-						sizeof(wkssvc_info->min));
-		offset += sizeof(wkssvc_info->min);
-
-		for (i = 0; i < 1; i++) {
-			memcpy(outdata + offset,
-			&wkssvc_info->shares[i].str_info1, sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-
-			string_len =
-			wkssvc_info->shares[i].str_info1.actual_count * 2;
-
-			memcpy(outdata + offset,
-				wkssvc_info->shares[i].server_name, string_len);
-			offset += ((string_len + 3) & ~3);
-
-			memcpy(outdata + offset,
-			&wkssvc_info->shares[i].str_info2, sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-
-			string_len =
-			wkssvc_info->shares[i].str_info2.actual_count * 2;
-
-			memcpy(outdata + offset,
-			wkssvc_info->shares[i].domain_name, string_len);
-			offset += ((string_len + 3) & ~3);
-		}
-
-		memcpy(outdata + offset, &wkssvc_info->status,
-				sizeof(wkssvc_info->status));
-		offset += sizeof(wkssvc_info->status);
+		/* header of this call is in place, the rest is pre-encoded */
+		offset = wkssvc_info->rsp->len;
+		memcpy(outdata + sizeof(RPC_REQUEST_RSP),
+		       wkssvc_info->rsp->data + sizeof(RPC_REQUEST_RSP),
+		       offset - sizeof(RPC_REQUEST_RSP));
 
 		rpc_request_rsp->hdr.frag_len = offset;
 		rpc_request_rsp->alloc_hint = offset - sizeof(RPC_REQUEST_RSP);
@@ -615,7 +1067,7 @@ finish:
 		cifssrv_debug("frag len = %d alloc_hint = %d\n",
 		rpc_request_rsp->hdr.frag_len, rpc_request_rsp->alloc_hint);
 
-		free(wkssvc_info->shares);
+		rpc_rsp_cache_put(wkssvc_info->rsp);
 		free(wkssvc_info);
 
 	}
@@ -632,32 +1084,25 @@ finish:
  */
 int pipe_data_size(struct cifssrv_pipe *pipe, void *data, int num_shares)
 {
-	int size = 0, i, string_len;
+	int size = 0, i;
+	__u32 level;
 	SRVSVC_SHARE_INFO_CTR *sharectr;
 
 	if (pipe->opnum == SRV_NET_SHARE_ENUM_ALL) {
 		sharectr = (SRVSVC_SHARE_INFO_CTR *)data;
+		level = le32_to_cpu(sharectr->info.info_level);
 
-		size += sizeof(RPC_REQUEST_RSP);
-		size += sizeof(SRVSVC_SHARE_COMMON_INFO);
-		size += num_shares * sizeof(PTR_INFO1);
+		size += NDR_SIZE(SRVSVC_SHARE_ENUM_HDR);
+		for (i = 0; i < num_shares; i++)
+			size += srvsvc_share_ptr_copy(NULL,
+					&sharectr->ptrs[i], level);
 
 		/* determine the size of share info */
-		for (i = 0; i < num_shares; i++) {
-			size += sizeof(UNISTR_INFO);
-			string_len =
-				sharectr->shares[i].str_info1.actual_count * 2;
-			size += ((string_len + 3) & ~3);
-			size += sizeof(UNISTR_INFO);
-			string_len =
-				sharectr->shares[i].str_info2.actual_count * 2;
-
-			size += ((string_len + 3) & ~3);
-		}
+		for (i = 0; i < num_shares; i++)
+			size += srvsvc_share_str_copy(NULL,
+					&sharectr->shares[i], level);
 
-		size += sizeof(sharectr->total_entries);
-		size += sizeof(sharectr->resume_handle);
-		size += sizeof(sharectr->status);
+		size += NDR_SIZE(SRVSVC_SHARE_ENUM_TAIL);
 	}
 	cifssrv_debug("Total data length in pipe %d\n", size);
 	return size;
@@ -672,60 +1117,30 @@ int pipe_data_size(struct cifssrv_pipe *pipe, void *data, int num_shares)
  */
 int pipe_data_copy(struct cifssrv_pipe *pipe, char *buf)
 {
-	int offset = 0, i, str_len, num_shares;
+	int offset = 0, i, num_shares;
+	__u32 level;
 	SRVSVC_SHARE_INFO_CTR *sharectr;
 
 	if (pipe->opnum == SRV_NET_SHARE_ENUM_ALL) {
 		sharectr = (SRVSVC_SHARE_INFO_CTR *)pipe->data;
 		num_shares = sharectr->info.num_entries;
+		level = le32_to_cpu(sharectr->info.info_level);
 
 		cifssrv_debug("num entries = %d\n", sharectr->info.num_entries);
-		memcpy(buf, &sharectr->rpc_request_rsp,
-						sizeof(RPC_REQUEST_RSP));
-		offset += sizeof(RPC_REQUEST_RSP);
-
-		memcpy(buf + offset, &sharectr->info,
-				sizeof(SRVSVC_SHARE_COMMON_INFO));
-		offset += sizeof(SRVSVC_SHARE_COMMON_INFO);
-
-		memcpy(buf + offset, sharectr->ptrs,
-				num_shares * sizeof(PTR_INFO1));
-		offset += num_shares * sizeof(PTR_INFO1);
+		/* buf was sized by pipe_data_size() */
+		offset += ndr_push_srvsvc_share_enum_hdr(buf,
+				NDR_SIZE(SRVSVC_SHARE_ENUM_HDR), sharectr);
 
-		for (i = 0; i < num_shares; i++) {
+		for (i = 0; i < num_shares; i++)
+			offset += srvsvc_share_ptr_copy(buf + offset,
+					&sharectr->ptrs[i], level);
 
-			memcpy(buf + offset, &sharectr->shares[i].str_info1,
-					sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
+		for (i = 0; i < num_shares; i++)
+			offset += srvsvc_share_str_copy(buf + offset,
+					&sharectr->shares[i], level);
 
-			str_len =
-				sharectr->shares[i].str_info1.actual_count * 2;
-
-			memcpy(buf + offset, sharectr->shares[i].sharename,
-					str_len);
-			offset += ((str_len + 3) & ~3);
-
-			memcpy(buf + offset, &sharectr->shares[i].str_info2,
-					sizeof(UNISTR_INFO));
-			offset += sizeof(UNISTR_INFO);
-
-			str_len =
-				sharectr->shares[i].str_info2.actual_count * 2;
-
-			memcpy(buf + offset, sharectr->shares[i].comment,
-					str_len);
-			offset += ((str_len + 3) & ~3);
-
-		}
-		memcpy(buf + offset, &sharectr->total_entries,
-				sizeof(sharectr->total_entries));
-		offset += sizeof(sharectr->total_entries);
-		memcpy(buf + offset, &sharectr->resume_handle,
-				sizeof(sharectr->resume_handle));
-		offset += sizeof(sharectr->resume_handle);
-		memcpy(buf + offset, &sharectr->status,
-				sizeof(sharectr->status));
-		offset += sizeof(sharectr->status);
+		offset += ndr_push_srvsvc_share_enum_tail(buf + offset,
+				NDR_SIZE(SRVSVC_SHARE_ENUM_TAIL), sharectr);
 	}
 
 	return offset;
@@ -754,23 +1169,82 @@ void dcerpc_header_init(RPC_HDR *header, int packet_type,
 	header->call_id  = call_id;
 }
 
+/**
+ * srvsvc_share_info_fill() - fill share info entry from share data
+ * @share:		share to describe
+ * @u16:		pre-encoded strings of the share
+ * @ptr_info:		fixed part of share info to fill
+ * @share_info:		strings of share info to fill
+ *
+ * All fields of every supported info level are filled, the level is
+ * only applied when the entry is put on the wire.
+ */
+static void srvsvc_share_info_fill(struct cifssrv_share *share,
+		struct cifssrv_share_utf16 *u16, PTR_INFO *ptr_info,
+		SRVSVC_SHARE_INFO *share_info)
+{
+	if (strcmp(share->sharename, STR_IPC) == 0)
+		ptr_info->type = STYPE_IPC_HIDDEN;
+	else
+		ptr_info->type = STYPE_DISKTREE;
+	cifssrv_debug("share %s added\n", share->sharename);
+
+	cifssrv_debug("comment len = %d share len = %d\n",
+			u16->comment_len, u16->name_len);
+
+	/* Since sharename, comment and path are non-null*/
+	ptr_info->ptr_netname = 1;
+	ptr_info->ptr_remark = 1;
+	ptr_info->ptr_path = 1;
+	ptr_info->ptr_passwd = 0;
+
+	ptr_info->permissions = cpu_to_le32(ACCESS_NONE);
+	if (share->config.max_connections)
+		ptr_info->max_uses = cpu_to_le32(share->config.max_connections);
+	else
+		ptr_info->max_uses = cpu_to_le32(SHI_USES_UNLIMITED);
+	ptr_info->current_uses = cpu_to_le32(share->tcount);
+
+	/* no security descriptor, so reserved (its length) is zero too */
+	ptr_info->reserved = 0;
+	ptr_info->ptr_sd = 0;
+	ptr_info->csc_flags = cpu_to_le32(CSC_CACHE_MANUAL_REFERENCE);
+
+	share_info->sharename = u16->name;
+	share_info->str_info1.max_count = u16->name_len;
+	share_info->str_info1.offset = 0;
+	share_info->str_info1.actual_count = u16->name_len;
+
+	share_info->comment = u16->comment;
+	share_info->str_info2.max_count = u16->comment_len;
+	share_info->str_info2.offset = 0;
+	share_info->str_info2.actual_count = u16->comment_len;
+
+	share_info->path = u16->path;
+	share_info->str_info3.max_count = u16->path_len;
+	share_info->str_info3.offset = 0;
+	share_info->str_info3.actual_count = u16->path_len;
+}
+
 /**
  * init_srvsvc_share_info1() - initialize srvsvc pipe share information
  * @server:		TCP server instance of connection
  * @rpc_request_req:	rpc request
+ * @level:		share info level requested by client
  *
  * Return:      0 on success or error number
  */
 static int init_srvsvc_share_info1(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req)
+				RPC_REQUEST_REQ *rpc_request_req, __u32 level)
 {
-	int num_shares = 0, cnt = 0, len = 0, ret;
+	int num_shares = 0, cnt = 0;
 	int total_pipe_data = 0, data_copied = 0;
 	struct list_head *tmp;
 	struct cifssrv_share *share;
-	SRVSVC_SHARE_INFO1 *share_info;
-	PTR_INFO1 *ptr_info;
-	int share_name_len, comment_len = 0;
+	struct cifssrv_share_utf16 *u16;
+	SRVSVC_SHARE_INFO *share_info;
+	PTR_INFO *ptr_info;
+	int share_name_len;
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	SRVSVC_SHARE_INFO_CTR *sharectr;
 	char *buf = NULL;
@@ -783,13 +1257,13 @@ static int init_srvsvc_share_info1(struct cifssrv_pipe *pipe,
 	}
 	pipe->data = (char *)sharectr;
 
-	sharectr->ptrs = calloc(1, (num_shares * sizeof(PTR_INFO1)));
+	sharectr->ptrs = calloc(1, (num_shares * sizeof(PTR_INFO)));
 
 	if (!sharectr->ptrs) {
 		free(sharectr);
 		return -ENOMEM;
 	}
-	sharectr->shares = calloc(1, (num_shares * sizeof(SRVSVC_SHARE_INFO1)));
+	sharectr->shares = calloc(1, (num_shares * sizeof(SRVSVC_SHARE_INFO)));
 
 	if (!sharectr->shares) {
 		free(sharectr->ptrs);
@@ -804,12 +1278,10 @@ static int init_srvsvc_share_info1(struct cifssrv_pipe *pipe,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
 
-	sharectr->info.info_level = cpu_to_le32(1);
-	sharectr->info.switch_value = cpu_to_le32(1);
+	sharectr->info.info_level = cpu_to_le32(level);
+	sharectr->info.switch_value = cpu_to_le32(level);
 	sharectr->info.ptr_share_info = cpu_to_le32(1);
-	sharectr->info.num_entries = cpu_to_le32(num_shares);
 	sharectr->info.ptr_entries = cpu_to_le32(1);
-	sharectr->info.num_entries2 = cpu_to_le32(num_shares);
 
 /*
  * TBD: To replace with actual user configuration part,
@@ -828,79 +1300,27 @@ static int init_srvsvc_share_info1(struct cifssrv_pipe *pipe,
 			continue;
 		}
 
-		if (strcmp(share->sharename, STR_IPC) == 0) {
-			ptr_info->type = STYPE_IPC_HIDDEN;
-			ret = smbConvertToUTF16((__le16 *)share_info->comment,
-					"IPC SHARE", strlen("IPC SHARE"), 256,
-					pipe->codepage);
-			if (ret < 0) {
-				free(sharectr->ptrs);
-				free(sharectr);
-				return -EINVAL;
-			}
-			comment_len = strlen("IPC SHARE") + 1;
-			cifssrv_debug("IPC share %s added len = %d\n",
-				       share->sharename, len);
-		} else {
-			ptr_info->type = STYPE_DISKTREE;
-			if (share->config.comment) {
-				ret = smbConvertToUTF16((__le16 *)share_info->comment,
-				share->config.comment, strlen(share->config.comment),
-				256, pipe->codepage);
-				if (ret < 0) {
-					free(sharectr->ptrs);
-					free(sharectr);
-					return -EINVAL;
-				}
-				comment_len = strlen(share->config.comment) + 1;
-			} else {
-				/* Windows expect comment to be non-null
-				   In case comment is not given in conf file,
-				   using sharename as comment */
-				ret = smbConvertToUTF16((__le16 *)share_info->comment,
-				share->sharename, strlen(share->sharename), 256,
-				pipe->codepage);
-				if (ret < 0) {
-					free(sharectr->ptrs);
-					free(sharectr);
-					return -EINVAL;			
-				}
-				comment_len = strlen(share->sharename) + 1;
-			}
-			cifssrv_debug("share %s added\n", share->sharename);
-		}
-
-		cifssrv_debug("comment len = %d share len = %d uni len = %d\n",
-				comment_len, share_name_len, len);
-
-		/* Since sharename and comment are non-null*/
-		ptr_info->ptr_netname = 1;
-		ptr_info->ptr_remark = 1;
-
-		ret = smbConvertToUTF16((__le16 *)share_info->sharename,
-				share->sharename, strlen(share->sharename),
-				256, pipe->codepage);
-		if (ret < 0) {
+		u16 = get_share_utf16(share, pipe->codepage);
+		if (IS_ERR(u16)) {
+			free(sharectr->shares);
 			free(sharectr->ptrs);
 			free(sharectr);
 			return -EINVAL;
 		}
-		share_info->str_info1.max_count = share_name_len;
-		share_info->str_info1.offset = 0;
-		share_info->str_info1.actual_count = share_name_len;
 
-		share_info->str_info2.max_count = comment_len;
-		share_info->str_info2.offset = 0;
-		share_info->str_info2.actual_count = comment_len;
+		srvsvc_share_info_fill(share, u16, ptr_info, share_info);
 		cnt++;
 	}
 #endif
 
-	sharectr->total_entries = cpu_to_le32(num_shares);
+	/* shares skipped above are not sent */
+	sharectr->info.num_entries = cpu_to_le32(cnt);
+	sharectr->info.num_entries2 = cpu_to_le32(cnt);
+	sharectr->total_entries = cpu_to_le32(cnt);
 	sharectr->resume_handle = 0;
 	sharectr->status = 0;
 
-	total_pipe_data = pipe_data_size(pipe, (void *)sharectr, num_shares);
+	total_pipe_data = pipe_data_size(pipe, (void *)sharectr, cnt);
 	if (total_pipe_data == 0)
 		return 0;
 	buf =  calloc(1, total_pipe_data);
@@ -918,49 +1338,47 @@ static int init_srvsvc_share_info1(struct cifssrv_pipe *pipe,
 /**
  * srvsvc_net_share_enum_all() - srvsvc pipe for share list enumeration
  * @server:     TCP server instance of connection
- * @data:	SRVSVC_REQ data
+ * @ndr:	cursor over NetrShareEnum request
  * @rpc_request_req:	rpc request
  *
  * Return:      0 on success or error number
  */
-static int srvsvc_net_share_enum_all(struct cifssrv_pipe *pipe, char *data,
-				RPC_REQUEST_REQ *rpc_request_req)
+static int srvsvc_net_share_enum_all(struct cifssrv_pipe *pipe,
+		struct ndr_cursor *ndr, RPC_REQUEST_REQ *rpc_request_req)
 {
-	SRVSVC_REQ *req = (SRVSVC_REQ *)data;
-	SERVER_HANDLE handle;
-	char *server_unc_ptr, *server_unc;
-	int server_unc_len = 0;
+	struct ndr_unistr unc;
+	char *server_unc;
+	__u32 info_level;
 	int ret = 0;
 
-	handle = req->server_unc_handle;
-	server_unc_ptr = (char *)(data + sizeof(SERVER_HANDLE));
-	server_unc = smb_strndup_from_utf16(server_unc_ptr,
-			req->server_unc_handle.handle_info.actual_count, 1,
-			pipe->codepage);
+	if (ndr_pull_unique_unistr(ndr, &unc) ||
+	    ndr_pull_u32(ndr, &info_level))
+		return -EINVAL;
+
+	server_unc = ndr_unistr_dup(&unc, pipe->codepage);
 	if (IS_ERR(server_unc))
 		return PTR_ERR(server_unc);
 
 	cifssrv_debug("server_unc = %s unc size = %d\n", server_unc,
-			handle.handle_info.actual_count);
+			unc.units);
 	free(server_unc);
 
-	server_unc_len = 2 * handle.handle_info.actual_count;
-	server_unc_len = ((server_unc_len + 3) & ~3);
-	/* Add 2 for Pad */
-	req->info_level = le32_to_cpu(*(server_unc_ptr + server_unc_len));
-
-	switch (req->info_level) {
+	switch (info_level) {
 
+	case INFO_0:
 	case INFO_1:
-		cifssrv_debug("GOT SRVSVC pipe info level %u\n",
-			       req->info_level);
+	case INFO_2:
+	case INFO_501:
+	case INFO_502:
+		cifssrv_debug("GOT SRVSVC pipe info level %u\n", info_level);
 
-		ret = init_srvsvc_share_info1(pipe, rpc_request_req);
+		ret = init_srvsvc_share_info1(pipe, rpc_request_req,
+				info_level);
 		break;
 
 	default:
 		cifssrv_debug("SRVSVC pipe info level %u  not supported\n",
-				req->info_level);
+				info_level);
 		return -EOPNOTSUPP;
 	}
 
@@ -972,19 +1390,18 @@ static int srvsvc_net_share_enum_all(struct cifssrv_pipe *pipe, char *data,
  * @server:		TCP server instance of connection
  * @rpc_request_req:	rpc request
  * @share_name:		share_name for which information is requested
+ * @level:		share info level requested by client
  *
  * Return:      0 on success or error number
  */
 int init_srvsvc_share_info2(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *share_name)
+			RPC_REQUEST_REQ *rpc_request_req, char *share_name,
+			__u32 level)
 {
-	int num_shares = 1, cnt = 0, len = 0;
-	struct list_head *tmp;
+	int num_shares = 1;
 	struct cifssrv_share *share;
-	SRVSVC_SHARE_INFO1 *share_info;
+	struct cifssrv_share_utf16 *u16;
 	SRVSVC_SHARE_GETINFO *shareinfo;
-	PTR_INFO1 *ptr_info;
-	int share_name_len, comment_len = 0;
 	RPC_REQUEST_RSP *rpc_request_rsp;
 
 	shareinfo = (SRVSVC_SHARE_GETINFO *)
@@ -994,13 +1411,13 @@ int init_srvsvc_share_info2(struct cifssrv_pipe *pipe,
 	}
 
 	pipe->data = (char *)shareinfo;
-	shareinfo->ptrs = malloc((num_shares * sizeof(PTR_INFO1)));
+	shareinfo->ptrs = calloc(num_shares, sizeof(PTR_INFO));
 	if (!shareinfo->ptrs) {
 		free(shareinfo);
 		return -ENOMEM;
 	}
 
-	shareinfo->shares = malloc(num_shares * sizeof(SRVSVC_SHARE_INFO1));
+	shareinfo->shares = calloc(num_shares, sizeof(SRVSVC_SHARE_INFO));
 	if (!shareinfo->shares) {
 		free(shareinfo->ptrs);
 		free(shareinfo);
@@ -1015,74 +1432,35 @@ int init_srvsvc_share_info2(struct cifssrv_pipe *pipe,
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
 
 	shareinfo->status = cpu_to_le32(WERR_INVALID_NAME);
-	shareinfo->info_level = cpu_to_le32(1);
+	shareinfo->info_level = cpu_to_le32(level);
 	shareinfo->switch_value = cpu_to_le32(0);
 
-/*
- * TBD: To replace with actual user configuration part,
- * need to decide complete logic to get this information
- */
-#if 1
-	list_for_each(tmp, &cifssrv_share_list) {
-		share_info = &shareinfo->shares[cnt];
-		ptr_info = &shareinfo->ptrs[cnt];
-		share = list_entry(tmp, struct cifssrv_share, list);
-		share_name_len = strlen(share->sharename) + 1;
-
-		if (share_name_len > 13) {
-			cifssrv_err("Not displaying share = %s",
-					share->sharename);
-			continue;
-		}
+	share = lookup_share(share_name);
+	if (!share) {
+		cifssrv_debug("share %s not found\n", share_name);
+		return 0;
+	}
 
-		if (strcmp(share->sharename, share_name) == 0) {
-			ptr_info->type = STYPE_DISKTREE;
-			if (share->config.comment) {
-				len =
-				smbConvertToUTF16((__le16 *)share_info->comment,
-				share->config.comment,
-				strlen(share->config.comment),
-				256, pipe->codepage);
-				comment_len = strlen(share->config.comment) + 1;
-			} else {
-				len =
-				smbConvertToUTF16((__le16 *)share_info->comment,
-				share->sharename, strlen(share->sharename),
-				256, pipe->codepage);
-				comment_len = strlen(share->sharename) + 1;
-			}
-			cifssrv_debug("share %s added\n", share->sharename);
-
-			shareinfo->switch_value = cpu_to_le32(1);
-			cifssrv_debug("comment len = %d share len = %d uni len = %d\n",
-				      comment_len, share_name_len, len);
-
-			/* Since sharename and comment are non-null*/
-			ptr_info->ptr_netname = 1;
-			ptr_info->ptr_remark = 1;
-
-			smbConvertToUTF16((__le16 *)share_info->sharename,
-					  share->sharename,
-					  strlen(share->sharename),
-					  256, pipe->codepage);
-			share_info->str_info1.max_count = share_name_len;
-			share_info->str_info1.offset = 0;
-			share_info->str_info1.actual_count = share_name_len;
-
-			share_info->str_info2.max_count = comment_len;
-			share_info->str_info2.offset = 0;
-			share_info->str_info2.actual_count = comment_len;
-			shareinfo->status = cpu_to_le32(WERR_OK);
-		}
+	if (strlen(share->sharename) + 1 > 13) {
+		cifssrv_err("Not displaying share = %s", share->sharename);
+		return 0;
 	}
-#endif
+
+	u16 = get_share_utf16(share, pipe->codepage);
+	if (IS_ERR(u16))
+		return PTR_ERR(u16);
+
+	srvsvc_share_info_fill(share, u16, &shareinfo->ptrs[0],
+			&shareinfo->shares[0]);
+	shareinfo->switch_value = cpu_to_le32(1);
+	shareinfo->status = cpu_to_le32(WERR_OK);
 	return 0;
 }
 
 /**
  * srvsvc_net_share_info() - get share information on srvsvc pipe
  * @server:		TCP server instance of connection
- * @data:		SRVSVC_REQ data
+ * @ndr:		cursor over NetrShareGetInfo request
  * @rpc_request_req:	rpc request
  *
  * parse srvspc packet for share_name. Get share information on requested
@@ -1090,64 +1468,157 @@ int init_srvsvc_share_info2(struct cifssrv_pipe *pipe,
  *
  * Return:      0 on success or error number
  */
-int srvsvc_net_share_info(struct cifssrv_pipe *pipe, char *data,
+int srvsvc_net_share_info(struct cifssrv_pipe *pipe, struct ndr_cursor *ndr,
 				RPC_REQUEST_REQ *rpc_request_req)
 {
-	SRVSVC_REQ *req = (SRVSVC_REQ *)data;
-	char *server_unc_ptr, *server_unc;
-	int server_unc_len = 0;
+	struct ndr_unistr unc, netname;
+	char *server_unc, *share_name;
+	__u32 info_level;
 	int ret = 0;
-	int infolevel_len;
-	UNISTR_INFO *istr_info;
-	char *ptr, *share_name_ptr, *share_name;
 
-	server_unc_ptr = (char *)(data + sizeof(SERVER_HANDLE));
-	server_unc = smb_strndup_from_utf16(server_unc_ptr,
-			req->server_unc_handle.handle_info.actual_count, 1,
-			pipe->codepage);
+	if (ndr_pull_unique_unistr(ndr, &unc) ||
+	    ndr_pull_unistr(ndr, &netname) ||
+	    ndr_pull_u32(ndr, &info_level))
+		return -EINVAL;
+
+	server_unc = ndr_unistr_dup(&unc, pipe->codepage);
 	if (IS_ERR(server_unc))
 		return PTR_ERR(server_unc);
 
 	cifssrv_debug("server_unc = %s unc size = %d\n", server_unc,
-			req->server_unc_handle.handle_info.actual_count);
+			unc.units);
 	free(server_unc);
 
-	server_unc_len = 2 * req->server_unc_handle.handle_info.actual_count;
-	server_unc_len = ((server_unc_len + 3) & ~3);
-	/* Add 2 for Pad */
-	istr_info = (UNISTR_INFO *)((char *)(server_unc_ptr + server_unc_len));
-
-	infolevel_len = 2 * istr_info->actual_count;
-	infolevel_len = ((infolevel_len + 3) & ~3);
-
-	cifssrv_debug("istr_info->max_count %u, offset %u, actual count %u\n",
-	istr_info->max_count, istr_info->offset, istr_info->actual_count);
-	share_name_ptr = (char *)((char *)istr_info + sizeof(UNISTR_INFO));
-	share_name = smb_strndup_from_utf16(share_name_ptr,
-			istr_info->actual_count, 1, pipe->codepage);
+	share_name = ndr_unistr_dup(&netname, pipe->codepage);
 	if (IS_ERR(share_name))
 		return PTR_ERR(share_name);
 
-	ptr = (char *)((char *)istr_info + infolevel_len + sizeof(UNISTR_INFO));
 	cifssrv_debug("Share name is %s\n", share_name);
-	switch (le32_to_cpu(*(ptr))) {
+	switch (info_level) {
+	case INFO_0:
 	case INFO_1:
-		cifssrv_debug("GOT SRVSVC pipe info level %u\n",
-			       req->info_level);
+	case INFO_2:
+	case INFO_501:
+	case INFO_502:
+		cifssrv_debug("GOT SRVSVC pipe info level %u\n", info_level);
 		ret = init_srvsvc_share_info2(pipe, rpc_request_req,
-								share_name);
-		free(share_name);
+				share_name, info_level);
 		break;
 
 	default:
 		cifssrv_debug("SRVSVC pipe info level %u  not supported\n",
-				req->info_level);
-		return -EOPNOTSUPP;
+				info_level);
+		ret = -EOPNOTSUPP;
 	}
 
+	free(share_name);
 	return ret;
 }
 
+/**
+ * wkssvc_build_info100() - encode NetrWkstaGetInfo level 100 response
+ * @codepage:	client codepage
+ *
+ * The header is left for the caller to fill in for each call.
+ *
+ * Return:      response with one reference held, or error pointer
+ */
+static struct rpc_rsp_cache *wkssvc_build_info100(const char *codepage)
+{
+	struct rpc_rsp_cache *rsp = ERR_PTR(-ENOMEM);
+	WKSSVC_WKSTA_INFO info;
+	UNISTR_INFO str;
+	__le16 *name, *domain;
+	int name_len, domain_len, size, offset;
+
+	name = smb_utf16_encode(server_string, codepage, &name_len);
+	if (IS_ERR(name))
+		return (struct rpc_rsp_cache *)name;
+
+	domain = smb_utf16_encode(workgroup, codepage, &domain_len);
+	if (IS_ERR(domain)) {
+		rsp = (struct rpc_rsp_cache *)domain;
+		goto out_name;
+	}
+
+	size = sizeof(WKSSVC_WKSTA_INFO) + 2 * sizeof(UNISTR_INFO) +
+		((name_len * 2 + 3) & ~3) + ((domain_len * 2 + 3) & ~3) +
+		sizeof(__u32);
+	rsp = calloc(1, sizeof(struct rpc_rsp_cache) + size);
+	if (!rsp) {
+		rsp = ERR_PTR(-ENOMEM);
+		goto out_domain;
+	}
+
+	snprintf(rsp->codepage, sizeof(rsp->codepage), "%s", codepage);
+	rsp->gen = cifssrv_global_gen;
+	rsp->refcount = 1;
+	rsp->len = size;
+
+	memset(&info, 0, sizeof(WKSSVC_WKSTA_INFO));
+	info.info_level = cpu_to_le32(100);
+	info.refid = cpu_to_le32(1);
+	info.platform_id = cpu_to_le32(500);
+	info.ref_id1 = cpu_to_le32(1);
+	info.ref_id2 = cpu_to_le32(1);
+	info.maj = cpu_to_le32(4);
+	info.min = cpu_to_le32(9);
+	offset = ndr_push_wkssvc_wksta_info(rsp->data, size, &info);
+
+	str.max_count = name_len;
+	str.offset = 0;
+	str.actual_count = name_len;
+	offset += srvsvc_unistr_copy(rsp->data + offset, &str, name);
+
+	str.max_count = domain_len;
+	str.actual_count = domain_len;
+	offset += srvsvc_unistr_copy(rsp->data + offset, &str, domain);
+
+	/* status is WERR_OK, already zeroed */
+	cifssrv_debug("encoded wkssvc info 100 for %s, %d bytes\n",
+			codepage, offset + (int)sizeof(__u32));
+
+out_domain:
+	free(domain);
+out_name:
+	free(name);
+	return rsp;
+}
+
+/**
+ * wkssvc_info100_get() - get NetrWkstaGetInfo level 100 response
+ * @codepage:	client codepage
+ *
+ * Return:      referenced response, or error pointer
+ */
+static struct rpc_rsp_cache *wkssvc_info100_get(const char *codepage)
+{
+	struct rpc_rsp_cache *rsp;
+	struct list_head *tmp;
+
+	list_for_each(tmp, &wkssvc_rsp_cache) {
+		rsp = list_entry(tmp, struct rpc_rsp_cache, list);
+		if (strcasecmp(rsp->codepage, codepage))
+			continue;
+		if (rsp->gen == cifssrv_global_gen) {
+			rsp->refcount++;
+			return rsp;
+		}
+		/* [global] changed, pipes still holding it keep it alive */
+		list_del(&rsp->list);
+		rpc_rsp_cache_put(rsp);
+		break;
+	}
+
+	rsp = wkssvc_build_info100(codepage);
+	if (IS_ERR(rsp))
+		return rsp;
+
+	list_add(&rsp->list, &wkssvc_rsp_cache);
+	rsp->refcount++;
+	return rsp;
+}
+
 /**
  * init_wkssvc_share_info2() - helper function to initialize share info
  *			response on wkssvc pipe
@@ -1159,117 +1630,68 @@ int srvsvc_net_share_info(struct cifssrv_pipe *pipe, char *data,
 int init_wkssvc_share_info2(struct cifssrv_pipe *pipe,
 				RPC_REQUEST_REQ *rpc_request_req)
 {
-	WKSSVC_SHARE_INFO1 *share_info;
 	WKSSVC_SHARE_GETINFO *shareinfo;
-	int share_name_len, comment_len, ret;
 	RPC_REQUEST_RSP *rpc_request_rsp;
 
 	shareinfo = (WKSSVC_SHARE_GETINFO *)
 			malloc(sizeof(WKSSVC_SHARE_GETINFO));
-	if (!shareinfo) {
+	if (!shareinfo)
 		return -ENOMEM;
-	}
-	pipe->data = (char *)shareinfo;
-	shareinfo->shares = malloc(sizeof(WKSSVC_SHARE_INFO1));
 
-	if (!shareinfo->shares) {
+	shareinfo->rsp = wkssvc_info100_get(pipe->codepage);
+	if (IS_ERR(shareinfo->rsp)) {
 		free(shareinfo);
-		return -ENOMEM;
+		return -EINVAL;
 	}
+	pipe->data = (char *)shareinfo;
 
 	rpc_request_rsp = &shareinfo->rpc_request_rsp;
-
+	memset(rpc_request_rsp, 0, sizeof(RPC_REQUEST_RSP));
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-
-	shareinfo->info_level = cpu_to_le32(100);
-	shareinfo->refid = cpu_to_le32(1);
-	shareinfo->platform_id = cpu_to_le32(500);
-	shareinfo->ref_id1 = cpu_to_le32(1);
-	shareinfo->ref_id2 = cpu_to_le32(1);
-	shareinfo->maj =	cpu_to_le32(4);
-	shareinfo->min = cpu_to_le32(9);
-	share_info = &shareinfo->shares[0];
-
-
-	ret = smbConvertToUTF16((__le16 *)share_info->domain_name,
-			workgroup, strlen(workgroup), 256, pipe->codepage);
-	if (ret < 0) {
-		free(shareinfo);
-		return -EINVAL;
-	}
-	comment_len = strlen(workgroup) + 1;
-
-	share_name_len = strlen(server_string) + 1;
-	cifssrv_debug("comment len = %d share len = %d \n",
-			comment_len, share_name_len);
-
-	ret = smbConvertToUTF16((__le16 *)share_info->server_name,
-			server_string, strlen(server_string), 256,
-			pipe->codepage);
-	if (ret < 0) {
-		free(shareinfo);
-		return -EINVAL;
-	}
-
-	share_info->str_info1.max_count = share_name_len;
-	share_info->str_info1.offset = 0;
-	share_info->str_info1.actual_count = share_name_len;
-
-	share_info->str_info2.max_count = comment_len;
-	share_info->str_info2.offset = 0;
-	share_info->str_info2.actual_count = comment_len;
-
-	shareinfo->status = cpu_to_le32(0);
 	return 0;
 }
 
 /**
  * wkkssvc_net_share_info() - get share info on wkssvc pipe
  * @server:		TCP server instance of connection
- * @data:		wkssvc request data
+ * @ndr:		cursor over NetrWkstaGetInfo request
  * @rpc_request_req:	rpc request
  *
  * Return:      0 on success or error number
  */
-int wkkssvc_net_share_info(struct cifssrv_pipe *pipe, char *data,
+int wkkssvc_net_share_info(struct cifssrv_pipe *pipe, struct ndr_cursor *ndr,
 				RPC_REQUEST_REQ *rpc_request_req)
 {
-	SRVSVC_REQ *req = (SRVSVC_REQ *)data;
-	char *server_unc_ptr, *server_unc;
-	int server_unc_len = 0;
+	struct ndr_unistr unc;
+	char *server_unc;
+	__u32 info_level;
 	int ret = 0;
-	int *info_level;
 
-	server_unc_ptr = (char *)(data + sizeof(SERVER_HANDLE));
-	server_unc = smb_strndup_from_utf16(server_unc_ptr,
-			req->server_unc_handle.handle_info.actual_count, 1,
-			pipe->codepage);
+	if (ndr_pull_unique_unistr(ndr, &unc) ||
+	    ndr_pull_u32(ndr, &info_level))
+		return -EINVAL;
+
+	server_unc = ndr_unistr_dup(&unc, pipe->codepage);
 	if (IS_ERR(server_unc))
 		return PTR_ERR(server_unc);
 
 	cifssrv_debug("server_unc = %s unc size = %d\n", server_unc,
-			req->server_unc_handle.handle_info.actual_count);
+			unc.units);
 	free(server_unc);
 
-	server_unc_len = 2 * req->server_unc_handle.handle_info.actual_count;
-	server_unc_len = ((server_unc_len + 3) & ~3);
-	/* Add 2 for Pad */
-	info_level = (int *)((char *)(server_unc_ptr + server_unc_len));
-
-	switch (le32_to_cpu(*info_level)) {
+	switch (info_level) {
 	case INFO_100:
-		cifssrv_debug("GOT WKSSVC pipe info level %u\n",
-			       le32_to_cpu(*info_level));
+		cifssrv_debug("GOT WKSSVC pipe info level %u\n", info_level);
 
 		ret = init_wkssvc_share_info2(pipe, rpc_request_req);
 		break;
 
 	default:
 		cifssrv_err("WKSSVC pipe info level %u  not supported\n",
-				req->info_level);
+				info_level);
 		return -EOPNOTSUPP;
 	}
 
@@ -1277,20 +1699,20 @@ int wkkssvc_net_share_info(struct cifssrv_pipe *pipe, char *data,
 }
 
 /**
- * rpc_request() - rpc request dispatcher
+ * srvsvc_rpc_request() - srvsvc and wkssvc request dispatcher
  * @server:	TCP server instance of connection
- * @in_data:	wkssvc request data
+ * @rpc_request_req:	rpc request
+ * @ndr:	cursor over request stub data
  *
  * parse rpc request command number, and call corresponding
  * command handler
  *
  * Return:      0 on success or error number
  */
-static int srvsvc_rpc_request(struct cifssrv_pipe *pipe, char *in_data)
+static int srvsvc_rpc_request(struct cifssrv_pipe *pipe,
+		RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
-	RPC_REQUEST_REQ *rpc_request_req = (RPC_REQUEST_REQ *)in_data;
 	int opnum;
-	char *data;
 	int ret = 0;
 
 	opnum = cpu_to_le16(rpc_request_req->opnum);
@@ -1298,18 +1720,15 @@ static int srvsvc_rpc_request(struct cifssrv_pipe *pipe, char *in_data)
 	switch (opnum) {
 	case SRV_NET_SHARE_ENUM_ALL:
 		cifssrv_debug("Got SRV_NET_SHARE_ENUM_ALL\n");
-		data = in_data + sizeof(RPC_REQUEST_REQ);
-		ret = srvsvc_net_share_enum_all(pipe, data, rpc_request_req);
+		ret = srvsvc_net_share_enum_all(pipe, ndr, rpc_request_req);
 		break;
 	case SRV_NET_SHARE_GETINFO:
 		cifssrv_debug("Got SRV_NET_SHARE_GETINFO\n");
-		data = in_data + sizeof(RPC_REQUEST_REQ);
-		ret = srvsvc_net_share_info(pipe, data, rpc_request_req);
+		ret = srvsvc_net_share_info(pipe, ndr, rpc_request_req);
 		break;
 	case WKSSVC_NET_SHARE_GETINFO:
 		cifssrv_debug("Got WKSSVC_SHARE_GETINFO\n");
-		data = in_data + sizeof(RPC_REQUEST_REQ);
-		ret = wkkssvc_net_share_info(pipe, data, rpc_request_req);
+		ret = wkkssvc_net_share_info(pipe, ndr, rpc_request_req);
 		break;
 	default:
 		cifssrv_debug("WKSSVC pipe opnum not supported = %d\n", opnum);
@@ -1318,86 +1737,35 @@ static int srvsvc_rpc_request(struct cifssrv_pipe *pipe, char *in_data)
 	return ret;
 }
 
-int winreg_rpc_request(struct cifssrv_pipe *pipe, char *in_data)
+#define WINREG_CALL_HANDLER(opnum, handler, rsp)			\
+	case opnum:							\
+		cifssrv_debug("Got " #opnum "\n");			\
+		ret = handler(pipe, rpc_request_req, ndr);		\
+		break;
+
+/**
+ * winreg_rpc_request() - winreg request dispatcher
+ * @pipe:	winreg pipe
+ * @rpc_request_req:	rpc request
+ * @ndr:	cursor over request stub data
+ *
+ * Return:      0 on success or error number
+ */
+int winreg_rpc_request(struct cifssrv_pipe *pipe,
+		RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
-	RPC_REQUEST_REQ *rpc_request_req = (RPC_REQUEST_REQ *)in_data;
 	int opnum;
-	char *data;
 	int ret = 0;
 
 	opnum = cpu_to_le16(rpc_request_req->opnum);
 	pipe->opnum = opnum;
-	data = in_data + sizeof(RPC_REQUEST_REQ);
 	cifssrv_debug("Opnum %d\n", opnum);
 
+	/* a new call means the client gave up on its pending notify */
+	winreg_cancel_watch(pipe);
+
 	switch (opnum) {
-	case WINREG_OPENHKCR:
-		cifssrv_debug("Got WINREG_OPENHKCR\n");
-		/* fall through */
-	case WINREG_OPENHKCU:
-		cifssrv_debug("Got WINREG_OPENHKCU\n");
-		/* fall through */
-	case WINREG_OPENHKLM:
-		cifssrv_debug("Got WINREG_OPENHKLM\n");
-		/* fall through */
-	case WINREG_OPENHKU:
-		cifssrv_debug("Got WINREG_OPENHKU\n");
-		ret = winreg_open_root_key(pipe,
-				opnum, rpc_request_req, data);
-		break;
-	case WINREG_GETVERSION:
-		cifssrv_debug("Got WINREG_GETVERSION\n");
-		ret = winreg_get_version(pipe, rpc_request_req, data);
-		break;
-	case WINREG_DELETEKEY:
-		cifssrv_debug("Got WINREG_DELETEKEY\n");
-		ret = winreg_delete_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_FLUSHKEY:
-		cifssrv_debug("Got WINREG_FLUSHKEY\n");
-		ret = winreg_flush_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_OPENKEY:
-		cifssrv_debug("Got WINREG_OPENKEY\n");
-		ret = winreg_open_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_CREATEKEY:
-		cifssrv_debug("Got WINREG_CREATEKEY\n");
-		ret = winreg_create_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_CLOSEKEY:
-		cifssrv_debug("Got WINREG_CLOSEKEY\n");
-		ret = winreg_close_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_ENUMKEY:
-		cifssrv_debug("Got WINREG_CLOSEKEY\n");
-		ret = winreg_enum_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_ENUMVALUE:
-		cifssrv_debug("Got WINREG_ENUMVALUE\n");
-		ret = winreg_enum_value(pipe, rpc_request_req, data);
-		break;
-	case WINREG_QUERYINFOKEY:
-		cifssrv_debug("Got WINREG_QUERYINFOKEY\n");
-		ret = winreg_query_info_key(pipe, rpc_request_req, data);
-		break;
-	case WINREG_NOTIFYCHANGEKEYVALUE:
-		cifssrv_debug("Got WINREG_NOTIFYCHANGEKEYVALUE\n");
-		ret = winreg_notify_change_key_value(pipe, rpc_request_req,
-									data);
-		break;
-	case WINREG_SETVALUE:
-		cifssrv_debug("Got WINREG_SETVALUE\n");
-		ret = winreg_set_value(pipe, rpc_request_req, data);
-		break;
-	case WINREG_QUERYVALUE:
-		cifssrv_debug("Got WINREG_QUERYVALUE\n");
-		ret = winreg_query_value(pipe, rpc_request_req, data);
-		break;
-	case WINREG_DELETEVALUE:
-		cifssrv_debug("Got WINREG_DELETEVALUE\n");
-		ret = winreg_delete_value(pipe, rpc_request_req, data);
-		break;
+	WINREG_IDL(WINREG_CALL_HANDLER)
 	default:
 		cifssrv_debug("WINREG pipe opnum not supported = %d\n", opnum);
 		return -EOPNOTSUPP;
@@ -1405,18 +1773,31 @@ int winreg_rpc_request(struct cifssrv_pipe *pipe, char *in_data)
 	return ret;
 }
 
-int rpc_request(struct cifssrv_pipe *pipe, char *in_data)
+/**
+ * rpc_request() - rpc request dispatcher
+ * @server:	TCP server instance of connection
+ * @in_data:	rpc request pdu
+ * @len:	length of request header and stub data
+ *
+ * Return:      0 on success or error number
+ */
+int rpc_request(struct cifssrv_pipe *pipe, char *in_data, int len)
 {
+	RPC_REQUEST_REQ *rpc_request_req = (RPC_REQUEST_REQ *)in_data;
+	struct ndr_cursor ndr;
 	int ret = 0;
+
+	ndr_init(&ndr, in_data + sizeof(RPC_REQUEST_REQ),
+			len - sizeof(RPC_REQUEST_REQ));
 	cifssrv_debug("server pipe request %d\n", pipe->pipe_type);
 	switch (pipe->pipe_type) {
 	case SRVSVC:
 		cifssrv_debug("SRVSVC pipe\n");
-		ret = srvsvc_rpc_request(pipe, in_data);
+		ret = srvsvc_rpc_request(pipe, rpc_request_req, &ndr);
 		break;
 	case WINREG:
 		cifssrv_debug("WINREG pipe\n");
-		ret = winreg_rpc_request(pipe, in_data);
+		ret = winreg_rpc_request(pipe, rpc_request_req, &ndr);
 		break;
 	default:
 		cifssrv_debug("pipe not supported\n");
@@ -1429,26 +1810,68 @@ int rpc_request(struct cifssrv_pipe *pipe, char *in_data)
  * rpc_bind() - rpc bind request handler
  * @server:	TCP server instance of connection
  * @in_data:	rpc bind request data
+ * @len:	length of bind pdu
  *
  * Return:      0 on success or error number
  */
-int rpc_bind(struct cifssrv_pipe *pipe, char *in_data)
+int rpc_bind(struct cifssrv_pipe *pipe, char *in_data, int len)
 {
-	RPC_BIND_REQ *rpc_bind_req = (RPC_BIND_REQ *)in_data;
+	RPC_BIND_REQ *rpc_bind_req;
 	char *pipe_name = NULL;
-	int len;
-	RPC_CONTEXT *rpc_context;
-	RPC_IFACE *transfer;
+	RPC_CONTEXT *rpc_context = NULL, *ctx;
+	RPC_IFACE *transfer = NULL, *syntaxes;
 	RPC_BIND_RSP *rpc_bind_rsp;
+	NEGOTIATE_MESSAGE *negblob = NULL;
+	RPC_AUTH_INFO *auth_info = NULL;
+	struct ndr_cursor ndr;
+	int str_len;
 	int version_maj;
 	int pipe_type;
 	int num_ctx;
 	int i = 0;
-	int offset = 0;
 
-	rpc_context = (RPC_CONTEXT *)(((char *)in_data) + sizeof(RPC_BIND_REQ));
-	transfer = (RPC_IFACE *)(((char *)in_data) + sizeof(RPC_BIND_REQ) +
-				   sizeof(RPC_CONTEXT));
+	ndr_init(&ndr, in_data, len);
+	if (ndr_pull_bytes(&ndr, (char **)&rpc_bind_req, sizeof(RPC_BIND_REQ)))
+		return -EINVAL;
+
+	num_ctx = rpc_bind_req->num_contexts;
+	for (i = 0; i < num_ctx; i++) {
+		if (ndr_pull_bytes(&ndr, (char **)&ctx, sizeof(RPC_CONTEXT)) ||
+		    ndr_pull_bytes(&ndr, (char **)&syntaxes,
+				ctx->num_transfer_syntaxes * sizeof(RPC_IFACE)))
+			return -EINVAL;
+
+		/* the first context with a transfer syntax is used */
+		if (!rpc_context && ctx->num_transfer_syntaxes) {
+			rpc_context = ctx;
+			transfer = syntaxes;
+		}
+	}
+	if (!rpc_context)
+		return -EINVAL;
+
+	if (rpc_bind_req->hdr.auth_len) {
+		/* auth verifier sits at the end of the pdu */
+		if (ndr_seek(&ndr, len - rpc_bind_req->hdr.auth_len -
+				sizeof(RPC_AUTH_INFO)) ||
+		    ndr.offset < sizeof(RPC_BIND_REQ) ||
+		    rpc_bind_req->hdr.auth_len <
+				offsetof(NEGOTIATE_MESSAGE, DomainName) ||
+		    ndr_pull_bytes(&ndr, (char **)&auth_info,
+				sizeof(RPC_AUTH_INFO)) ||
+		    ndr_pull_bytes(&ndr, (char **)&negblob,
+				rpc_bind_req->hdr.auth_len))
+			return -EINVAL;
+	}
+
+	if (pipe->pipe_type == WINREG &&
+	    (!auth_info || auth_info->auth_type != RPC_C_AUTHN_WINNT ||
+	     auth_info->auth_level < RPC_C_AUTHN_LEVEL_CONNECT ||
+	     auth_info->auth_level > RPC_C_AUTHN_LEVEL_PKT_PRIVACY)) {
+		cifssrv_err("winreg bind without NTLMSSP auth\n");
+		return -EACCES;
+	}
+
 	rpc_bind_rsp = (RPC_BIND_RSP *) calloc(1, sizeof(RPC_BIND_RSP));
 	if (!rpc_bind_rsp)
 		return -ENOMEM;
@@ -1492,22 +1915,18 @@ int rpc_bind(struct cifssrv_pipe *pipe, char *in_data)
 	} else if (pipe_type == WINREG) {
 		pipe_name = "\\PIPE\\winreg";
 		rpc_bind_rsp->BufferLength = 0;
+		ntlmssp_ctx_free(pipe->ntlmssp);
+		pipe->ntlmssp = NULL;
+		pipe->auth_level = 0;
 		if (rpc_bind_req->hdr.auth_len != 0) {
-			NEGOTIATE_MESSAGE *negblob;
 			CHALLENGE_MESSAGE *chgblob;
-			__le16 name[8];
-			while (i < num_ctx) {
-				offset  = offset + sizeof(RPC_CONTEXT);
-				i++;
-			}
-			rpc_bind_rsp->auth.auth_type = 10;
-			rpc_bind_rsp->auth.auth_level = 6;
+			struct ntlmssp_ctx *ctx;
+
+			rpc_bind_rsp->auth.auth_type = RPC_C_AUTHN_WINNT;
+			rpc_bind_rsp->auth.auth_level = auth_info->auth_level;
 			rpc_bind_rsp->auth.auth_pad_len = 0;
 			rpc_bind_rsp->auth.auth_reserved = 0;
-			rpc_bind_rsp->auth.auth_ctx_id = 1;
-			negblob = (NEGOTIATE_MESSAGE *)(((char *)in_data) +
-						sizeof(RPC_BIND_REQ) +
-						offset + sizeof(RPC_AUTH_INFO));
+			rpc_bind_rsp->auth.auth_ctx_id = auth_info->auth_ctx_id;
 			if (!memcmp(negblob->Signature, "NTLMSSP", 8))
 				cifssrv_debug("%s NTLMSSP present\n", __func__);
 			else
@@ -1515,18 +1934,26 @@ int rpc_bind(struct cifssrv_pipe *pipe, char *in_data)
 								__func__);
 			if (negblob->MessageType == NtLmNegotiate) {
 				cifssrv_debug("%s negotiate phase\n", __func__);
-				len = smbConvertToUTF16(name, netbios_name,
-							strlen(netbios_name),8,
-							pipe->codepage);
-				rpc_bind_rsp->Buffer = malloc(
-					sizeof(CHALLENGE_MESSAGE) +
-					sizeof(TargetInfo)*5 +
-					UNICODE_LEN(len)*4);
-				chgblob = (CHALLENGE_MESSAGE *)
-						rpc_bind_rsp->Buffer;
-				rpc_bind_rsp->BufferLength =
-					build_ntlmssp_challenge_blob(chgblob,
-							pipe->codepage);
+				chgblob = build_ntlmssp_challenge_blob(
+						pipe->codepage,
+						&rpc_bind_rsp->BufferLength);
+				if (IS_ERR(chgblob)) {
+					free(rpc_bind_rsp->addr.sec_addr);
+					free(rpc_bind_rsp);
+					return PTR_ERR(chgblob);
+				}
+
+				ctx = ntlmssp_ctx_new(negblob, chgblob);
+				if (IS_ERR(ctx)) {
+					free(chgblob);
+					free(rpc_bind_rsp->addr.sec_addr);
+					free(rpc_bind_rsp);
+					return PTR_ERR(ctx);
+				}
+				pipe->ntlmssp = ctx;
+				pipe->auth_level = auth_info->auth_level;
+				pipe->auth_ctx_id = auth_info->auth_ctx_id;
+				rpc_bind_rsp->Buffer = (__u8 *)chgblob;
 			}
 		}
 
@@ -1538,10 +1965,10 @@ int rpc_bind(struct cifssrv_pipe *pipe, char *in_data)
 	}
 
 	memcpy(rpc_bind_rsp->addr.sec_addr, pipe_name, strlen(pipe_name));
-	len = strlen(pipe_name) + 1;
-	rpc_bind_rsp->addr.sec_addr[len - 1] = '\0';
-	rpc_bind_rsp->addr.sec_addr_len = len;
-	cifssrv_debug("pipe_name len = %d\n", len);
+	str_len = strlen(pipe_name) + 1;
+	rpc_bind_rsp->addr.sec_addr[str_len - 1] = '\0';
+	rpc_bind_rsp->addr.sec_addr_len = str_len;
+	cifssrv_debug("pipe_name len = %d\n", str_len);
 
 	/* Results */
 	rpc_bind_rsp->results.num_results = 1;
@@ -1566,86 +1993,269 @@ int rpc_bind(struct cifssrv_pipe *pipe, char *in_data)
 }
 
 /**
- * handle_netshareenum_info1() - helper function for share info using LANMAN
- *		request
- * @server:	TCP server instance of connection
- * @in_params:	LANMAN request parameters
- * @out_data:	output response buffer
+ * rpc_auth3() - rpc AUTH3 handler, completes NTLMSSP started at bind
+ * @pipe:	pipe the pdu was written to
+ * @in_data:	rpc auth3 pdu
+ * @len:	length of auth3 pdu
  *
- * Return:      response buffer size or error number
+ * Return:      0 on success or error number
  */
-static int handle_netshareenum_info1(struct cifssrv_pipe *pipe,
-				     LANMAN_PARAMS *in_params, char *out_data)
+int rpc_auth3(struct cifssrv_pipe *pipe, char *in_data, int len)
 {
-	LANMAN_NETSHAREENUM_RESP *resp;
-	NETSHAREINFO1 *info1;
-	struct list_head *tmp;
-	struct cifssrv_share *share;
-	int out_buffersize, comment_len = 0, comment_offset;
-	int num_shares = 0;
-	char *comment_buf;
+	RPC_HDR *hdr = (RPC_HDR *)in_data;
+	RPC_AUTH_INFO *auth_info;
+	struct ndr_cursor ndr;
+	char *authblob;
+	int ret;
+
+	if (!pipe->ntlmssp || !hdr->auth_len)
+		return -EACCES;
+
+	ndr_init(&ndr, in_data, len);
+	if (ndr_seek(&ndr, len - hdr->auth_len - sizeof(RPC_AUTH_INFO)) ||
+	    ndr.offset < sizeof(RPC_HDR) ||
+	    ndr_pull_bytes(&ndr, (char **)&auth_info, sizeof(RPC_AUTH_INFO)) ||
+	    ndr_pull_bytes(&ndr, &authblob, hdr->auth_len))
+		return -EINVAL;
 
-	resp = (LANMAN_NETSHAREENUM_RESP *)out_data;
-	info1 = (NETSHAREINFO1 *)resp->RAPOutData;
-	num_shares = cifssrv_num_shares;
-	comment_offset = num_shares * sizeof(NETSHAREINFO1);
+	if (auth_info->auth_type != RPC_C_AUTHN_WINNT ||
+	    auth_info->auth_ctx_id != pipe->auth_ctx_id)
+		return -EINVAL;
 
-/*
- * TBD: To replace with actual user configuration part,
- * need to decide complete logic to get this information
+	ret = ntlmssp_authenticate(pipe->ntlmssp, authblob, hdr->auth_len,
+			pipe->codepage);
+	if (ret) {
+		cifssrv_err("NTLMSSP authentication failed %d\n", ret);
+		/* a failed handshake cannot be resumed, rebind to retry */
+		ntlmssp_ctx_free(pipe->ntlmssp);
+		pipe->ntlmssp = NULL;
+		pipe->auth_level = 0;
+	}
+	return ret;
+}
+
+static const int rap_share_entry_size[INFO_2 + 1] = {
+	sizeof(NETSHAREINFO0),
+	sizeof(NETSHAREINFO1),
+	sizeof(NETSHAREINFO2),
+};
+
+/**
+ * rap_share_str_copy() - copy strings referred by a RAP share entry
+ * @buf:	buffer to copy to, or NULL to only get the size
+ * @share:	share to describe
+ * @level:	share info level requested by client
+ *
+ * Return:      size of the strings, or error number
  */
-#if 1
-	list_for_each(tmp, &cifssrv_share_list) {
-		memset(info1, 0, sizeof(NETSHAREINFO1));
-		share = list_entry(tmp, struct cifssrv_share, list);
-		memcpy(info1->NetworkName, share->sharename,
+static int rap_share_str_copy(char *buf, struct cifssrv_share *share,
+			      int level)
+{
+	char *comment, *path;
+	int len, path_len;
+
+	if (level == INFO_0)
+		return 0;
+
+	if (!strcmp(share->sharename, STR_IPC))
+		comment = "IPC share";
+	else if (share->config.comment)
+		comment = share->config.comment;
+	else
+		comment = share->sharename;
+
+	len = strlen(comment) + 1;
+	if (buf)
+		memcpy(buf, comment, len);
+	if (level == INFO_1)
+		return len;
+
+	path = share_dos_path(share);
+	if (!path)
+		return -ENOMEM;
+	path_len = strlen(path) + 1;
+	if (buf)
+		memcpy(buf + len, path, path_len);
+	free(path);
+	return len + path_len;
+}
+
+/**
+ * rap_share_entry_fill() - fill fixed part of a RAP share entry
+ * @entry:	entry to fill, zeroed
+ * @share:	share to describe
+ * @level:	share info level requested by client
+ * @str_offset:	offset of the share strings from the start of strings
+ */
+static void rap_share_entry_fill(char *entry, struct cifssrv_share *share,
+				 int level, int str_offset)
+{
+	NETSHAREINFO2 *info2 = (NETSHAREINFO2 *)entry;
+	char *comment;
+	int type;
+
+	/* level 0 and 1 are prefixes of level 2 */
+	memcpy(info2->NetworkName, share->sharename,
 			strlen(share->sharename));
+	if (level == INFO_0)
+		return;
+
+	type = strcmp(share->sharename, STR_IPC) ? STYPE_DISKTREE : STYPE_IPC;
+	info2->Type = cpu_to_le16(type);
+	info2->RemarkOffsetLow = cpu_to_le16(str_offset);
+	if (level == INFO_1)
+		return;
+
+	if (!strcmp(share->sharename, STR_IPC))
+		comment = "IPC share";
+	else if (share->config.comment)
+		comment = share->config.comment;
+	else
+		comment = share->sharename;
+
+	info2->Permissions = cpu_to_le16(ACCESS_NONE);
+	info2->MaxUses = cpu_to_le16(0xFFFF);
+	info2->PathOffsetLow = cpu_to_le16(str_offset + strlen(comment) + 1);
+}
+
+/**
+ * rap_share_enum_build() - render NetShareEnum data of an info level
+ * @cache:	cache entry of the level
+ * @level:	share info level
+ *
+ * Shares with names longer than 12 characters cannot be described to
+ * LANMAN clients and are left out.
+ *
+ * Return:      0 on success, otherwise error number
+ */
+static int rap_share_enum_build(struct rap_share_enum *cache, int level)
+{
+	struct cifssrv_share *share;
+	struct list_head *tmp;
+	int entry_size = rap_share_entry_size[level];
+	int n = 0, str_len = 0, len;
 
-		comment_buf = resp->RAPOutData + comment_offset;
+	free(cache->entries);
+	free(cache->strings);
+	free(cache->str_end);
+	memset(cache, 0, sizeof(struct rap_share_enum));
 
-		info1->RemarkOffsetLow = comment_offset;
+	list_for_each(tmp, &cifssrv_share_list) {
+		share = list_entry(tmp, struct cifssrv_share, list);
+		len = rap_share_str_copy(NULL, share, level);
+		if (len < 0)
+			return len;
+		str_len += len;
+	}
 
-		info1->RemarkOffsetHigh = 0;
+	cache->entries = calloc(cifssrv_num_shares, entry_size);
+	cache->str_end = calloc(cifssrv_num_shares, sizeof(int));
+	cache->strings = malloc(str_len + 1);
+	if (!cache->entries || !cache->str_end || !cache->strings)
+		goto err;
 
-		if (strcmp(share->sharename, STR_IPC) == 0) {
-			info1->Type = STYPE_IPC;
-			comment_len = strlen("IPC share");
-			memcpy(comment_buf, "IPC share", comment_len);
-		} else {
-			if (share->config.comment) {
-				comment_len = strlen(share->config.comment);
-				memcpy(comment_buf, share->config.comment,
-				       comment_len);
-			} else {
-				comment_len = strlen(share->sharename);
-				memcpy(comment_buf, share->config.comment,
-				       comment_len);
-			}
-			info1->Type = STYPE_DISKTREE;
+	str_len = 0;
+	list_for_each(tmp, &cifssrv_share_list) {
+		share = list_entry(tmp, struct cifssrv_share, list);
+		if (strlen(share->sharename) > 12) {
+			cifssrv_debug("share %s too long for LANMAN\n",
+					share->sharename);
+			continue;
 		}
 
-		/* Increment for '\0' */
-		comment_buf[comment_len] = '\0';
-		comment_len++;
-		comment_offset += comment_len;
+		rap_share_entry_fill(cache->entries + n * entry_size, share,
+				level, str_len);
+		len = rap_share_str_copy(cache->strings + str_len, share,
+				level);
+		if (len < 0)
+			goto err;
+		str_len += len;
+		cache->str_end[n++] = str_len;
+	}
+
+	cache->num_entries = n;
+	cache->entry_size = entry_size;
+	cache->gen = cifssrv_share_gen;
+	cache->valid = 1;
+	cifssrv_debug("rendered %d shares at level %d, %d string bytes\n",
+			n, level, str_len);
+	return 0;
+
+err:
+	free(cache->entries);
+	free(cache->strings);
+	free(cache->str_end);
+	memset(cache, 0, sizeof(struct rap_share_enum));
+	return -ENOMEM;
+}
+
+/**
+ * handle_netshareenum_level() - helper function for share info using
+ *		LANMAN request
+ * @pipe:	LANMAN pipe
+ * @in_params:	LANMAN request parameters
+ * @out_data:	output response buffer
+ * @level:	share info level 0, 1 or 2
+ *
+ * Returns as many entries as fit in the client receive buffer, with
+ * ERROR_MORE_DATA when some are left out.
+ *
+ * Return:      response buffer size or error number
+ */
+static int handle_netshareenum_level(struct cifssrv_pipe *pipe,
+			LANMAN_PARAMS *in_params, char *out_data, int level)
+{
+	struct rap_share_enum *cache = &rap_share_enum[level];
+	LANMAN_NETSHAREENUM_RESP *resp;
+	NETSHAREINFO2 *info2;
+	int bufsize, max_size, n, i, size, str_len, ret;
+	char *data;
 
-		cifssrv_debug("share %s added comment_offset = %d\n",
-				share->sharename, comment_offset);
-		info1++;
+	if (!cache->valid || cache->gen != cifssrv_share_gen) {
+		ret = rap_share_enum_build(cache, level);
+		if (ret)
+			return ret;
 	}
-#endif
 
-	out_buffersize = sizeof(LANMAN_NETSHAREENUM_RESP) - 1 + comment_offset;
+	bufsize = le16_to_cpu(in_params->ReceiveBufferSize);
+	max_size = NETLINK_CIFSSRV_MAX_PAYLOAD -
+			offsetof(LANMAN_NETSHAREENUM_RESP, RAPOutData);
+	if (bufsize > max_size)
+		bufsize = max_size;
 
-	resp->Win32ErrorCode = 0;
+	size = cache->entry_size;
+	for (n = cache->num_entries; n > 0; n--) {
+		if (n * size + cache->str_end[n - 1] <= bufsize)
+			break;
+	}
+	str_len = n ? cache->str_end[n - 1] : 0;
+
+	resp = (LANMAN_NETSHAREENUM_RESP *)out_data;
+	data = resp->RAPOutData;
+	memcpy(data, cache->entries, n * size);
+	memcpy(data + n * size, cache->strings, str_len);
+
+	/* strings start right after the entries returned */
+	for (i = 0; level != INFO_0 && i < n; i++) {
+		info2 = (NETSHAREINFO2 *)(data + i * size);
+		info2->RemarkOffsetLow = cpu_to_le16(n * size +
+				le16_to_cpu(info2->RemarkOffsetLow));
+		if (level == INFO_2)
+			info2->PathOffsetLow = cpu_to_le16(n * size +
+					le16_to_cpu(info2->PathOffsetLow));
+	}
+
+	resp->Win32ErrorCode = cpu_to_le16(n < cache->num_entries ?
+			ERROR_MORE_DATA : 0);
 	resp->Converter = 0;
-	resp->EntriesReturned = num_shares;
-	resp->EntriesAvailable = num_shares;
+	resp->EntriesReturned = cpu_to_le16(n);
+	resp->EntriesAvailable = cpu_to_le16(cache->num_entries);
 
-	cifssrv_debug("num_shares = %d out buffer size = %d\n",
-			num_shares, out_buffersize);
+	cifssrv_debug("returned %d of %d shares in %d byte buffer\n",
+			n, cache->num_entries, bufsize);
 
-	return out_buffersize;
+	return offsetof(LANMAN_NETSHAREENUM_RESP, RAPOutData) +
+		n * size + str_len;
 }
 
 /**
@@ -1688,9 +2298,12 @@ static int handle_netshareenum(struct cifssrv_pipe *pipe, LANMAN_REQ *req,
 	cifssrv_debug("info_level = %d\n", info_level);
 
 	switch (info_level) {
+	case INFO_0:
 	case INFO_1:
-		cifssrv_debug("GOT RAP_NetshareEnum Info1\n");
-		ret = handle_netshareenum_info1(pipe, in_params, out_data);
+	case INFO_2:
+		cifssrv_debug("GOT RAP_NetshareEnum Info%d\n", info_level);
+		ret = handle_netshareenum_level(pipe, in_params, out_data,
+				info_level);
 		break;
 	default:
 		cifssrv_debug("Info level = %d not supported\n", info_level);
@@ -1700,6 +2313,47 @@ static int handle_netshareenum(struct cifssrv_pipe *pipe, LANMAN_REQ *req,
 	return ret;
 }
 
+/*
+ * WkstaGetInfo level 10 strings that only depend on [global]: the info
+ * structure with the computer name, and the workgroup three times as
+ * lan group, logon domain and other domain. The user name goes between.
+ */
+static struct {
+	int valid;
+	unsigned int gen;
+	int head_len;
+	int group_len;
+	char head[sizeof(NETWKSTAGEINFO10) + MAX_SERVER_NAME_LEN];
+	char tail[3 * MAX_SERVER_WRKGRP_LEN];
+} lanman_wksta;
+
+/**
+ * lanman_wksta_encode() - pre-encode WkstaGetInfo level 10 strings
+ */
+static void lanman_wksta_encode(void)
+{
+	NETWKSTAGEINFO10 *info10 = (NETWKSTAGEINFO10 *)lanman_wksta.head;
+	int len, i;
+
+	memset(info10, 0, sizeof(NETWKSTAGEINFO10));
+	info10->ComputerName = sizeof(NETWKSTAGEINFO10);
+	info10->VerMajor = CIFSSRV_MAJOR_VERSION;
+	info10->VerMinor = CIFSSRV_MINOR_VERSION;
+
+	len = strlen(server_string) + 1;
+	memcpy(lanman_wksta.head + sizeof(NETWKSTAGEINFO10),
+			server_string, len);
+	lanman_wksta.head_len = sizeof(NETWKSTAGEINFO10) + len;
+
+	len = strlen(workgroup) + 1;
+	for (i = 0; i < 3; i++)
+		memcpy(lanman_wksta.tail + i * len, workgroup, len);
+	lanman_wksta.group_len = len;
+
+	lanman_wksta.gen = cifssrv_global_gen;
+	lanman_wksta.valid = 1;
+}
+
 /**
  * handle_wkstagetinfo_info10() - helper function to get target info command
  *		using LANMAN request
@@ -1714,81 +2368,40 @@ int handle_wkstagetinfo_info10(struct cifssrv_pipe *pipe,
 {
 	LANMAN_WKSTAGEINFO_RESP *resp;
 	NETWKSTAGEINFO10 *info10;
-	int out_buffersize;
 	int offset, len;
 	char *data;
-	int user_valid = 0;
 
-	resp = (LANMAN_WKSTAGEINFO_RESP *)out_data;
+	/* there is no default user to report */
+	if (pipe->username[0] == '\0')
+		return -EINVAL;
 
-	offset = sizeof(NETWKSTAGEINFO10);
+	if (!lanman_wksta.valid || lanman_wksta.gen != cifssrv_global_gen)
+		lanman_wksta_encode();
 
-	info10 = (NETWKSTAGEINFO10 *)resp->RAPOutData;
+	resp = (LANMAN_WKSTAGEINFO_RESP *)out_data;
 	data = resp->RAPOutData;
+	info10 = (NETWKSTAGEINFO10 *)data;
 
-	/* Add name of workstation */
-	data += offset;
-	info10->ComputerName = offset;
-	len = strlen(server_string);
-	memcpy(data, server_string, len);
-	data[len] = '\0';
-	offset += len + 1;
-	data += len + 1;
+	memcpy(data, lanman_wksta.head, lanman_wksta.head_len);
+	offset = lanman_wksta.head_len;
 
-	/* Add user name */
+	/* Add user name, the domain offsets follow from its length */
 	info10->UserName = offset;
-	if (pipe->username[0] != '\0')
-		user_valid = 1;
-
-	/* If valid user is found provide logged in user
-	   otherwise send default user "root" */
-	if (user_valid) {
-		len = strlen(pipe->username);
-		memcpy(data, pipe->username, len);
-	} else {
-		return -EINVAL;
-	}
-
-	data[len] = '\0';
-	offset += len + 1;
-	data += len + 1;
+	len = strlen(pipe->username) + 1;
+	memcpy(data + offset, pipe->username, len);
+	offset += len;
 
-	/* Add Domain name */
 	info10->LanGroup = offset;
-	len = strlen(workgroup);
-	memcpy(data, workgroup, len);
-	data[len] = '\0';
-	offset += len + 1;
-	data += len + 1;
-
-	/* Add Major version*/
-	info10->VerMajor = CIFSSRV_MAJOR_VERSION;
-
-	/* Add Minor Version */
-	info10->VerMinor = CIFSSRV_MINOR_VERSION;
-
-	/* User logged domain */
-	info10->LogonDomain = offset;
-	len = strlen(workgroup);
-	memcpy(data, workgroup, len);
-	data[len] = '\0';
-	offset += len + 1;
-	data += len + 1;
-
-	/* All domains */
-	info10->OtherDomain = offset;
-	len = strlen(workgroup);
-	memcpy(data, workgroup, len);
-	data[len] = '\0';
-	offset += len + 1;
+	info10->LogonDomain = offset + lanman_wksta.group_len;
+	info10->OtherDomain = offset + 2 * lanman_wksta.group_len;
+	memcpy(data + offset, lanman_wksta.tail, 3 * lanman_wksta.group_len);
+	offset += 3 * lanman_wksta.group_len;
 
 	resp->TotalBytesAvailable = offset;
 	resp->Win32ErrorCode = 0;
 	resp->Converter = 0;
 
-	out_buffersize = offset + sizeof(LANMAN_WKSTAGEINFO_RESP) - 1;
-
-	return out_buffersize;
+	return offset + sizeof(LANMAN_WKSTAGEINFO_RESP) - 1;
 }
 
 /**
@@ -24,11 +24,14 @@
 
 #include "cifssrv.h"
 #include "ntlmssp.h"
+#include "ndr.h"
+#include "rpc_idl.h"
 
 /* these are win32 error codes. */
 #define WERR_OK			0x00000000
 #define WERR_BAD_FILE		0x00000002
 #define WERR_ACCESS_DENIED	0x00000005
+#define WERR_INVALID_HANDLE	0x00000006
 #define WERR_NOT_SUPPORTED	0x00000032
 #define WERR_INVALID_PARAMETER	0x00000057
 #define WERR_INVALID_NAME	0x0000007B
@@ -42,6 +45,20 @@
 #define RPC_FLAG_FIRST	0x01
 #define RPC_FLAG_LAST	0x02
 
+/* auth verifier, NTLMSSP is the only supported auth_type */
+#define RPC_C_AUTHN_WINNT		10
+#define RPC_C_AUTHN_LEVEL_NONE		1
+#define RPC_C_AUTHN_LEVEL_CONNECT	2
+#define RPC_C_AUTHN_LEVEL_CALL		3
+#define RPC_C_AUTHN_LEVEL_PKT		4
+#define RPC_C_AUTHN_LEVEL_PKT_INTEGRITY	5
+#define RPC_C_AUTHN_LEVEL_PKT_PRIVACY	6
+#define RPC_AUTH_PAD_ALIGN		16
+
+/* limits for reassembly of fragmented requests */
+#define RPC_MAX_REQ_SIZE	(1024 * 1024)
+#define RPC_MAX_FRAG_TOTAL	(8 * 1024 * 1024)
+
 /* DCE/RPC packet types */
 enum RPC_PKT_TYPE {
 	RPC_REQUEST	= 0x00,    /* Ordinary request. */
@@ -78,6 +95,9 @@ enum RPC_PKT_TYPE {
 #define RAP_NetshareEnum	0
 #define RAP_WkstaGetInfo       63
 
+/* RAP status returned when only some entries fit the receive buffer */
+#define ERROR_MORE_DATA		234
+
 /* Shares type */
 #define STYPE_DISKTREE 0
 #define STYPE_PRINTQ 1
@@ -88,9 +108,18 @@ enum RPC_PKT_TYPE {
 
 /* Info Level Values*/
 
+#define INFO_0		0
 #define INFO_1		1
+#define INFO_2		2
 #define INFO_10		10
 #define INFO_100	100
+#define INFO_501	501
+#define INFO_502	502
+
+/* Share permissions and client side caching values for info 2/501 */
+#define ACCESS_NONE		0
+#define SHI_USES_UNLIMITED	0xFFFFFFFF
+#define CSC_CACHE_MANUAL_REFERENCE	0x00
 
 /* RPC_HDR - dce rpc header */
 typedef struct rpc_hdr_info {
@@ -199,46 +228,42 @@ typedef struct unistr_info {
 	__u32 actual_count;
 } __attribute__((packed)) UNISTR_INFO;
 
-typedef struct server_handle {
-	__u32 ref_id;
-	UNISTR_INFO handle_info;
-} __attribute__((packed)) SERVER_HANDLE;
-
-typedef struct srvsvc_req {
-	SERVER_HANDLE server_unc_handle;
-	char  *server_unc; /* unicode */
-	__u32 info_level;
-} SRVSVC_REQ;
-
-typedef struct srvsvc_share_ptr_info1 {
+/*
+ * Fixed part of SHARE_INFO_0/1/2/501/502. Only the fields of the
+ * requested info level are put on the wire, see srvsvc_share_ptr_copy().
+ */
+typedef struct srvsvc_share_ptr_info {
 	__u32 ptr_netname; /* pointer to net name. */
 	__u32 type; /* ipc, print, disk ... */
 	__u32 ptr_remark; /* pointer to comment. */
-} __attribute__((packed)) PTR_INFO1;
-
-typedef struct srvsvc_share_info1 {
+	__u32 permissions;
+	__u32 max_uses;
+	__u32 current_uses;
+	__u32 ptr_path; /* pointer to local path. */
+	__u32 ptr_passwd; /* pointer to password, always null */
+	__u32 reserved; /* security descriptor length */
+	__u32 ptr_sd; /* pointer to security descriptor, always null */
+	__u32 csc_flags; /* client side caching flags */
+} PTR_INFO;
+
+/* sharename, comment and path point to the share's pre-encoded strings */
+typedef struct srvsvc_share_info {
 	UNISTR_INFO str_info1;
-	char sharename[256];
+	__le16 *sharename;
 	UNISTR_INFO str_info2;
-	char comment[256];
-} SRVSVC_SHARE_INFO1;
-
-typedef struct srvsvc_share_common_info {
-	__u32 info_level;
-	__u32 switch_value;
-	__u32 ptr_share_info;
+	__le16 *comment;
+	UNISTR_INFO str_info3;
+	__le16 *path;
+} SRVSVC_SHARE_INFO;
 
-	__u32 num_entries;
-	__u32 ptr_entries;
-	__u32 num_entries2;
-} __attribute__((packed)) SRVSVC_SHARE_COMMON_INFO;
+NDR_STRUCT(srvsvc_share_common_info, SRVSVC_SHARE_COMMON_INFO)
 
 typedef struct srvsvc_share_info_ctr {
 	RPC_REQUEST_RSP rpc_request_rsp;
 	SRVSVC_SHARE_COMMON_INFO info;
 
-	PTR_INFO1 *ptrs;
-	SRVSVC_SHARE_INFO1 *shares;
+	PTR_INFO *ptrs;
+	SRVSVC_SHARE_INFO *shares;
 	__u32 total_entries;
 	__u32 resume_handle;
 	__u32 status;
@@ -250,31 +275,45 @@ typedef struct srvsvc_share_getinfo {
 	__u32 switch_value;
 	__u32 ptr_share_info;
 
-	PTR_INFO1 *ptrs;
+	PTR_INFO *ptrs;
 
-	SRVSVC_SHARE_INFO1 *shares;
+	SRVSVC_SHARE_INFO *shares;
 	__u32 status;
 } SRVSVC_SHARE_GETINFO;
 
-typedef struct wkssvc_share_info1 {
-	UNISTR_INFO str_info1;
-	char server_name[256];
-	UNISTR_INFO str_info2;
-	char domain_name[256];
-} WKSSVC_SHARE_INFO1;
+NDR_STRUCT(wkssvc_wksta_info, WKSSVC_WKSTA_INFO)
 
+/* srvsvc responses, encoded from the structures above */
+NDR_ENCODER(srvsvc_share_enum_hdr, SRVSVC_SHARE_ENUM_HDR,
+		SRVSVC_SHARE_INFO_CTR)
+NDR_ENCODER(srvsvc_share_enum_tail, SRVSVC_SHARE_ENUM_TAIL,
+		SRVSVC_SHARE_INFO_CTR)
+NDR_ENCODER(srvsvc_share_getinfo_hdr, SRVSVC_SHARE_GETINFO_HDR,
+		SRVSVC_SHARE_GETINFO)
+NDR_ENCODER(srvsvc_share_getinfo_tail, SRVSVC_SHARE_GETINFO_TAIL,
+		SRVSVC_SHARE_GETINFO)
+
+#define SRVSVC_SHARE_INFO_ENCODER(level, tag, NAME)			\
+	NDR_ENCODER(tag, NAME, PTR_INFO)
+SRVSVC_SHARE_INFO_LEVELS(SRVSVC_SHARE_INFO_ENCODER)
+
+/*
+ * Response pre-encoded for one client codepage. It only depends on the
+ * [global] section, so it is rebuilt when cifssrv_global_gen moves on.
+ * Pipes hold a reference until the response is read.
+ */
+struct rpc_rsp_cache {
+	struct list_head list;
+	char codepage[CIFSSRV_CODEPAGE_LEN];
+	unsigned int gen;
+	int refcount;
+	int len;
+	char data[0];
+};
 
 typedef struct wkssvc_share_getinfo {
 	RPC_REQUEST_RSP rpc_request_rsp;
-	__u32 info_level;
-	__u32 refid;
-	__u32 platform_id;
-	__u32 ref_id1;
-	__u32 ref_id2;
-	__u32 maj;
-	__u32 min;
-	WKSSVC_SHARE_INFO1 *shares;
-	__u32 status;
+	struct rpc_rsp_cache *rsp;
 } WKSSVC_SHARE_GETINFO;
 
 /* LANMAN PIPE STRUCTURES */
@@ -297,6 +336,10 @@ typedef struct lanman_netshareenum_resp {
 	char  RAPOutData[1];
 } __attribute__((packed)) LANMAN_NETSHAREENUM_RESP;
 
+typedef struct netshareinfo0 {
+	__u8 NetworkName[13];
+} __attribute__((packed)) NETSHAREINFO0;
+
 typedef struct netshareinfo1 {
 	__u8 NetworkName[13];
 	__u8 Pad;
@@ -305,6 +348,21 @@ typedef struct netshareinfo1 {
 	__u16 RemarkOffsetHigh;
 } __attribute__((packed)) NETSHAREINFO1;
 
+typedef struct netshareinfo2 {
+	__u8 NetworkName[13];
+	__u8 Pad;
+	__u16 Type;
+	__u16 RemarkOffsetLow;
+	__u16 RemarkOffsetHigh;
+	__u16 Permissions;
+	__u16 MaxUses;
+	__u16 CurrentUses;
+	__u16 PathOffsetLow;
+	__u16 PathOffsetHigh;
+	__u8 Password[9];
+	__u8 Pad2;
+} __attribute__((packed)) NETSHAREINFO2;
+
 typedef struct lanman_wkstageinfo_resp {
 	__u16 Win32ErrorCode;
 	__u16 Converter;
@@ -324,18 +382,20 @@ typedef struct netwkstageinfo10 {
 
 /* DCERPC Functions */
 
-int process_rpc(struct cifssrv_pipe *pipe, char *data);
+int process_rpc(struct cifssrv_pipe *pipe, char *data, int len);
 int process_rpc_rsp(struct cifssrv_pipe *pipe, char *data_buf, int size);
 
 void dcerpc_header_init(RPC_HDR *header, int packet_type,
 					int flags, int call_id);
-int rpc_bind(struct cifssrv_pipe *pipe, char *data);
-int rpc_request(struct cifssrv_pipe *pipe, char *data);
+int rpc_bind(struct cifssrv_pipe *pipe, char *data, int len);
+int rpc_auth3(struct cifssrv_pipe *pipe, char *data, int len);
+int rpc_request(struct cifssrv_pipe *pipe, char *data, int len);
 int rpc_read_bind_data(struct cifssrv_pipe *pipe, char *data);
 int rpc_read_winreg_data(struct cifssrv_pipe *pipe, char *outdata,
 							int buf_len);
 
-int winreg_rpc_request(struct cifssrv_pipe *pipe, char *in_data);
+int winreg_rpc_request(struct cifssrv_pipe *pipe,
+		RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 /* SRVSVC pipe function */
 
 int rpc_read_srvsvc_data(struct cifssrv_pipe *pipe,
@@ -0,0 +1,148 @@
+/*
+ *   cifssrv-tools/cifssrvd/ndr.c
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "ndr.h"
+
+/**
+ * ndr_pull_unistr() - pull a conformant varying UTF-16 string
+ * @ndr:	request cursor
+ * @str:	set to the string inside the request buffer
+ *
+ * The string is max_count, offset and actual_count followed by the
+ * characters, padded to 4 bytes.
+ *
+ * Return:	0 on success, otherwise -EINVAL
+ */
+int ndr_pull_unistr(struct ndr_cursor *ndr, struct ndr_unistr *str)
+{
+	int start = ndr->offset;
+	__u32 max_count, offset, actual_count;
+
+	if (ndr_pull_u32(ndr, &max_count) ||
+	    ndr_pull_u32(ndr, &offset) ||
+	    ndr_pull_u32(ndr, &actual_count))
+		goto err;
+
+	if (offset != 0 || actual_count > max_count ||
+	    actual_count > (ndr->len - ndr->offset) / 2)
+		goto err;
+
+	str->units = actual_count;
+	if (ndr_pull_bytes(ndr, &str->data, actual_count * 2))
+		goto err;
+
+	/* trailing pad may be cut off at the end of stub data */
+	if (ndr_align(ndr, 4))
+		ndr->offset = ndr->len;
+	return 0;
+
+err:
+	ndr->offset = start;
+	return -EINVAL;
+}
+
+/**
+ * ndr_pull_unique_unistr() - pull a unique pointer to UTF-16 string
+ * @ndr:	request cursor
+ * @str:	set to the string, data is NULL for a null pointer
+ *
+ * Return:	0 on success, otherwise -EINVAL
+ */
+int ndr_pull_unique_unistr(struct ndr_cursor *ndr, struct ndr_unistr *str)
+{
+	int start = ndr->offset;
+	__u32 ref_id;
+
+	if (ndr_pull_u32(ndr, &ref_id))
+		return -EINVAL;
+
+	if (!ref_id) {
+		str->data = NULL;
+		str->units = 0;
+		return 0;
+	}
+
+	if (ndr_pull_unistr(ndr, str)) {
+		ndr->offset = start;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * ndr_pull_lsa_string() - pull a counted UTF-16 string
+ * @ndr:	request cursor
+ * @str:	set to the string, data is NULL for a null pointer
+ *
+ * This is the length/size/pointer form used by winreg_String.
+ *
+ * Return:	0 on success, otherwise -EINVAL
+ */
+int ndr_pull_lsa_string(struct ndr_cursor *ndr, struct ndr_unistr *str)
+{
+	int start = ndr->offset;
+	__u16 len, size;
+
+	if (ndr_pull_u16(ndr, &len) || ndr_pull_u16(ndr, &size) ||
+	    len > size || ndr_pull_unique_unistr(ndr, str) ||
+	    str->units * 2 > size) {
+		ndr->offset = start;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * ndr_pull_array() - pull a conformant byte array
+ * @ndr:	request cursor
+ * @data:	set to the array inside the request buffer
+ * @count:	set to the number of bytes in the array
+ *
+ * Return:	0 on success, otherwise -EINVAL
+ */
+int ndr_pull_array(struct ndr_cursor *ndr, char **data, __u32 *count)
+{
+	int start = ndr->offset;
+
+	if (ndr_pull_u32(ndr, count) ||
+	    *count > ndr->len - ndr->offset ||
+	    ndr_pull_bytes(ndr, data, *count)) {
+		ndr->offset = start;
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * ndr_unistr_dup() - convert a borrowed UTF-16 string to a C string
+ * @str:	string view from the request buffer
+ * @codepage:	codepage of the client pipe
+ *
+ * Return:	allocated string, empty for a null pointer, or error pointer
+ */
+char *ndr_unistr_dup(struct ndr_unistr *str, const char *codepage)
+{
+	char *empty;
+
+	if (!str->data) {
+		empty = strdup("");
+		return empty ? empty : ERR_PTR(-ENOMEM);
+	}
+
+	return smb_strndup_from_utf16(str->data, str->units, 1, codepage);
+}
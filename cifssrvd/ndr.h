@@ -0,0 +1,191 @@
+/*
+ *   cifssrv-tools/cifssrvd/ndr.h
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSSRV_NDR_H
+#define __CIFSSRV_NDR_H
+
+#include "cifssrv.h"
+
+/*
+ * Read cursor over the NDR stub data of a request. Fields are decoded in
+ * place: every pull checks alignment and the remaining length first, and
+ * variable sized data is handed out as a pointer into the request buffer
+ * rather than copied. All pulls return 0 or -EINVAL, and the cursor does
+ * not move on failure.
+ */
+struct ndr_cursor {
+	char	*buf;
+	int	len;
+	int	offset;
+};
+
+/* borrowed view of a UTF-16LE string inside the request buffer */
+struct ndr_unistr {
+	char	*data;	/* NULL for a null pointer */
+	int	units;	/* UTF-16 code units sent, including any NUL */
+};
+
+static inline void ndr_init(struct ndr_cursor *ndr, char *buf, int len)
+{
+	ndr->buf = buf;
+	ndr->len = len;
+	ndr->offset = 0;
+}
+
+static inline int ndr_seek(struct ndr_cursor *ndr, int offset)
+{
+	if (offset < 0 || offset > ndr->len)
+		return -EINVAL;
+	ndr->offset = offset;
+	return 0;
+}
+
+/* cursor offset rounded up to @align, the cursor itself is not moved */
+static inline int ndr_align_offset(struct ndr_cursor *ndr, int align)
+{
+	return (ndr->offset + align - 1) & ~(align - 1);
+}
+
+static inline int ndr_align(struct ndr_cursor *ndr, int align)
+{
+	int offset = ndr_align_offset(ndr, align);
+
+	if (offset > ndr->len)
+		return -EINVAL;
+	ndr->offset = offset;
+	return 0;
+}
+
+/**
+ * ndr_pull_bytes() - borrow bytes from the cursor
+ * @ndr:	request cursor
+ * @data:	set to the bytes inside the request buffer
+ * @size:	number of bytes
+ *
+ * Return:	0 on success, otherwise -EINVAL
+ */
+static inline int ndr_pull_bytes(struct ndr_cursor *ndr, char **data,
+				 int size)
+{
+	if (size < 0 || size > ndr->len - ndr->offset)
+		return -EINVAL;
+	*data = ndr->buf + ndr->offset;
+	ndr->offset += size;
+	return 0;
+}
+
+static inline int ndr_pull_u16(struct ndr_cursor *ndr, __u16 *val)
+{
+	int offset = ndr_align_offset(ndr, 2);
+	__le16 v;
+
+	if (ndr->len - offset < 2)
+		return -EINVAL;
+	memcpy(&v, ndr->buf + offset, 2);
+	*val = le16_to_cpu(v);
+	ndr->offset = offset + 2;
+	return 0;
+}
+
+static inline int ndr_pull_u32(struct ndr_cursor *ndr, __u32 *val)
+{
+	int offset = ndr_align_offset(ndr, 4);
+	__le32 v;
+
+	if (ndr->len - offset < 4)
+		return -EINVAL;
+	memcpy(&v, ndr->buf + offset, 4);
+	*val = le32_to_cpu(v);
+	ndr->offset = offset + 4;
+	return 0;
+}
+
+/*
+ * Generator for fixed layout NDR structures. An IDL list names each field
+ * with its type and NDR alignment:
+ *
+ *	#define FOO_IDL(F)			\
+ *		F(__u32,	level,	4)	\
+ *		F(__u64,	time,	4)
+ *
+ * NDR_STRUCT(foo, FOO) then defines the packed FOO type and
+ * ndr_push_foo(), which copies the fields one after another into a
+ * buffer of the given length, or fails with -E2BIG. Sizes are
+ * known at compile time, so the copies turn into plain stores, and a
+ * field that breaks its alignment fails the build. Offsets are checked
+ * from the start of the structure, which is fine for responses because
+ * the RPC_REQUEST_RSP header is a multiple of 8 bytes.
+ */
+#define NDR_MEMBER(type, name, align)	type name;
+
+#define NDR_PUSH_MEMBER(type, name, align)				\
+	memcpy(buf + offset, &p->name, sizeof(type));			\
+	offset += sizeof(type);
+
+#define NDR_CHECK_MEMBER(type, name, align)				\
+	_Static_assert(offsetof(ndr_type, name) % (align) == 0,		\
+		       "misaligned NDR field " #name);
+
+#define NDR_STRUCT(tag, NAME)						\
+typedef struct tag {							\
+	NAME##_IDL(NDR_MEMBER)						\
+} __attribute__((packed)) NAME;						\
+									\
+static inline int ndr_push_##tag(char *buf, int buf_len, NAME *p)	\
+{									\
+	typedef NAME ndr_type;						\
+	int offset = 0;							\
+									\
+	NAME##_IDL(NDR_CHECK_MEMBER)					\
+									\
+	if (sizeof(NAME) > buf_len)					\
+		return -E2BIG;						\
+									\
+	NAME##_IDL(NDR_PUSH_MEMBER)					\
+	return offset;							\
+}
+
+#define NDR_SIZE_MEMBER(type, name, align)	sizeof(type) +
+
+/* wire size of a fixed layout */
+#define NDR_SIZE(NAME)	(NAME##_IDL(NDR_SIZE_MEMBER) 0)
+
+/*
+ * NDR_ENCODER(foo, FOO, TYPE) defines only ndr_push_foo(), which copies
+ * the FOO fields of a TYPE. Fields of TYPE left out of the layout are not
+ * sent, so one in-memory structure can serve several info levels.
+ */
+#define NDR_ENCODER(tag, NAME, TYPE)					\
+static inline int ndr_push_##tag(char *buf, int buf_len, TYPE *p)	\
+{									\
+	int offset = 0;							\
+									\
+	if (NDR_SIZE(NAME) > buf_len)					\
+		return -E2BIG;						\
+									\
+	NAME##_IDL(NDR_PUSH_MEMBER)					\
+	return offset;							\
+}
+
+int ndr_pull_unistr(struct ndr_cursor *ndr, struct ndr_unistr *str);
+int ndr_pull_unique_unistr(struct ndr_cursor *ndr, struct ndr_unistr *str);
+int ndr_pull_lsa_string(struct ndr_cursor *ndr, struct ndr_unistr *str);
+int ndr_pull_array(struct ndr_cursor *ndr, char **data, __u32 *count);
+char *ndr_unistr_dup(struct ndr_unistr *str, const char *codepage);
+
+#endif /* __CIFSSRV_NDR_H */
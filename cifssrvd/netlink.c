@@ -34,6 +34,7 @@ static int nlsk_fd = -1;
 static struct sockaddr_nl src_addr, dest_addr;
 
 extern int request_handler(void *msg);
+extern int deferred_handler(void);
 extern void initialize(void);
 
 static int cifssrv_sendmsg(struct cifssrv_uevent *eev, unsigned int dlen,
@@ -172,14 +173,22 @@ static int cifssrv_handle_event(void)
 static void cifssrv_nl_loop(void)
 {
 	fd_set readfds;
+	struct timeval tv;
+	int timeout;
 	int ret;
 
 	for (;;) {
+		/* answer what the last event made ready, sleep until the next */
+		timeout = deferred_handler();
+		tv.tv_sec = timeout;
+		tv.tv_usec = 0;
+
 		/* add cifssrv netlink socket fd to read fd list*/
 		FD_ZERO(&readfds);
 		FD_SET(nlsk_fd, &readfds);
 
-		ret = select(nlsk_fd + 1, &readfds, NULL, NULL, NULL);
+		ret = select(nlsk_fd + 1, &readfds, NULL, NULL,
+				timeout < 0 ? NULL : &tv);
 		if (ret == -1) {
 			perror("select");
 		}
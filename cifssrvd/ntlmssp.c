@@ -0,0 +1,458 @@
+/*
+ *   cifssrv-tools/cifssrvd/ntlmssp.c
+ *
+ *   NTLMSSP authentication and session security for the rpc pipes.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include "cifssrv.h"
+#include "ntlmssp.h"
+#include "crypto.h"
+
+/* flags taken over from the client negotiate message when it sets them */
+#define NTLMSSP_CLIENT_FLAGS						\
+	(NTLMSSP_NEGOTIATE_SIGN | NTLMSSP_NEGOTIATE_SEAL |		\
+	 NTLMSSP_NEGOTIATE_ALWAYS_SIGN | NTLMSSP_NEGOTIATE_EXTENDED_SEC | \
+	 NTLMSSP_NEGOTIATE_KEY_XCH)
+
+/* key strengths the server offers, cut down to what the client sets */
+#define NTLMSSP_KEY_FLAGS	(NTLMSSP_NEGOTIATE_128 | NTLMSSP_NEGOTIATE_56)
+
+/* one direction of the session, keys are set up once at AUTH3 */
+struct ntlmssp_dir {
+	struct hmac_md5_key sign_key;
+	struct arc4_ctx seal;
+	__u32 seq;
+};
+
+struct ntlmssp_ctx {
+	__u8 challenge[CIFS_CRYPTO_KEY_SIZE];
+	__u32 flags;
+	int established;
+	struct ntlmssp_dir send;	/* server to client */
+	struct ntlmssp_dir recv;	/* client to server */
+};
+
+static const char ntlmssp_c2s_sign[] =
+	"session key to client-to-server signing key magic constant";
+static const char ntlmssp_s2c_sign[] =
+	"session key to server-to-client signing key magic constant";
+static const char ntlmssp_c2s_seal[] =
+	"session key to client-to-server sealing key magic constant";
+static const char ntlmssp_s2c_seal[] =
+	"session key to server-to-client sealing key magic constant";
+
+/**
+ * ntlmssp_ctx_new() - start a security context at bind time
+ * @negblob:	negotiate message of the client
+ * @chgblob:	challenge message being sent back, flags are updated
+ *
+ * Return:	security context on success, otherwise error pointer
+ */
+struct ntlmssp_ctx *ntlmssp_ctx_new(NEGOTIATE_MESSAGE *negblob,
+		CHALLENGE_MESSAGE *chgblob)
+{
+	struct ntlmssp_ctx *ctx;
+	__u32 client, flags;
+
+	ctx = calloc(1, sizeof(struct ntlmssp_ctx));
+	if (!ctx)
+		return ERR_PTR(-ENOMEM);
+
+	client = le32_to_cpu(negblob->NegotiateFlags);
+	flags = le32_to_cpu(chgblob->NegotiateFlags);
+	flags &= ~NTLMSSP_KEY_FLAGS | client;
+	flags |= client & NTLMSSP_CLIENT_FLAGS;
+	chgblob->NegotiateFlags = cpu_to_le32(flags);
+
+	ctx->flags = flags;
+	memcpy(ctx->challenge, chgblob->Challenge, CIFS_CRYPTO_KEY_SIZE);
+	return ctx;
+}
+
+/**
+ * ntlmssp_ctx_free() - destroy a security context
+ * @ctx:	security context, may be NULL
+ */
+void ntlmssp_ctx_free(struct ntlmssp_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	memset(ctx, 0, sizeof(struct ntlmssp_ctx));
+	free(ctx);
+}
+
+/**
+ * ntlmssp_established() - check if AUTHENTICATE completed on a context
+ * @ctx:	security context, may be NULL
+ *
+ * Return:	1 when the client proved its credentials, otherwise 0
+ */
+int ntlmssp_established(struct ntlmssp_ctx *ctx)
+{
+	return ctx && ctx->established;
+}
+
+/**
+ * ntlmssp_blob_field() - locate a security buffer in a message
+ * @blob:	NTLMSSP message
+ * @len:	length of message
+ * @sb:		security buffer descriptor inside the message
+ * @data:	set to the start of the field
+ *
+ * Return:	length of the field, or -EINVAL if it is out of the message
+ */
+static int ntlmssp_blob_field(char *blob, int len, SECURITY_BUFFER *sb,
+		char **data)
+{
+	unsigned int offset = le32_to_cpu(sb->BufferOffset);
+	unsigned int field_len = le16_to_cpu(sb->Length);
+
+	if (offset > len || field_len > len - offset)
+		return -EINVAL;
+	*data = blob + offset;
+	return field_len;
+}
+
+/**
+ * ntlmssp_memneq() - compare two MACs in constant time
+ * @a:		first MAC
+ * @b:		second MAC
+ * @len:	length of the MACs
+ *
+ * Return:	0 when they are equal, otherwise nonzero
+ */
+static int ntlmssp_memneq(const void *a, const void *b, size_t len)
+{
+	const __u8 *x = a, *y = b;
+	__u8 diff = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		diff |= x[i] ^ y[i];
+	return diff;
+}
+
+/**
+ * ntlmssp_derive_key() - derive a sign or seal key from the session key
+ * @session_key:	exported session key
+ * @key_len:		bytes of @session_key to use
+ * @magic:		direction and purpose constant
+ * @key:		16 byte key
+ */
+static void ntlmssp_derive_key(__u8 *session_key, int key_len,
+		const char *magic, __u8 *key)
+{
+	struct md5_ctx mctx;
+
+	md5_init(&mctx);
+	md5_update(&mctx, session_key, key_len);
+	/* the constants are hashed with their terminating NUL */
+	md5_update(&mctx, magic, strlen(magic) + 1);
+	md5_final(&mctx, key);
+}
+
+/**
+ * ntlmssp_dir_init() - set up one direction of session security
+ * @ctx:		security context
+ * @dir:		direction to set up
+ * @session_key:	exported session key
+ * @sign_magic:		signing key constant of the direction
+ * @seal_magic:		sealing key constant of the direction
+ */
+static void ntlmssp_dir_init(struct ntlmssp_ctx *ctx, struct ntlmssp_dir *dir,
+		__u8 *session_key, const char *sign_magic,
+		const char *seal_magic)
+{
+	__u8 key[MD5_DIGEST_SIZE];
+	int key_len;
+
+	ntlmssp_derive_key(session_key, CIFS_SESS_KEY_SIZE, sign_magic, key);
+	hmac_md5_setkey(&dir->sign_key, key, MD5_DIGEST_SIZE);
+
+	/* weaker keys hash less of the session key, RC4 always gets 16 bytes */
+	if (ctx->flags & NTLMSSP_NEGOTIATE_128)
+		key_len = 16;
+	else if (ctx->flags & NTLMSSP_NEGOTIATE_56)
+		key_len = 7;
+	else
+		key_len = 5;
+	ntlmssp_derive_key(session_key, key_len, seal_magic, key);
+	arc4_setkey(&dir->seal, key, MD5_DIGEST_SIZE);
+	dir->seq = 0;
+
+	memset(key, 0, sizeof(key));
+}
+
+/**
+ * ntlmssp_nt_proof() - compute NTLMv2 proof and session base key
+ * @ctx:		security context
+ * @usr:		user account
+ * @user:		user name from the message, UTF-16
+ * @user_len:		length of user name in bytes
+ * @domain:		domain name from the message, UTF-16
+ * @domain_len:		length of domain name in bytes
+ * @nt_resp:		NTLMv2 response of the client
+ * @nt_len:		length of the response
+ * @session_key:	16 byte session base key
+ *
+ * Return:	0 when the proof matches, otherwise -EACCES
+ */
+static int ntlmssp_nt_proof(struct ntlmssp_ctx *ctx, struct cifssrv_usr *usr,
+		char *user, int user_len, char *domain, int domain_len,
+		__u8 *nt_resp, int nt_len, __u8 *session_key)
+{
+	struct hmac_md5_key hkey;
+	struct md5_ctx mctx;
+	__u8 response_key[MD5_DIGEST_SIZE];
+	__u8 proof[MD5_DIGEST_SIZE];
+	__u8 *ident;
+	int diff, i;
+
+	/* NTOWFv2 is keyed on upper cased user and domain as sent */
+	ident = malloc(user_len + domain_len);
+	if (!ident)
+		return -ENOMEM;
+	memcpy(ident, user, user_len);
+	for (i = 0; i + 1 < user_len; i += 2) {
+		if (!ident[i + 1])
+			ident[i] = toupper(ident[i]);
+	}
+	memcpy(ident + user_len, domain, domain_len);
+	hmac_md5((__u8 *)usr->passkey, CIFS_NTHASH_SIZE, ident,
+			user_len + domain_len, response_key);
+	free(ident);
+
+	hmac_md5_setkey(&hkey, response_key, MD5_DIGEST_SIZE);
+	hmac_md5_init(&mctx, &hkey);
+	md5_update(&mctx, ctx->challenge, CIFS_CRYPTO_KEY_SIZE);
+	md5_update(&mctx, nt_resp + MD5_DIGEST_SIZE, nt_len - MD5_DIGEST_SIZE);
+	hmac_md5_final(&mctx, &hkey, proof);
+
+	diff = ntlmssp_memneq(proof, nt_resp, MD5_DIGEST_SIZE);
+	if (!diff) {
+		hmac_md5_init(&mctx, &hkey);
+		md5_update(&mctx, proof, MD5_DIGEST_SIZE);
+		hmac_md5_final(&mctx, &hkey, session_key);
+	}
+
+	memset(&hkey, 0, sizeof(hkey));
+	memset(response_key, 0, sizeof(response_key));
+	return diff ? -EACCES : 0;
+}
+
+/**
+ * ntlmssp_authenticate() - check AUTHENTICATE message and derive keys
+ * @ctx:	security context started at bind
+ * @blob:	AUTHENTICATE message from the AUTH3 pdu
+ * @len:	length of message
+ * @codepage:	codepage of the client pipe
+ *
+ * Only NTLMv2 responses are accepted, and signing or sealing needs
+ * extended session security.
+ *
+ * Return:	0 on success, otherwise error number
+ */
+int ntlmssp_authenticate(struct ntlmssp_ctx *ctx, char *blob, int len,
+		const char *codepage)
+{
+	AUTHENTICATE_MESSAGE *authblob = (AUTHENTICATE_MESSAGE *)blob;
+	struct cifssrv_usr *usr;
+	struct arc4_ctx arc4;
+	__u8 session_key[CIFS_SESS_KEY_SIZE];
+	char *nt_resp = NULL, *user = NULL, *domain = NULL;
+	char *enc_key, *name;
+	int nt_len, user_len, domain_len, key_len;
+	int ret;
+
+	if (ctx->established)
+		return -EINVAL;
+
+	if (len < sizeof(AUTHENTICATE_MESSAGE) ||
+	    memcmp(authblob->Signature, NTLMSSP_SIGNATURE, 8) ||
+	    authblob->MessageType != NtLmAuthenticate)
+		return -EINVAL;
+
+	nt_len = ntlmssp_blob_field(blob, len,
+			&authblob->NtChallengeResponse, &nt_resp);
+	user_len = ntlmssp_blob_field(blob, len, &authblob->UserName, &user);
+	domain_len = ntlmssp_blob_field(blob, len,
+			&authblob->DomainName, &domain);
+	key_len = ntlmssp_blob_field(blob, len, &authblob->SessionKey,
+			&enc_key);
+	if (nt_len < 0 || user_len < 0 || domain_len < 0 || key_len < 0)
+		return -EINVAL;
+
+	if (nt_len <= CIFS_AUTH_RESP_SIZE || !user_len) {
+		cifssrv_debug("NTLMv2 response required, got %d bytes\n",
+				nt_len);
+		return -EACCES;
+	}
+
+	name = smb_strndup_from_utf16(user, user_len / 2, 1, codepage);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+	usr = lookup_user(name);
+	if (!usr) {
+		cifssrv_debug("unknown user %s\n", name);
+		free(name);
+		return -EACCES;
+	}
+
+	ret = ntlmssp_nt_proof(ctx, usr, user, user_len & ~1,
+			domain, domain_len & ~1, (__u8 *)nt_resp, nt_len,
+			session_key);
+	if (ret) {
+		cifssrv_debug("NTLMv2 proof mismatch for %s\n", name);
+		free(name);
+		return ret;
+	}
+	free(name);
+
+	ctx->flags &= le32_to_cpu(authblob->NegotiateFlags);
+	if ((ctx->flags & (NTLMSSP_NEGOTIATE_SIGN | NTLMSSP_NEGOTIATE_SEAL)) &&
+	    !(ctx->flags & NTLMSSP_NEGOTIATE_EXTENDED_SEC)) {
+		cifssrv_err("NTLMSSP session security without extended "
+				"session security is not supported\n");
+		memset(session_key, 0, sizeof(session_key));
+		return -EOPNOTSUPP;
+	}
+
+	/* NTLMv2 key exchange key is the session base key */
+	if (ctx->flags & NTLMSSP_NEGOTIATE_KEY_XCH) {
+		if (key_len != CIFS_SESS_KEY_SIZE) {
+			memset(session_key, 0, sizeof(session_key));
+			return -EINVAL;
+		}
+		arc4_setkey(&arc4, session_key, CIFS_SESS_KEY_SIZE);
+		memcpy(session_key, enc_key, CIFS_SESS_KEY_SIZE);
+		arc4_crypt(&arc4, session_key, CIFS_SESS_KEY_SIZE);
+		memset(&arc4, 0, sizeof(arc4));
+	}
+
+	ntlmssp_dir_init(ctx, &ctx->send, session_key,
+			ntlmssp_s2c_sign, ntlmssp_s2c_seal);
+	ntlmssp_dir_init(ctx, &ctx->recv, session_key,
+			ntlmssp_c2s_sign, ntlmssp_c2s_seal);
+	memset(session_key, 0, sizeof(session_key));
+
+	ctx->established = 1;
+	return 0;
+}
+
+/**
+ * ntlmssp_checksum() - HMAC of a pdu under the direction signing key
+ * @dir:	session direction
+ * @pdu:	signed part of the pdu, in plain text
+ * @pdu_len:	length of signed part
+ * @digest:	16 byte MAC, only the first 8 bytes are used
+ */
+static void ntlmssp_checksum(struct ntlmssp_dir *dir, char *pdu, int pdu_len,
+		__u8 *digest)
+{
+	struct md5_ctx mctx;
+	__le32 seq = cpu_to_le32(dir->seq);
+
+	hmac_md5_init(&mctx, &dir->sign_key);
+	md5_update(&mctx, &seq, sizeof(seq));
+	md5_update(&mctx, pdu, pdu_len);
+	hmac_md5_final(&mctx, &dir->sign_key, digest);
+}
+
+/**
+ * ntlmssp_signature() - finish a message signature
+ * @ctx:	security context
+ * @dir:	session direction
+ * @digest:	checksum from ntlmssp_checksum()
+ * @sig:	signature to fill
+ *
+ * The checksum is encrypted after the data, as both use one key stream.
+ */
+static void ntlmssp_signature(struct ntlmssp_ctx *ctx, struct ntlmssp_dir *dir,
+		__u8 *digest, NTLMSSP_MESSAGE_SIGNATURE *sig)
+{
+	if (ctx->flags & NTLMSSP_NEGOTIATE_KEY_XCH)
+		arc4_crypt(&dir->seal, digest, sizeof(sig->Checksum));
+
+	sig->Version = cpu_to_le32(NTLMSSP_SIGNATURE_VERSION);
+	memcpy(sig->Checksum, digest, sizeof(sig->Checksum));
+	sig->SeqNum = cpu_to_le32(dir->seq);
+	dir->seq++;
+}
+
+/**
+ * ntlmssp_seal() - sign and optionally encrypt an outgoing pdu
+ * @ctx:	security context
+ * @seal:	encrypt @data as well
+ * @data:	stub data and padding, encrypted in place
+ * @data_len:	length of data
+ * @pdu:	signed part of the pdu, containing @data
+ * @pdu_len:	length of signed part
+ * @sig:	NTLMSSP_SIGNATURE_SIZE bytes for the signature
+ *
+ * Return:	0 on success, otherwise -EACCES
+ */
+int ntlmssp_seal(struct ntlmssp_ctx *ctx, int seal, char *data, int data_len,
+		char *pdu, int pdu_len, char *sig)
+{
+	__u8 digest[MD5_DIGEST_SIZE];
+
+	if (!ctx->established ||
+	    (seal && !(ctx->flags & NTLMSSP_NEGOTIATE_SEAL)))
+		return -EACCES;
+
+	ntlmssp_checksum(&ctx->send, pdu, pdu_len, digest);
+	if (seal)
+		arc4_crypt(&ctx->send.seal, (__u8 *)data, data_len);
+	ntlmssp_signature(ctx, &ctx->send, digest,
+			(NTLMSSP_MESSAGE_SIGNATURE *)sig);
+	return 0;
+}
+
+/**
+ * ntlmssp_unseal() - optionally decrypt and verify an incoming pdu
+ * @ctx:	security context
+ * @seal:	@data is encrypted
+ * @data:	stub data and padding, decrypted in place
+ * @data_len:	length of data
+ * @pdu:	signed part of the pdu, containing @data
+ * @pdu_len:	length of signed part
+ * @sig:	signature sent by the client
+ *
+ * Return:	0 when the signature matches, otherwise -EACCES
+ */
+int ntlmssp_unseal(struct ntlmssp_ctx *ctx, int seal, char *data,
+		int data_len, char *pdu, int pdu_len, char *sig)
+{
+	NTLMSSP_MESSAGE_SIGNATURE expected;
+	__u8 digest[MD5_DIGEST_SIZE];
+
+	if (!ctx->established ||
+	    (seal && !(ctx->flags & NTLMSSP_NEGOTIATE_SEAL)))
+		return -EACCES;
+
+	if (seal)
+		arc4_crypt(&ctx->recv.seal, (__u8 *)data, data_len);
+	ntlmssp_checksum(&ctx->recv, pdu, pdu_len, digest);
+	ntlmssp_signature(ctx, &ctx->recv, digest, &expected);
+
+	if (ntlmssp_memneq(&expected, sig, NTLMSSP_SIGNATURE_SIZE)) {
+		cifssrv_debug("NTLMSSP signature mismatch, seq %u\n",
+				ctx->recv.seq - 1);
+		return -EACCES;
+	}
+	return 0;
+}
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include "cifssrv.h"
 #include "list.h"
+#include "ntlmssp.h"
 #include "netlink.h"
 
 #define CREATE	0x1
@@ -100,6 +101,7 @@ static struct cifssrv_pipe *initpipe(int pipetype, char *codepage)
 		pipe->pipe_type = pipetype;
 		strncpy(pipe->codepage, codepage, CIFSSRV_CODEPAGE_LEN - 1);
 		INIT_LIST_HEAD(&pipe->list);
+		INIT_LIST_HEAD(&pipe->reg_handles);
 	}
 	return pipe;
 }
@@ -118,9 +120,11 @@ static int cifssrv_create_pipe(__u64 clienthash, int pipetype, char *codepage)
 	client = lookup_client(clienthash);
 	if (!client) {
 		cifssrv_err("Failed to allocate memory for cifssrv client object\n");
+		free(pipe);
 		return -ENOMEM;
 	}
 
+	pipe->client = client;
 	cifssrv_debug("added pipe %p, in client 0x%llx, client %p\n",
 			pipe, clienthash, client);
 	list_add(&pipe->list, &client->pipelist);
@@ -141,11 +145,101 @@ static int cifssrv_remove_pipe(__u64 clienthash, int pipetype)
 	cifssrv_debug("remove pipe %p from clienthash 0x%llx\n", pipe,
 			clienthash);
 	/* If need to add logic about cleaning up pipe buffers, ADD HERE */
+	rpc_frag_release(pipe);
+	ntlmssp_ctx_free(pipe->ntlmssp);
+	winreg_release_pipe(pipe);
 	list_del(&pipe->list);
 	free(pipe);
 	return 0;
 }
 
+/**
+ * pipe_defer_read() - park a read until the pipe response is ready
+ * @pipe:	pipe whose request handler held the response back
+ * @event:	response event to answer the read with
+ * @buflen:	response buffer size of the read
+ */
+static void pipe_defer_read(struct cifssrv_pipe *pipe, unsigned int event,
+		unsigned int buflen)
+{
+	cifssrv_debug("parking read of pipe %p\n", pipe);
+	pipe->rsp_event = event;
+	pipe->rsp_buflen = buflen;
+}
+
+/**
+ * pipe_answer_read() - answer the parked read of a pipe
+ * @pipe:	pipe with a parked read
+ * @buf:	response
+ * @nbytes:	response length, or error number
+ *
+ * Return:	number of bytes sent, or -1 on error
+ */
+static int pipe_answer_read(struct cifssrv_pipe *pipe, char *buf, int nbytes)
+{
+	struct cifssrv_uevent rsp_ev;
+
+	memset(&rsp_ev, 0, sizeof(rsp_ev));
+	rsp_ev.type = pipe->rsp_event;
+	rsp_ev.server_handle = pipe->client->hash;
+	rsp_ev.pipe_type = pipe->pipe_type;
+	if (nbytes < 0) {
+		rsp_ev.error = nbytes;
+		nbytes = 0;
+	}
+
+	rsp_ev.buflen = nbytes;
+	if (pipe->rsp_event == CIFSSRV_UEVENT_READ_PIPE_RSP)
+		rsp_ev.u.r_pipe_rsp.read_count = nbytes;
+	else
+		rsp_ev.u.i_pipe_rsp.data_count = nbytes;
+	pipe->rsp_event = 0;
+	return cifssrv_common_sendmsg(&rsp_ev, buf, nbytes);
+}
+
+/**
+ * cifssrv_pipe_complete() - hand out a response the handler held back
+ * @pipe:	pipe with the response in pipe->data
+ *
+ * A request handler that cannot answer yet sets pipe->rsp_deferred
+ * instead of pipe->data, and a read of the response is parked rather
+ * than answered, so the daemon goes on serving other pipes. Once the
+ * response is there the parked read is answered, or if the read did not
+ * come yet, it finds the response as usual.
+ */
+void cifssrv_pipe_complete(struct cifssrv_pipe *pipe)
+{
+	char *buf;
+	int nbytes;
+
+	pipe->rsp_deferred = 0;
+	if (!pipe->rsp_event)
+		return;
+
+	buf = calloc(1, NETLINK_CIFSSRV_MAX_PAYLOAD);
+	if (buf) {
+		nbytes = process_rpc_rsp(pipe, buf, pipe->rsp_buflen);
+	} else {
+		free(pipe->data);
+		nbytes = -ENOMEM;
+	}
+
+	cifssrv_debug("deferred response of pipe %p, length %d\n",
+			pipe, nbytes);
+	pipe_answer_read(pipe, buf, nbytes);
+	free(buf);
+}
+
+/**
+ * deferred_handler() - send the pipe responses that became ready
+ *
+ * Return:	seconds until one is due anyway, or -1 if none is pending
+ */
+int deferred_handler(void)
+{
+	return winreg_run_watches();
+}
+
 static int handle_create_pipe_event(void *msg)
 {
 	struct nlmsghdr *nlh = (struct nlmsghdr *)msg;
@@ -208,6 +302,13 @@ static int handle_read_pipe_event(void *msg)
 		goto out;
 	}
 
+	if (pipe->rsp_deferred) {
+		pipe_defer_read(pipe, CIFSSRV_UEVENT_READ_PIPE_RSP,
+				ev->k.r_pipe.out_buflen);
+		free(buf);
+		return 0;
+	}
+
 	nbytes = process_rpc_rsp(pipe, buf, ev->k.r_pipe.out_buflen);
 	if (nbytes < 0) {
 		ret = nbytes;
@@ -249,7 +350,11 @@ static int handle_write_pipe_event(void *msg)
 		goto out;
 	}
 
-	ret = process_rpc(pipe, ev->buffer);
+	/* a new request, the parked read will not get its response */
+	if (pipe->rsp_event)
+		pipe_answer_read(pipe, NULL, -ECANCELED);
+
+	ret = process_rpc(pipe, ev->buffer, ev->buflen);
 	if (ret)
 		cifssrv_debug("process_rpc: failed ret %d\n", ret);
 
@@ -295,12 +400,26 @@ static int handle_ioctl_pipe_event(void *msg)
 		goto out;
 	}
 
-	ret = process_rpc(pipe, ev->buffer);
+	if (pipe->rsp_event)
+		pipe_answer_read(pipe, NULL, -ECANCELED);
+
+	ret = process_rpc(pipe, ev->buffer, ev->buflen);
 	if (ret) {
 		cifssrv_debug("process_rpc: failed %d\n", ret);
 		goto out;
 	}
 
+	/* no response until the last fragment of a request is in */
+	if (pipe->frag_buf)
+		goto out;
+
+	if (pipe->rsp_deferred) {
+		pipe_defer_read(pipe, CIFSSRV_UEVENT_IOCTL_PIPE_RSP,
+				ev->k.i_pipe.out_buflen);
+		free(buf);
+		return 0;
+	}
+
 	nbytes = process_rpc_rsp(pipe, buf, ev->k.i_pipe.out_buflen);
 	if (nbytes < 0) {
 		ret = nbytes;
@@ -0,0 +1,816 @@
+/*
+ *   cifssrv-tools/cifssrvd/regdb.c
+ *
+ *   Persistent winreg store: an on-disk snapshot of the registry tree
+ *   and a journal of the changes made since.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "winreg.h"
+
+/*
+ * The snapshot is a binary image of the tree, mmapped read-only at
+ * startup and walked once, record by record:
+ *
+ *	REG_DB_HDR
+ *	REG_DB_KEY, name, { REG_DB_VALUE, name, data } * nr_values
+ *	...
+ *
+ * Keys come in preorder and refer to their parent by record index, so
+ * no path is parsed or walked from a root; reg_create_child() still
+ * looks the name up among the parent's children. Names are NUL
+ * terminated in the file and every record is padded to 4 bytes. Names
+ * and data are copied into the heap tree and the mapping is dropped
+ * once loading is done.
+ *
+ * Changes made through winreg are appended to a journal next to the
+ * snapshot, one self checksummed record each, and replayed on top of the
+ * snapshot at startup; a torn record at the end is cut off. Records are
+ * numbered and the snapshot stores the number of the last one it
+ * includes, so replay skips what the snapshot already has. The journal
+ * is not fsynced: it survives a restart or crash of the daemon, not a
+ * power loss.
+ *
+ * Once the journal outgrows the snapshot it is compacted: the journal is
+ * rotated to <snapshot>.log.old and a forked child writes the snapshot
+ * from its copy of the tree, while the daemon goes on journaling to a
+ * fresh file. The old journal is dropped when the child succeeds.
+ */
+#define REG_DB_MAGIC		"CIFSREG"
+#define REG_DB_VERSION		1
+#define REG_DB_ROOT		0xffffffff
+#define REG_DB_COMPACT_MIN	(1024 * 1024)
+
+#define REG_LOG_CREATE_KEY	1
+#define REG_LOG_DELETE_KEY	2
+#define REG_LOG_SET_VALUE	3
+#define REG_LOG_DELETE_VALUE	4
+
+typedef struct reg_db_hdr {
+	__u8 magic[8];
+	__u32 version;
+	__u32 nr_keys;
+	__u64 seq;
+	__u64 size;
+} __attribute__((packed)) REG_DB_HDR;
+
+typedef struct reg_db_key {
+	__u32 parent;
+	__u32 nr_values;
+	__u16 name_len;
+	__u16 reserved;
+} __attribute__((packed)) REG_DB_KEY;
+
+typedef struct reg_db_value {
+	__u32 type;
+	__u32 data_len;
+	__u16 name_len;
+	__u16 reserved;
+} __attribute__((packed)) REG_DB_VALUE;
+
+/* followed by path, name and data; the path is relative to the root */
+typedef struct reg_log_rec {
+	__u32 size;
+	__u32 sum;
+	__u64 seq;
+	__u8 op;
+	__u8 root;
+	__u16 name_len;
+	__u32 path_len;
+	__u32 type;
+	__u32 data_len;
+} __attribute__((packed)) REG_LOG_REC;
+
+#define REG_DB_PAD(len)		(((len) + 3) & ~3)
+#define REG_LOG_PAD(len)	(((len) + 7) & ~7)
+
+static struct registry_node **reg_db_roots[] = {
+	&reg_openhkcr,
+	&reg_openhkcu,
+	&reg_openhklm,
+	&reg_openhku,
+};
+
+#define REG_DB_NR_ROOTS	(sizeof(reg_db_roots) / sizeof(reg_db_roots[0]))
+
+static char *reg_db_path;
+static char *reg_db_log_path;
+static char *reg_db_old_path;
+static int reg_db_fd = -1;
+static off_t reg_db_log_size;
+static off_t reg_db_snap_size;
+static __u64 reg_db_seq;
+static __u64 reg_db_snap_seq;
+static pid_t reg_db_compactor;
+
+/* FNV-1a, only to tell a torn journal record from a whole one */
+static __u32 reg_log_sum(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	__u32 sum = 2166136261u;
+
+	while (len--) {
+		sum ^= *p++;
+		sum *= 16777619u;
+	}
+	return sum;
+}
+
+static int reg_db_root_index(struct registry_node *key)
+{
+	int i;
+
+	for (i = 0; i < REG_DB_NR_ROOTS; i++) {
+		if (*reg_db_roots[i] == key)
+			return i;
+	}
+	return -1;
+}
+
+static char *reg_db_name(const char *path, const char *suffix)
+{
+	char *name = malloc(strlen(path) + strlen(suffix) + 1);
+
+	if (name)
+		sprintf(name, "%s%s", path, suffix);
+	return name;
+}
+
+/**
+ * reg_db_key_path() - path of a key relative to its root key
+ * @key:	key
+ * @root:	set to the index of the root key
+ *
+ * Return:	malloced path, or NULL on error
+ */
+static char *reg_db_key_path(struct registry_node *key, int *root)
+{
+	struct registry_node *k;
+	size_t len = 0, n;
+	char *path, *p;
+
+	for (k = key; k->parent; k = k->parent)
+		len += strlen(k->key_name) + 1;
+
+	*root = reg_db_root_index(k);
+	if (*root < 0)
+		return NULL;
+	if (!len)
+		return strdup("");
+
+	path = malloc(len);
+	if (!path)
+		return NULL;
+
+	p = path + len - 1;
+	*p = '\0';
+	for (k = key; k->parent; k = k->parent) {
+		n = strlen(k->key_name);
+		p -= n;
+		memcpy(p, k->key_name, n);
+		if (k->parent->parent)
+			*--p = '\\';
+	}
+	return path;
+}
+
+static void *reg_db_map(const char *path, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return ERR_PTR(-errno);
+	}
+
+	*size = st.st_size;
+	if (!st.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return ERR_PTR(-errno);
+	return map;
+}
+
+/**
+ * reg_db_load_snapshot() - build the registry tree from the snapshot
+ * @path:	snapshot file
+ *
+ * Return:	0 on success, -ENOENT if there is no snapshot, otherwise error
+ */
+static int reg_db_load_snapshot(const char *path)
+{
+	struct registry_node **keys = NULL, *key, *parent;
+	const REG_DB_HDR *hdr;
+	const REG_DB_KEY *krec;
+	const REG_DB_VALUE *vrec;
+	struct registry_value *value;
+	const char *map, *name;
+	size_t size, off, len, name_len, data_len;
+	__u32 nr_keys, nr_values, i, j, idx;
+	int ret = -EINVAL;
+
+	map = reg_db_map(path, &size);
+	if (IS_ERR(map))
+		return PTR_ERR(map);
+
+	hdr = (const REG_DB_HDR *)map;
+	if (size < sizeof(REG_DB_HDR) ||
+	    memcmp(hdr->magic, REG_DB_MAGIC, sizeof(REG_DB_MAGIC)) ||
+	    le32_to_cpu(hdr->version) != REG_DB_VERSION ||
+	    le64_to_cpu(hdr->size) != size)
+		goto out;
+
+	nr_keys = le32_to_cpu(hdr->nr_keys);
+	if (nr_keys > size / sizeof(REG_DB_KEY))
+		goto out;
+
+	keys = malloc(nr_keys * sizeof(struct registry_node *));
+	if (!keys) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	off = sizeof(REG_DB_HDR);
+	for (i = 0; i < nr_keys; i++) {
+		if (size - off < sizeof(REG_DB_KEY))
+			goto out;
+		krec = (const REG_DB_KEY *)(map + off);
+		name = (const char *)(krec + 1);
+		name_len = le16_to_cpu(krec->name_len);
+		len = REG_DB_PAD(sizeof(REG_DB_KEY) + name_len + 1);
+		if (size - off < len || name[name_len] ||
+		    strlen(name) != name_len)
+			goto out;
+		off += len;
+
+		idx = le32_to_cpu(krec->parent);
+		if (idx == REG_DB_ROOT) {
+			key = NULL;
+			for (j = 0; j < REG_DB_NR_ROOTS; j++) {
+				if (!strcmp((*reg_db_roots[j])->key_name, name))
+					key = *reg_db_roots[j];
+			}
+			if (!key)
+				goto out;
+		} else {
+			if (idx >= i)
+				goto out;
+			parent = keys[idx];
+			key = reg_create_child(parent, name, NULL);
+			if (IS_ERR(key)) {
+				ret = PTR_ERR(key);
+				goto out;
+			}
+		}
+		keys[i] = key;
+
+		nr_values = le32_to_cpu(krec->nr_values);
+		for (j = 0; j < nr_values; j++) {
+			if (size - off < sizeof(REG_DB_VALUE))
+				goto out;
+			vrec = (const REG_DB_VALUE *)(map + off);
+			name = (const char *)(vrec + 1);
+			name_len = le16_to_cpu(vrec->name_len);
+			data_len = le32_to_cpu(vrec->data_len);
+			len = REG_DB_PAD(sizeof(REG_DB_VALUE) + name_len + 1 +
+					data_len);
+			if (size - off < len || name[name_len] ||
+			    strlen(name) != name_len)
+				goto out;
+			off += len;
+
+			value = set_value(name, le32_to_cpu(vrec->type),
+					(char *)name + name_len + 1, data_len,
+					key);
+			if (PTR_ERR(value) == -EFBIG) {
+				/* from before values were limited */
+				cifssrv_err("dropping oversized value %s of %s\n",
+						name, key->key_name);
+			} else if (IS_ERR(value)) {
+				ret = PTR_ERR(value);
+				goto out;
+			}
+		}
+	}
+
+	if (off != size)
+		goto out;
+
+	reg_db_snap_seq = reg_db_seq = le64_to_cpu(hdr->seq);
+	reg_db_snap_size = size;
+	cifssrv_debug("loaded %u registry keys from %s\n", nr_keys, path);
+	ret = 0;
+out:
+	if (ret == -EINVAL)
+		cifssrv_err("registry snapshot %s is corrupt\n", path);
+	free(keys);
+	if (map)
+		munmap((void *)map, size);
+	return ret;
+}
+
+static void reg_db_apply(const REG_LOG_REC *rec, const char *path,
+		const char *name, const char *data)
+{
+	struct registry_node *root, *key;
+	char *kpath;
+
+	if (rec->root >= REG_DB_NR_ROOTS)
+		return;
+	root = *reg_db_roots[rec->root];
+
+	kpath = strdup(path);
+	if (!kpath)
+		return;
+
+	if (!*kpath)
+		key = root;
+	else if (rec->op == REG_LOG_CREATE_KEY ||
+		 rec->op == REG_LOG_SET_VALUE)
+		key = create_key(kpath, root, NULL);
+	else
+		key = search_registry(kpath, root);
+	free(kpath);
+	if (IS_ERR(key))
+		return;
+
+	switch (rec->op) {
+	case REG_LOG_DELETE_KEY:
+		if (key != root)
+			delete_key(key);
+		break;
+	case REG_LOG_SET_VALUE:
+		set_value(name, le32_to_cpu(rec->type), (char *)data,
+				le32_to_cpu(rec->data_len), key);
+		break;
+	case REG_LOG_DELETE_VALUE:
+		delete_value(name, key);
+		break;
+	}
+}
+
+/**
+ * reg_db_replay() - apply the changes in a journal to the tree
+ * @path:	journal file
+ *
+ * Return:	length of the valid part of the journal, otherwise error
+ */
+static off_t reg_db_replay(const char *path)
+{
+	const REG_LOG_REC *rec;
+	const char *map, *rpath, *name;
+	size_t size, off = 0, rsize, len, path_len, name_len;
+	__u64 seq;
+
+	map = reg_db_map(path, &size);
+	if (IS_ERR(map))
+		return PTR_ERR(map);
+
+	while (size - off >= sizeof(REG_LOG_REC)) {
+		rec = (const REG_LOG_REC *)(map + off);
+		rsize = le32_to_cpu(rec->size);
+		path_len = le32_to_cpu(rec->path_len);
+		name_len = le16_to_cpu(rec->name_len);
+		len = sizeof(REG_LOG_REC) + path_len + name_len + 2 +
+			le32_to_cpu(rec->data_len);
+		if (rsize > size - off || rsize != REG_LOG_PAD(len) ||
+		    reg_log_sum(&rec->seq, rsize - 8) !=
+				le32_to_cpu(rec->sum))
+			break;
+
+		/* strings are used in place, a bad terminator ends replay */
+		rpath = (const char *)(rec + 1);
+		name = rpath + path_len + 1;
+		if (rpath[path_len] || name[name_len])
+			break;
+
+		seq = le64_to_cpu(rec->seq);
+		if (seq > reg_db_snap_seq)
+			reg_db_apply(rec, rpath, name, name + name_len + 1);
+		if (seq > reg_db_seq)
+			reg_db_seq = seq;
+		off += rsize;
+	}
+
+	if (off != size)
+		cifssrv_err("dropping %zu bytes of torn journal in %s\n",
+				size - off, path);
+	if (map)
+		munmap((void *)map, size);
+	return off;
+}
+
+static int reg_db_write_str(FILE *fp, const void *buf, size_t len,
+		size_t rec_len)
+{
+	static const char zero[4];
+
+	if (len && fwrite(buf, len, 1, fp) != 1)
+		return -EIO;
+	if (REG_DB_PAD(rec_len) != rec_len &&
+	    fwrite(zero, REG_DB_PAD(rec_len) - rec_len, 1, fp) != 1)
+		return -EIO;
+	return 0;
+}
+
+static int reg_db_write_key(FILE *fp, struct registry_node *key,
+		__u32 parent, __u32 *index)
+{
+	struct registry_value *value;
+	REG_DB_KEY krec;
+	REG_DB_VALUE vrec;
+	__u32 self = (*index)++;
+	size_t name_len;
+	unsigned int i;
+	int ret;
+
+	krec.parent = cpu_to_le32(parent);
+	krec.nr_values = cpu_to_le32(key->nr_values);
+	name_len = strlen(key->key_name);
+	krec.name_len = cpu_to_le16(name_len);
+	krec.reserved = 0;
+	if (fwrite(&krec, sizeof(krec), 1, fp) != 1 ||
+	    reg_db_write_str(fp, key->key_name, name_len + 1,
+		    sizeof(krec) + name_len + 1))
+		return -EIO;
+
+	for (i = 0; i < key->nr_values; i++) {
+		value = key->values[i];
+		name_len = strlen(value->value_name);
+		vrec.type = cpu_to_le32(value->value_type);
+		vrec.data_len = cpu_to_le32(value->value_size);
+		vrec.name_len = cpu_to_le16(name_len);
+		vrec.reserved = 0;
+		if (fwrite(&vrec, sizeof(vrec), 1, fp) != 1 ||
+		    fwrite(value->value_name, name_len + 1, 1, fp) != 1 ||
+		    reg_db_write_str(fp, reg_value_data(value),
+			    value->value_size, sizeof(vrec) + name_len + 1 +
+			    value->value_size))
+			return -EIO;
+	}
+
+	ret = reg_materialize(key);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < key->nr_children; i++) {
+		ret = reg_db_write_key(fp, key->children[i], self, index);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * reg_db_write_snapshot() - write the tree to the snapshot file
+ * @seq:	number of the last journal record included
+ *
+ * The snapshot is written to a temporary file and renamed over the old
+ * one once it is on disk, so a crash leaves either snapshot intact.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int reg_db_write_snapshot(__u64 seq)
+{
+	REG_DB_HDR hdr;
+	__u32 nr_keys = 0;
+	char *tmp;
+	FILE *fp;
+	int i, fd, ret = 0;
+
+	tmp = reg_db_name(reg_db_path, ".tmp");
+	if (!tmp)
+		return -ENOMEM;
+
+	/*
+	 * Private like the journal. A file left by a crash keeps its mode
+	 * through O_TRUNC, so start from a new one.
+	 */
+	unlink(tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	fp = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!fp) {
+		ret = -errno;
+		if (fd >= 0)
+			close(fd);
+		free(tmp);
+		return ret;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		ret = -EIO;
+
+	for (i = 0; !ret && i < REG_DB_NR_ROOTS; i++)
+		ret = reg_db_write_key(fp, *reg_db_roots[i], REG_DB_ROOT,
+				&nr_keys);
+
+	if (!ret) {
+		memcpy(hdr.magic, REG_DB_MAGIC, sizeof(REG_DB_MAGIC));
+		hdr.version = cpu_to_le32(REG_DB_VERSION);
+		hdr.nr_keys = cpu_to_le32(nr_keys);
+		hdr.seq = cpu_to_le64(seq);
+		hdr.size = cpu_to_le64(ftello(fp));
+		if (fseek(fp, 0, SEEK_SET) ||
+		    fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		    fflush(fp) || fsync(fileno(fp)))
+			ret = -EIO;
+	}
+
+	if (fclose(fp) && !ret)
+		ret = -EIO;
+	if (!ret && rename(tmp, reg_db_path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	free(tmp);
+	return ret;
+}
+
+/**
+ * reg_db_reap() - collect the compaction child
+ * @wait:	block until it is done
+ */
+static void reg_db_reap(int wait)
+{
+	struct stat st;
+	int status;
+	pid_t pid;
+
+	if (!reg_db_compactor)
+		return;
+
+	pid = waitpid(reg_db_compactor, &status, wait ? 0 : WNOHANG);
+	if (!pid)
+		return;
+
+	reg_db_compactor = 0;
+	if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		cifssrv_err("writing registry snapshot %s failed\n",
+				reg_db_path);
+		return;
+	}
+
+	unlink(reg_db_old_path);
+	if (!stat(reg_db_path, &st))
+		reg_db_snap_size = st.st_size;
+}
+
+static void reg_db_compact(void)
+{
+	pid_t pid;
+	int fd;
+
+	if (reg_db_compactor)
+		return;
+
+	/*
+	 * Rotate the journal unless a failed compaction left the old one
+	 * behind; then the current one is kept, and the records the new
+	 * snapshot covers are skipped by number on replay.
+	 */
+	if (access(reg_db_old_path, F_OK) && !rename(reg_db_log_path,
+				reg_db_old_path)) {
+		fd = open(reg_db_log_path, O_WRONLY | O_CREAT | O_TRUNC |
+				O_APPEND, 0600);
+		if (fd < 0) {
+			cifssrv_err("cannot open registry journal %s: %d\n",
+					reg_db_log_path, errno);
+			rename(reg_db_old_path, reg_db_log_path);
+			return;
+		}
+		close(reg_db_fd);
+		reg_db_fd = fd;
+		reg_db_log_size = 0;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		cifssrv_err("cannot fork registry compaction: %d\n", errno);
+		return;
+	}
+	if (!pid)
+		_exit(reg_db_write_snapshot(reg_db_seq) ? 1 : 0);
+	reg_db_compactor = pid;
+}
+
+static void reg_db_log(int op, struct registry_node *key, const char *name,
+		__u32 type, const char *data, __u32 data_len)
+{
+	REG_LOG_REC *rec;
+	size_t path_len, name_len, size;
+	ssize_t n;
+	char *path, *p;
+	int root;
+
+	if (reg_db_fd < 0)
+		return;
+
+	path = reg_db_key_path(key, &root);
+	if (!path) {
+		cifssrv_err("cannot journal registry change to %s\n",
+				key->key_name);
+		return;
+	}
+
+	path_len = strlen(path);
+	name_len = name ? strlen(name) : 0;
+	size = REG_LOG_PAD(sizeof(REG_LOG_REC) + path_len + 1 + name_len + 1 +
+			data_len);
+	rec = calloc(1, size);
+	if (!rec) {
+		free(path);
+		cifssrv_err("cannot journal registry change to %s\n",
+				key->key_name);
+		return;
+	}
+
+	rec->size = cpu_to_le32(size);
+	rec->seq = cpu_to_le64(++reg_db_seq);
+	rec->op = op;
+	rec->root = root;
+	rec->name_len = cpu_to_le16(name_len);
+	rec->path_len = cpu_to_le32(path_len);
+	rec->type = cpu_to_le32(type);
+	rec->data_len = cpu_to_le32(data_len);
+	p = (char *)(rec + 1);
+	memcpy(p, path, path_len + 1);
+	p += path_len + 1;
+	if (name)
+		memcpy(p, name, name_len + 1);
+	p += name_len + 1;
+	if (data_len)
+		memcpy(p, data, data_len);
+	rec->sum = cpu_to_le32(reg_log_sum(&rec->seq, size - 8));
+	free(path);
+
+	p = (char *)rec;
+	while (size) {
+		n = write(reg_db_fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			cifssrv_err("registry journal write failed: %d\n",
+					errno);
+			/* do not leave a torn record in front of later ones */
+			if (ftruncate(reg_db_fd, reg_db_log_size))
+				cifssrv_err("cannot truncate %s\n",
+						reg_db_log_path);
+			free(rec);
+			return;
+		}
+		p += n;
+		size -= n;
+		reg_db_log_size += n;
+	}
+	free(rec);
+
+	reg_db_reap(0);
+	if (reg_db_log_size >= REG_DB_COMPACT_MIN &&
+	    reg_db_log_size >= reg_db_snap_size)
+		reg_db_compact();
+}
+
+void reg_db_create_key(struct registry_node *key)
+{
+	reg_db_log(REG_LOG_CREATE_KEY, key, NULL, 0, NULL, 0);
+}
+
+void reg_db_delete_key(struct registry_node *key)
+{
+	reg_db_log(REG_LOG_DELETE_KEY, key, NULL, 0, NULL, 0);
+}
+
+void reg_db_set_value(struct registry_node *key, struct registry_value *value)
+{
+	reg_db_log(REG_LOG_SET_VALUE, key, value->value_name,
+			value->value_type, reg_value_data(value),
+			value->value_size);
+}
+
+void reg_db_delete_value(struct registry_node *key, const char *name)
+{
+	reg_db_log(REG_LOG_DELETE_VALUE, key, name, 0, NULL, 0);
+}
+
+/**
+ * reg_db_open() - load the registry tree from the snapshot
+ * @path:	snapshot file, the journal is kept next to it
+ *
+ * Return:	0 on success, -ENOENT if there is no snapshot yet, otherwise
+ *		error
+ */
+int reg_db_open(const char *path)
+{
+	reg_db_path = strdup(path);
+	reg_db_log_path = reg_db_name(path, ".log");
+	reg_db_old_path = reg_db_name(path, ".log.old");
+	if (!reg_db_path || !reg_db_log_path || !reg_db_old_path)
+		return -ENOMEM;
+
+	return reg_db_load_snapshot(path);
+}
+
+/**
+ * reg_db_start_log() - replay the journal and open it for appending
+ *
+ * Return:	0 on success, otherwise error
+ */
+int reg_db_start_log(void)
+{
+	off_t len;
+
+	len = reg_db_replay(reg_db_old_path);
+	if (len < 0 && len != -ENOENT)
+		return len;
+
+	len = reg_db_replay(reg_db_log_path);
+	if (len == -ENOENT)
+		len = 0;
+	else if (len < 0)
+		return len;
+
+	reg_db_fd = open(reg_db_log_path, O_WRONLY | O_CREAT | O_APPEND,
+			0600);
+	if (reg_db_fd < 0)
+		return -errno;
+	if (ftruncate(reg_db_fd, len)) {
+		close(reg_db_fd);
+		reg_db_fd = -1;
+		return -errno;
+	}
+	reg_db_log_size = len;
+
+	if (reg_db_log_size >= REG_DB_COMPACT_MIN &&
+	    reg_db_log_size >= reg_db_snap_size)
+		reg_db_compact();
+	return 0;
+}
+
+/**
+ * reg_db_checkpoint() - write a snapshot of the tree now
+ *
+ * For changes made to the tree without journaling them, such as an
+ * import. The snapshot includes every journal record, so the journal is
+ * emptied.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int reg_db_checkpoint(void)
+{
+	struct stat st;
+	int ret;
+
+	if (!reg_db_path)
+		return 0;
+
+	reg_db_reap(1);
+	ret = reg_db_write_snapshot(reg_db_seq);
+	if (ret)
+		return ret;
+
+	unlink(reg_db_old_path);
+	if (reg_db_fd >= 0 && !ftruncate(reg_db_fd, 0))
+		reg_db_log_size = 0;
+	if (!stat(reg_db_path, &st))
+		reg_db_snap_size = st.st_size;
+	return 0;
+}
+
+void reg_db_close(void)
+{
+	reg_db_reap(1);
+	if (reg_db_fd >= 0)
+		close(reg_db_fd);
+	reg_db_fd = -1;
+	free(reg_db_path);
+	free(reg_db_log_path);
+	free(reg_db_old_path);
+	reg_db_path = reg_db_log_path = reg_db_old_path = NULL;
+}
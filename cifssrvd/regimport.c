@@ -0,0 +1,708 @@
+/*
+ *   cifssrv-tools/cifssrvd/regimport.c
+ *
+ *   Import of registry editor (.reg) files into the winreg tree, for
+ *   provisioning keys and values ahead of the clients that query them.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <fcntl.h>
+#include "winreg.h"
+
+/*
+ * Both formats regedit exports are accepted:
+ *
+ *	Windows Registry Editor Version 5.00	UTF-16LE with a BOM
+ *	REGEDIT4				8 bit text
+ *
+ *	[HKEY_LOCAL_MACHINE\SOFTWARE\Vendor]	create key, make it current
+ *	[-HKEY_LOCAL_MACHINE\SOFTWARE\Old]	delete key and subtree
+ *	"Name"="text"				REG_SZ
+ *	"Name"=dword:0000000a			REG_DWORD
+ *	"Name"=hex:01,02,\			REG_BINARY, continued on
+ *	  03,04					the next line
+ *	"Name"=hex(7):41,00,00,00,00,00		any other type, by number
+ *	@="text"				default value
+ *	"Name"=-				delete value
+ *	; comment
+ *
+ * The file is read in fixed size blocks and decoded to UTF-8 one line at
+ * a time, so memory use does not depend on the size of the file. Keys
+ * and values go straight into the tree.
+ *
+ * Nothing is journaled while importing. The caller writes a snapshot
+ * afterwards with reg_db_checkpoint().
+ */
+#define REG_IMPORT_BUF		(64 * 1024)
+
+#define REG_IMPORT_HDR_V5	"Windows Registry Editor Version 5.00"
+#define REG_IMPORT_HDR_V4	"REGEDIT4"
+
+struct reg_import {
+	int fd;
+	/* the file is UTF-16LE */
+	int utf16;
+	/* REGEDIT4, strings in hex(2) and hex(7) data are 8 bit */
+	int ansi;
+	unsigned char *buf;
+	size_t pos;
+	size_t len;
+
+	/* current line, UTF-8 */
+	char *line;
+	size_t line_len;
+	size_t line_size;
+	unsigned long lineno;
+
+	/* value data being decoded */
+	char *data;
+	size_t data_len;
+	size_t data_size;
+
+	/* key of the current section, NULL if its values are ignored */
+	struct registry_node *key;
+	int skip;
+
+	unsigned int nr_keys;
+	unsigned int nr_values;
+};
+
+static const struct {
+	const char *name;
+	struct registry_node **root;
+} reg_import_roots[] = {
+	{ "HKEY_CLASSES_ROOT",	&reg_openhkcr },
+	{ "HKEY_CURRENT_USER",	&reg_openhkcu },
+	{ "HKEY_LOCAL_MACHINE",	&reg_openhklm },
+	{ "HKEY_USERS",		&reg_openhku },
+	{ "HKCR",		&reg_openhkcr },
+	{ "HKCU",		&reg_openhkcu },
+	{ "HKLM",		&reg_openhklm },
+	{ "HKU",		&reg_openhku },
+};
+
+#define REG_IMPORT_NR_ROOTS \
+	(sizeof(reg_import_roots) / sizeof(reg_import_roots[0]))
+
+static int reg_import_reserve(char **buf, size_t *size, size_t need)
+{
+	size_t new_size;
+	char *p;
+
+	if (need <= *size)
+		return 0;
+
+	new_size = *size ? *size : 256;
+	while (new_size < need)
+		new_size *= 2;
+	p = realloc(*buf, new_size);
+	if (!p)
+		return -ENOMEM;
+	*buf = p;
+	*size = new_size;
+	return 0;
+}
+
+/**
+ * reg_import_fill() - read the next block of the file
+ * @ri:		import state
+ *
+ * Bytes not consumed yet are moved to the front of the buffer first.
+ *
+ * Return:	number of bytes read, 0 at end of file, otherwise error
+ */
+static ssize_t reg_import_fill(struct reg_import *ri)
+{
+	ssize_t n;
+
+	if (ri->pos)
+		memmove(ri->buf, ri->buf + ri->pos, ri->len - ri->pos);
+	ri->len -= ri->pos;
+	ri->pos = 0;
+
+	do {
+		n = read(ri->fd, ri->buf + ri->len, REG_IMPORT_BUF - ri->len);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -errno;
+	ri->len += n;
+	return n;
+}
+
+/* up to the next newline of an 8 bit file, return 1 if it was found */
+static int reg_import_scan8(struct reg_import *ri)
+{
+	unsigned char *start = ri->buf + ri->pos;
+	unsigned char *nl;
+	size_t n;
+
+	nl = memchr(start, '\n', ri->len - ri->pos);
+	n = nl ? nl - start : ri->len - ri->pos;
+	if (reg_import_reserve(&ri->line, &ri->line_size, ri->line_len + n + 1))
+		return -ENOMEM;
+
+	memcpy(ri->line + ri->line_len, start, n);
+	ri->line_len += n;
+	ri->pos += nl ? n + 1 : n;
+	return nl != NULL;
+}
+
+/* up to the next newline of a UTF-16LE file, return 1 if it was found */
+static int reg_import_scan16(struct reg_import *ri)
+{
+	unsigned char *b = ri->buf;
+	unsigned int c, c2;
+	char *out;
+
+	while (ri->pos + 1 < ri->len) {
+		c = b[ri->pos] | b[ri->pos + 1] << 8;
+		if (c == '\n') {
+			ri->pos += 2;
+			return 1;
+		}
+
+		if (c >= 0xd800 && c < 0xdc00) {
+			/* wait for the low surrogate to be read */
+			if (ri->pos + 3 >= ri->len)
+				return 0;
+			c2 = b[ri->pos + 2] | b[ri->pos + 3] << 8;
+			if (c2 >= 0xdc00 && c2 < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) +
+					(c2 - 0xdc00);
+				ri->pos += 2;
+			}
+		}
+		ri->pos += 2;
+
+		if (reg_import_reserve(&ri->line, &ri->line_size,
+					ri->line_len + 5))
+			return -ENOMEM;
+		out = ri->line + ri->line_len;
+		if (c < 0x80) {
+			*out++ = c;
+		} else if (c < 0x800) {
+			*out++ = 0xc0 | c >> 6;
+			*out++ = 0x80 | (c & 0x3f);
+		} else if (c < 0x10000) {
+			*out++ = 0xe0 | c >> 12;
+			*out++ = 0x80 | ((c >> 6) & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		} else {
+			*out++ = 0xf0 | c >> 18;
+			*out++ = 0x80 | ((c >> 12) & 0x3f);
+			*out++ = 0x80 | ((c >> 6) & 0x3f);
+			*out++ = 0x80 | (c & 0x3f);
+		}
+		ri->line_len = out - ri->line;
+	}
+	return 0;
+}
+
+/**
+ * reg_import_getline() - append the next line of the file to ri->line
+ * @ri:		import state
+ *
+ * Return:	1 if a line was read, 0 at end of file, otherwise error
+ */
+static int reg_import_getline(struct reg_import *ri)
+{
+	size_t start = ri->line_len;
+	ssize_t n;
+	int ret;
+
+	for (;;) {
+		ret = ri->utf16 ? reg_import_scan16(ri) : reg_import_scan8(ri);
+		if (ret)
+			break;
+		n = reg_import_fill(ri);
+		if (n < 0)
+			return n;
+		if (!n) {
+			ret = ri->line_len > start;
+			break;
+		}
+	}
+	if (ret <= 0)
+		return ret;
+
+	if (ri->line_len > start && ri->line[ri->line_len - 1] == '\r')
+		ri->line_len--;
+	ri->line[ri->line_len] = '\0';
+	ri->lineno++;
+	return 1;
+}
+
+/**
+ * reg_import_next() - read the next logical line
+ * @ri:		import state
+ *
+ * A value line ending in a backslash goes on in the next line, without
+ * the indentation of that line.
+ *
+ * Return:	1 if a line was read, 0 at end of file, otherwise error
+ */
+static int reg_import_next(struct reg_import *ri)
+{
+	size_t start, n;
+	char *p;
+	int ret;
+
+	ri->line_len = 0;
+	ret = reg_import_getline(ri);
+	if (ret <= 0)
+		return ret;
+
+	p = ri->line + strspn(ri->line, " \t");
+	if (*p != '"' && *p != '@')
+		return 1;
+
+	for (;;) {
+		while (ri->line_len && (ri->line[ri->line_len - 1] == ' ' ||
+					ri->line[ri->line_len - 1] == '\t'))
+			ri->line_len--;
+		if (!ri->line_len || ri->line[ri->line_len - 1] != '\\')
+			break;
+
+		start = --ri->line_len;
+		ret = reg_import_getline(ri);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			break;
+
+		p = ri->line + start;
+		n = strspn(p, " \t");
+		memmove(p, p + n, ri->line_len - start - n + 1);
+		ri->line_len -= n;
+	}
+	ri->line[ri->line_len] = '\0';
+	return 1;
+}
+
+/**
+ * reg_import_section() - make the key of a section line current
+ * @ri:		import state
+ * @p:		line after the opening bracket
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int reg_import_section(struct reg_import *ri, char *p)
+{
+	struct registry_node *root = NULL, *key;
+	char *end, *token;
+	int del, i;
+
+	ri->key = NULL;
+	ri->skip = 1;
+
+	end = strrchr(p, ']');
+	if (!end || end[strspn(end + 1, " \t") + 1])
+		return -EINVAL;
+	/* regedit does not write a trailing backslash, reg.exe accepts it */
+	while (end > p && end[-1] == '\\')
+		end--;
+	*end = '\0';
+
+	del = *p == '-';
+	if (del)
+		p++;
+
+	token = strsep(&p, "\\");
+	for (i = 0; i < REG_IMPORT_NR_ROOTS; i++) {
+		if (!strcasecmp(token, reg_import_roots[i].name)) {
+			root = *reg_import_roots[i].root;
+			break;
+		}
+	}
+	if (!root) {
+		cifssrv_err("line %lu: skipping unsupported root key %s\n",
+				ri->lineno, token);
+		return 0;
+	}
+
+	if (del) {
+		if (!p || !*p)
+			return -EINVAL;
+		key = search_registry(p, root);
+		if (IS_ERR(key))
+			return 0;
+		return delete_key(key);
+	}
+
+	key = p && *p ? create_key(p, root, NULL) : root;
+	if (IS_ERR(key))
+		return PTR_ERR(key);
+
+	ri->key = key;
+	ri->skip = 0;
+	ri->nr_keys++;
+	return 0;
+}
+
+/**
+ * reg_import_string() - unquote a string in place
+ * @p:		points at the opening quote, moved past the closing one
+ *
+ * Return:	length of the string, otherwise -EINVAL
+ */
+static int reg_import_string(char **p)
+{
+	char *s = *p + 1, *d = s, *start = s;
+
+	while (*s && *s != '"') {
+		if (*s == '\\' && (s[1] == '\\' || s[1] == '"'))
+			s++;
+		*d++ = *s++;
+	}
+	if (*s != '"')
+		return -EINVAL;
+
+	*d = '\0';
+	*p = s + 1;
+	return d - start;
+}
+
+/*
+ * Decode one character of UTF-8. A byte that does not start a valid
+ * sequence is taken as Latin-1, which is what 8 bit REGEDIT4 text
+ * usually is.
+ */
+static unsigned int reg_import_utf8(const unsigned char **s,
+		const unsigned char *end)
+{
+	const unsigned char *p = *s;
+	unsigned int c = *p;
+	int n, i;
+
+	if (c >= 0xc2 && c < 0xe0)
+		n = 1;
+	else if (c >= 0xe0 && c < 0xf0)
+		n = 2;
+	else if (c >= 0xf0 && c < 0xf5)
+		n = 3;
+	else
+		n = 0;
+	if (end - p <= n)
+		n = 0;
+
+	c &= 0x3f >> n;
+	for (i = 1; i <= n; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			*s = p + 1;
+			return *p;
+		}
+		c = c << 6 | (p[i] & 0x3f);
+	}
+	*s = p + n + 1;
+	return n ? c : *p;
+}
+
+/* encode as NUL terminated UTF-16LE, the way clients store REG_SZ data */
+static int reg_import_utf16(struct reg_import *ri, const char *str, int len)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	const unsigned char *end = s + len;
+	unsigned int c;
+	__u8 *d;
+
+	ri->data_len = 0;
+	if (reg_import_reserve(&ri->data, &ri->data_size, 4 * len + 2))
+		return -ENOMEM;
+
+	d = (__u8 *)ri->data;
+	while (s < end) {
+		c = reg_import_utf8(&s, end);
+		if (c >= 0x10000) {
+			c -= 0x10000;
+			*d++ = (0xd800 | c >> 10) & 0xff;
+			*d++ = (0xd800 | c >> 10) >> 8;
+			c = 0xdc00 | (c & 0x3ff);
+		}
+		*d++ = c & 0xff;
+		*d++ = c >> 8;
+	}
+	*d++ = 0;
+	*d++ = 0;
+	ri->data_len = d - (__u8 *)ri->data;
+	return 0;
+}
+
+/* comma separated hex bytes, as written by regedit */
+static int reg_import_hex(struct reg_import *ri, char *p)
+{
+	unsigned long byte;
+	char *end;
+
+	ri->data_len = 0;
+	for (;;) {
+		p += strspn(p, " \t");
+		if (!*p)
+			return 0;
+		if (!isxdigit(*p))
+			return -EINVAL;
+		byte = strtoul(p, &end, 16);
+		if (byte > 0xff)
+			return -EINVAL;
+		if (ri->data_len == ri->data_size &&
+		    reg_import_reserve(&ri->data, &ri->data_size,
+			    ri->data_len + 1))
+			return -ENOMEM;
+		ri->data[ri->data_len++] = byte;
+
+		p = end + strspn(end, " \t");
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -EINVAL;
+	}
+}
+
+/* widen the 8 bit strings of REGEDIT4 hex(2) and hex(7) data in place */
+static int reg_import_widen(struct reg_import *ri)
+{
+	size_t i = ri->data_len;
+
+	if (reg_import_reserve(&ri->data, &ri->data_size, 2 * i))
+		return -ENOMEM;
+
+	while (i--) {
+		ri->data[2 * i] = ri->data[i];
+		ri->data[2 * i + 1] = 0;
+	}
+	ri->data_len *= 2;
+	return 0;
+}
+
+/**
+ * reg_import_value() - set or delete a value of the current key
+ * @ri:		import state
+ * @p:		line, at the value name
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int reg_import_value(struct reg_import *ri, char *p)
+{
+	struct registry_value *value;
+	unsigned long num;
+	__u32 type, dword;
+	char *name, *end;
+	int len;
+
+	if (!ri->key)
+		return ri->skip ? 0 : -EINVAL;
+
+	if (*p == '@') {
+		name = "";
+		p++;
+	} else {
+		name = p + 1;
+		len = reg_import_string(&p);
+		if (len < 0)
+			return len;
+	}
+
+	p += strspn(p, " \t");
+	if (*p++ != '=')
+		return -EINVAL;
+	p += strspn(p, " \t");
+
+	if (*p == '-' && !p[strspn(p + 1, " \t") + 1]) {
+		delete_value(name, ri->key);
+		return 0;
+	}
+
+	if (*p == '"') {
+		end = p + 1;
+		len = reg_import_string(&p);
+		if (len < 0 || p[strspn(p, " \t")])
+			return -EINVAL;
+		type = REG_SZ;
+		if (reg_import_utf16(ri, end, len))
+			return -ENOMEM;
+	} else if (!strncasecmp(p, "dword:", 6)) {
+		p += 6;
+		if (!isxdigit(*p))
+			return -EINVAL;
+		num = strtoul(p, &end, 16);
+		if (num > 0xffffffffUL || end - p > 8 ||
+		    end[strspn(end, " \t")])
+			return -EINVAL;
+		type = REG_DWORD;
+		dword = cpu_to_le32(num);
+		ri->data_len = 0;
+		if (reg_import_reserve(&ri->data, &ri->data_size,
+					sizeof(dword)))
+			return -ENOMEM;
+		memcpy(ri->data, &dword, sizeof(dword));
+		ri->data_len = sizeof(dword);
+	} else if (!strncasecmp(p, "hex", 3)) {
+		p += 3;
+		type = REG_BINARY;
+		if (*p == '(') {
+			num = strtoul(p + 1, &end, 16);
+			if (end == p + 1 || *end != ')' || num > 0xffffffffUL)
+				return -EINVAL;
+			type = num;
+			p = end + 1;
+		}
+		if (*p++ != ':')
+			return -EINVAL;
+		len = reg_import_hex(ri, p);
+		if (len)
+			return len;
+		if (ri->ansi && (type == REG_EXPAND_SZ ||
+					type == REG_MULTI_SZ) &&
+		    reg_import_widen(ri))
+			return -ENOMEM;
+	} else {
+		return -EINVAL;
+	}
+
+	value = set_value(name, type, ri->data, ri->data_len, ri->key);
+	if (IS_ERR(value))
+		return PTR_ERR(value);
+	ri->nr_values++;
+	return 0;
+}
+
+/**
+ * reg_import_header() - check the first line and the encoding
+ * @ri:		import state
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int reg_import_header(struct reg_import *ri)
+{
+	ssize_t n;
+	int ret;
+
+	n = reg_import_fill(ri);
+	if (n < 0)
+		return n;
+
+	if (ri->len >= 2 && ri->buf[0] == 0xff && ri->buf[1] == 0xfe) {
+		ri->utf16 = 1;
+		ri->pos = 2;
+	} else if (ri->len >= 3 && !memcmp(ri->buf, "\xef\xbb\xbf", 3)) {
+		ri->pos = 3;
+	}
+
+	ret = reg_import_next(ri);
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		return -EINVAL;
+
+	while (ri->line_len && (ri->line[ri->line_len - 1] == ' ' ||
+				ri->line[ri->line_len - 1] == '\t'))
+		ri->line[--ri->line_len] = '\0';
+
+	if (!strcmp(ri->line, REG_IMPORT_HDR_V4))
+		ri->ansi = 1;
+	else if (strcmp(ri->line, REG_IMPORT_HDR_V5))
+		return -EINVAL;
+	return 0;
+}
+
+/**
+ * cifssrv_import_registry() - import a .reg file into the registry
+ * @path:	REGEDIT4 or Windows Registry Editor 5.00 file
+ *
+ * Lines that cannot be imported are reported and skipped. The imported
+ * keys and values are written to the persistent registry, if there is
+ * one, when the file is done.
+ *
+ * Return:	0 on success, -EINVAL if some lines were skipped, otherwise
+ *		error
+ */
+int cifssrv_import_registry(const char *path)
+{
+	struct reg_import *ri;
+	unsigned int nr_errors = 0;
+	char *p;
+	int ret, err;
+
+	ri = calloc(1, sizeof(*ri));
+	if (!ri)
+		return -ENOMEM;
+	ri->buf = malloc(REG_IMPORT_BUF);
+	if (!ri->buf) {
+		free(ri);
+		return -ENOMEM;
+	}
+
+	ri->fd = open(path, O_RDONLY);
+	if (ri->fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	posix_fadvise(ri->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ret = reg_import_header(ri);
+	if (ret) {
+		cifssrv_err("%s is not a registry file\n", path);
+		goto out_close;
+	}
+
+	while ((ret = reg_import_next(ri)) > 0) {
+		p = ri->line + strspn(ri->line, " \t");
+		switch (*p) {
+		case '\0':
+		case ';':
+			continue;
+		case '[':
+			err = reg_import_section(ri, p + 1);
+			break;
+		case '"':
+		case '@':
+			err = reg_import_value(ri, p);
+			break;
+		default:
+			err = -EINVAL;
+		}
+
+		if (err == -ENOMEM) {
+			ret = err;
+			break;
+		}
+		if (err) {
+			cifssrv_err("%s:%lu: cannot import line: %d\n",
+					path, ri->lineno, err);
+			nr_errors++;
+		}
+	}
+
+	cifssrv_debug("imported %u keys, %u values from %s\n",
+			ri->nr_keys, ri->nr_values, path);
+
+	err = reg_db_checkpoint();
+	if (err) {
+		cifssrv_err("cannot save imported registry: %d\n", err);
+		if (!ret)
+			ret = err;
+	}
+	if (!ret && nr_errors)
+		ret = -EINVAL;
+
+out_close:
+	close(ri->fd);
+out:
+	free(ri->buf);
+	free(ri->line);
+	free(ri->data);
+	free(ri);
+	return ret;
+}
@@ -0,0 +1,161 @@
+/*
+ *   cifssrv-tools/cifssrvd/rpc_idl.h
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSSRV_RPC_IDL_H
+#define __CIFSSRV_RPC_IDL_H
+
+/*
+ * Interface descriptions for the RPC pipes. Response layouts are
+ * F(type, field, NDR alignment) lists, expanded by NDR_STRUCT() in ndr.h
+ * into the response type and its ndr_push_*() encoder. Interface tables
+ * are OP(opnum, request handler, response encoder) lists, expanded by
+ * dcerpc.c into the request and response dispatchers.
+ *
+ * Layouts made of some of the fields of an in-memory structure, like the
+ * srvsvc ones, are expanded by NDR_ENCODER() into an encoder only.
+ *
+ * Adding an opnum with a fixed layout response only takes a layout here,
+ * an NDR_STRUCT() line next to the other responses and a table entry.
+ * Strings and arrays are still put by hand between the fixed parts, and
+ * requests, which are mostly variable sized, are pulled field by field
+ * with the ndr_pull_*() cursor helpers rather than described here.
+ */
+
+/* wkssvc NetrWkstaGetInfo, level 100, up to the referred strings */
+#define WKSSVC_WKSTA_INFO_IDL(F)					\
+	F(RPC_REQUEST_RSP,	rpc_request_rsp,		8)	\
+	F(__u32,		info_level,			4)	\
+	F(__u32,		platform_id,			4)	\
+	F(__u32,		refid,				4)	\
+	F(__u32,		ref_id1,			4)	\
+	F(__u32,		ref_id2,			4)	\
+	F(__u32,		maj,				4)	\
+	F(__u32,		min,				4)
+
+/* srvsvc NetShareEnumAll, up to the share info entries */
+#define SRVSVC_SHARE_COMMON_INFO_IDL(F)					\
+	F(__u32,		info_level,			4)	\
+	F(__u32,		switch_value,			4)	\
+	F(__u32,		ptr_share_info,			4)	\
+	F(__u32,		num_entries,			4)	\
+	F(__u32,		ptr_entries,			4)	\
+	F(__u32,		num_entries2,			4)
+
+#define SRVSVC_SHARE_ENUM_HDR_IDL(F)					\
+	F(RPC_REQUEST_RSP,	rpc_request_rsp,		8)	\
+	F(SRVSVC_SHARE_COMMON_INFO, info,			4)
+
+/* after the strings of the last entry */
+#define SRVSVC_SHARE_ENUM_TAIL_IDL(F)					\
+	F(__u32,		total_entries,			4)	\
+	F(__u32,		resume_handle,			4)	\
+	F(__u32,		status,				4)
+
+/* srvsvc NetShareGetInfo, the switch value doubles as the info pointer */
+#define SRVSVC_SHARE_GETINFO_HDR_IDL(F)					\
+	F(RPC_REQUEST_RSP,	rpc_request_rsp,		8)	\
+	F(__u32,		info_level,			4)	\
+	F(__u32,		switch_value,			4)
+
+#define SRVSVC_SHARE_GETINFO_TAIL_IDL(F)				\
+	F(__u32,		status,				4)
+
+/* fixed part of a share info entry, each level adds to a smaller one */
+#define SHARE_INFO_0_IDL(F)						\
+	F(__u32,		ptr_netname,			4)
+
+#define SHARE_INFO_1_IDL(F)						\
+	SHARE_INFO_0_IDL(F)						\
+	F(__u32,		type,				4)	\
+	F(__u32,		ptr_remark,			4)
+
+#define SHARE_INFO_2_IDL(F)						\
+	SHARE_INFO_1_IDL(F)						\
+	F(__u32,		permissions,			4)	\
+	F(__u32,		max_uses,			4)	\
+	F(__u32,		current_uses,			4)	\
+	F(__u32,		ptr_path,			4)	\
+	F(__u32,		ptr_passwd,			4)
+
+#define SHARE_INFO_501_IDL(F)						\
+	SHARE_INFO_1_IDL(F)						\
+	F(__u32,		csc_flags,			4)
+
+#define SHARE_INFO_502_IDL(F)						\
+	SHARE_INFO_2_IDL(F)						\
+	F(__u32,		reserved,			4)	\
+	F(__u32,		ptr_sd,				4)
+
+/* share info levels, OP(level, encoder, layout) */
+#define SRVSVC_SHARE_INFO_LEVELS(OP)					\
+	OP(INFO_0,		share_info_0,		SHARE_INFO_0)	\
+	OP(INFO_1,		share_info_1,		SHARE_INFO_1)	\
+	OP(INFO_2,		share_info_2,		SHARE_INFO_2)	\
+	OP(INFO_501,		share_info_501,		SHARE_INFO_501)	\
+	OP(INFO_502,		share_info_502,		SHARE_INFO_502)
+
+/* winreg responses, FILETIME is two 32 bit words so only 4 aligned */
+#define OPENHKEY_RSP_IDL(F)						\
+	F(RPC_REQUEST_RSP,	rpc_request_rsp,		8)	\
+	F(KEY_HANDLE,		key_handle,			4)	\
+	F(__u32,		werror,				4)
+
+#define GET_VERSION_RSP_IDL(F)						\
+	F(RPC_REQUEST_RSP,	rpc_request_rsp,		8)	\
+	F(__u32,		version,			4)	\
+	F(__u32,		werror,				4)
+
+#define WINREG_COMMON_RSP_IDL(F)					\
+	F(RPC_REQUEST_RSP,	rpc_request_rsp,		8)	\
+	F(__u32,		werror,				4)
+
+#define CREATE_KEY_RSP_IDL(F)						\
+	F(RPC_REQUEST_RSP,	rpc_request_rsp,		8)	\
+	F(KEY_HANDLE,		key_handle,			4)	\
+	F(__u32,		ref_id,				4)	\
+	F(__u32,		action_taken,			4)	\
+	F(__u32,		werror,				4)
+
+#define QUERY_INFO_KEY_RSP_IDL(F)					\
+	F(RPC_REQUEST_RSP,	rpc_request_rsp,		8)	\
+	F(CLASSNAME_INFO,	class_info,			4)	\
+	F(KEY_INFO,		key_info,			4)	\
+	F(__u32,		werror,				4)
+
+/* winreg interface, see winreg.h for the variable sized responses */
+#define WINREG_IDL(OP)							\
+	OP(WINREG_OPENHKCR,	winreg_open_root_key,	openhkey_rsp)	\
+	OP(WINREG_OPENHKCU,	winreg_open_root_key,	openhkey_rsp)	\
+	OP(WINREG_OPENHKLM,	winreg_open_root_key,	openhkey_rsp)	\
+	OP(WINREG_OPENHKU,	winreg_open_root_key,	openhkey_rsp)	\
+	OP(WINREG_CLOSEKEY,	winreg_close_key,	openhkey_rsp)	\
+	OP(WINREG_CREATEKEY,	winreg_create_key,	create_key_rsp)	\
+	OP(WINREG_DELETEKEY,	winreg_delete_key,	winreg_common_rsp) \
+	OP(WINREG_DELETEVALUE,	winreg_delete_value,	winreg_common_rsp) \
+	OP(WINREG_ENUMKEY,	winreg_enum_key,	enum_key_rsp)	\
+	OP(WINREG_ENUMVALUE,	winreg_enum_value,	enum_value_rsp)	\
+	OP(WINREG_FLUSHKEY,	winreg_flush_key,	winreg_common_rsp) \
+	OP(WINREG_NOTIFYCHANGEKEYVALUE, winreg_notify_change_key_value,	\
+				winreg_common_rsp)			\
+	OP(WINREG_OPENKEY,	winreg_open_key,	openhkey_rsp)	\
+	OP(WINREG_QUERYINFOKEY,	winreg_query_info_key,	query_info_key_rsp) \
+	OP(WINREG_QUERYVALUE,	winreg_query_value,	query_value_rsp) \
+	OP(WINREG_SETVALUE,	winreg_set_value,	winreg_common_rsp) \
+	OP(WINREG_GETVERSION,	winreg_get_version,	get_version_rsp)
+
+#endif /* __CIFSSRV_RPC_IDL_H */
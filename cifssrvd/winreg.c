@@ -19,34 +19,1216 @@
  *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
  */
 
+#include <time.h>
 #include "winreg.h"
+#include "netlink.h"
 
 struct registry_node *reg_openhkcr;
 struct registry_node *reg_openhkcu;
 struct registry_node *reg_openhklm;
 struct registry_node *reg_openhku;
 
-/* Predefined registry*/
-unsigned int npre_def_keys = 14;
-
-char *pre_def_key[] = {
-	"SYSTEM\\CurrentControlSet\\Services",
-	"SYSTEM\\CurrentControlSet\\Services\\Eventlog",
-	"SYSTEM\\CurrentControlSet\\Services\\LanmanServer\\Shares",
-	"SYSTEM\\CurrentControlSet\\Services\\Netlogon\\Parameters",
-	"SYSTEM\\CurrentControlSet\\Services\\Tcpip\\Parameters",
-	"SYSTEM\\CurrentControlSet\\Control\\ProductOptions",
-	"SYSTEM\\CurrentControlSet\\Control\\Print",
-	"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Print\\Printers",
-	"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Ports",
-	"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion",
-	"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Perflib",
-	"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Perflib\\009",
-	"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Group Policy",
-	"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Winlogon",
+/*
+ * The registry is owned by the netlink thread and takes no locks. All
+ * pipe traffic arrives on the one netlink socket and is handled in order,
+ * so requests never overlap, and a lookup is a small part of the cost of
+ * a request next to the netlink round trip. Note that some read requests
+ * still change the tree: looking up or enumerating predefined keys makes
+ * nodes of them, and QueryInfoKey recomputes stale maxima. The snapshot
+ * of the tree for compaction is taken by fork(), see reg_db_compact().
+ */
+
+/*
+ * The predefined keys are a constant table in breadth first order, so
+ * the children of an entry are contiguous; the first entries are the
+ * root keys. Nothing is allocated for them at startup: a key refers to
+ * its table entry and its predefined children are made registry nodes
+ * one at a time, when they are looked up. reg_materialize() makes nodes
+ * of all the remaining ones and drops the reference. That is done before
+ * a child is deleted, so a deleted predefined key does not come back.
+ */
+struct reg_base_key {
+	char name[20];
+	unsigned char first_child;
+	unsigned char nr_children;
+};
+
+static const struct reg_base_key reg_base_hive[] = {
+	/*  0 */ { "HKEY_CLASSES_ROOT", 0, 0 },
+	/*  1 */ { "HKEY_CURRENT_USER", 0, 0 },
+	/*  2 */ { "HKEY_LOCAL_MACHINE", 4, 2 },
+	/*  3 */ { "HKEY_USERS", 0, 0 },
+	/*  4 */ { "SYSTEM", 6, 1 },
+	/*  5 */ { "SOFTWARE", 7, 1 },
+	/*  6 */ { "CurrentControlSet", 8, 2 },
+	/*  7 */ { "Microsoft", 10, 1 },
+	/*  8 */ { "Services", 11, 4 },
+	/*  9 */ { "Control", 15, 2 },
+	/* 10 */ { "Windows NT", 17, 1 },
+	/* 11 */ { "Eventlog", 0, 0 },
+	/* 12 */ { "LanmanServer", 18, 1 },
+	/* 13 */ { "Netlogon", 19, 1 },
+	/* 14 */ { "Tcpip", 20, 1 },
+	/* 15 */ { "ProductOptions", 0, 0 },
+	/* 16 */ { "Print", 0, 0 },
+	/* 17 */ { "CurrentVersion", 21, 5 },
+	/* 18 */ { "Shares", 0, 0 },
+	/* 19 */ { "Parameters", 0, 0 },
+	/* 20 */ { "Parameters", 0, 0 },
+	/* 21 */ { "Print", 26, 1 },
+	/* 22 */ { "Ports", 0, 0 },
+	/* 23 */ { "Perflib", 27, 1 },
+	/* 24 */ { "Group Policy", 0, 0 },
+	/* 25 */ { "Winlogon", 0, 0 },
+	/* 26 */ { "Printers", 0, 0 },
+	/* 27 */ { "009", 0, 0 },
+};
+
+/*
+ * Each key hashes its children on the case-folded name, as registry key
+ * names are case-insensitive. The bucket array is allocated with the
+ * first child and doubled whenever there are more children than buckets,
+ * so a path component is resolved with one hash and a short chain walk
+ * however wide the key is. The children array grows with the buckets and
+ * keeps the children in the order they were added, so EnumKey picks the
+ * child at an index directly.
+ */
+#define REG_MIN_HASH_SIZE	4
+#define REG_MIN_VALUES		2
+
+/* seconds between the FILETIME epoch, 1601, and the Unix epoch */
+#define REG_FILETIME_EPOCH	11644473600ULL
+
+/**
+ * reg_name_hash() - case-insensitive FNV-1a hash of a key name
+ * @name:	key name
+ *
+ * Return:	hash value
+ */
+static unsigned int reg_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261u;
+	unsigned char c;
+
+	/* key names are folded as ASCII, as by strcasecmp() in "C" locale */
+	for (; (c = *name); name++) {
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		hash ^= c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Keys, values and their names are carved out of 64KB arena chunks
+ * rather than malloced one by one. Sizes are rounded up to 16 bytes and
+ * a freed block goes on the free list of its size, to be handed out by
+ * the next allocation of that size. Blocks too large for the free lists
+ * come from malloc. The chunks are only given back when the whole
+ * registry is freed.
+ */
+#define REG_ARENA_CHUNK		(64 * 1024)
+#define REG_ARENA_ALIGN		16
+#define REG_ARENA_CLASSES	32
+
+struct reg_arena_chunk {
+	struct reg_arena_chunk *next;
+	/* keeps the blocks after the header aligned */
+	__u64 pad;
 };
 
-int cifssrv_init_registry(void)
+static struct reg_arena_chunk *reg_arena_chunks;
+static char *reg_arena_pos, *reg_arena_end;
+static void *reg_arena_free[REG_ARENA_CLASSES + 1];
+
+/**
+ * reg_alloc() - allocate a block from the registry arena
+ * @size:	size of the block
+ *
+ * Return:	uninitialized block, or NULL if out of memory
+ */
+static void *reg_alloc(size_t size)
+{
+	size_t class = (size + REG_ARENA_ALIGN - 1) / REG_ARENA_ALIGN;
+	struct reg_arena_chunk *chunk;
+	void *p;
+
+	if (class > REG_ARENA_CLASSES)
+		return malloc(size);
+
+	p = reg_arena_free[class];
+	if (p) {
+		reg_arena_free[class] = *(void **)p;
+		return p;
+	}
+
+	size = class * REG_ARENA_ALIGN;
+	if (reg_arena_end - reg_arena_pos < size) {
+		chunk = malloc(REG_ARENA_CHUNK);
+		if (!chunk)
+			return NULL;
+		chunk->next = reg_arena_chunks;
+		reg_arena_chunks = chunk;
+		reg_arena_pos = (char *)(chunk + 1);
+		reg_arena_end = (char *)chunk + REG_ARENA_CHUNK;
+	}
+
+	p = reg_arena_pos;
+	reg_arena_pos += size;
+	return p;
+}
+
+/**
+ * reg_free() - return a block to the registry arena
+ * @p:		block from reg_alloc()
+ * @size:	size it was allocated with
+ */
+static void reg_free(void *p, size_t size)
+{
+	size_t class = (size + REG_ARENA_ALIGN - 1) / REG_ARENA_ALIGN;
+
+	if (class > REG_ARENA_CLASSES) {
+		free(p);
+		return;
+	}
+
+	*(void **)p = reg_arena_free[class];
+	reg_arena_free[class] = p;
+}
+
+/**
+ * reg_grow_array() - move an array of pointers to a larger arena block
+ * @array:	array from reg_grow_array(), or NULL
+ * @nr:		entries in use
+ * @size:	entries allocated
+ * @new_size:	entries to allocate
+ *
+ * Return:	new array, or NULL if out of memory and @array is kept
+ */
+static void *reg_grow_array(void *array, unsigned int nr, unsigned int size,
+		unsigned int new_size)
+{
+	void *p;
+
+	p = reg_alloc(new_size * sizeof(void *));
+	if (!p)
+		return NULL;
+	if (nr)
+		memcpy(p, array, nr * sizeof(void *));
+	if (array)
+		reg_free(array, size * sizeof(void *));
+	return p;
+}
+
+static void reg_arena_release(void)
+{
+	struct reg_arena_chunk *chunk;
+
+	while ((chunk = reg_arena_chunks)) {
+		reg_arena_chunks = chunk->next;
+		free(chunk);
+	}
+	reg_arena_pos = reg_arena_end = NULL;
+	memset(reg_arena_free, 0, sizeof(reg_arena_free));
+}
+
+/*
+ * Key and value names are interned: the same name under many keys, as
+ * with per-user or per-printer subtrees, is stored once and refcounted.
+ * Interning is exact, so names differing only in case are kept apart
+ * but hash to the same bucket.
+ */
+#define REG_NAME_MIN_HASH_SIZE	256
+
+struct reg_name {
+	struct reg_name *hash_next;
+	unsigned int hash;
+	unsigned int refcount;
+	char name[0];
+};
+
+static struct reg_name **reg_name_table;
+static unsigned int reg_name_size;
+static unsigned int reg_nr_names;
+
+static inline struct reg_name *reg_name_entry(const char *name)
+{
+	return (struct reg_name *)(name - offsetof(struct reg_name, name));
+}
+
+static int reg_grow_names(void)
+{
+	struct reg_name **table, *n;
+	unsigned int i, size;
+
+	size = reg_name_size ? reg_name_size * 2 : REG_NAME_MIN_HASH_SIZE;
+	table = calloc(size, sizeof(struct reg_name *));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < reg_name_size; i++) {
+		while ((n = reg_name_table[i])) {
+			reg_name_table[i] = n->hash_next;
+			n->hash_next = table[n->hash & (size - 1)];
+			table[n->hash & (size - 1)] = n;
+		}
+	}
+
+	free(reg_name_table);
+	reg_name_table = table;
+	reg_name_size = size;
+	return 0;
+}
+
+/**
+ * reg_name_get() - take a reference to the interned copy of a name
+ * @name:	name
+ * @len:	length of the name
+ * @hash:	reg_name_hash() of the name
+ *
+ * Return:	interned name, or NULL if out of memory
+ */
+static const char *reg_name_get(const char *name, size_t len,
+		unsigned int hash)
+{
+	struct reg_name **bucket, *n;
+
+	if (reg_name_size) {
+		n = reg_name_table[hash & (reg_name_size - 1)];
+		for (; n; n = n->hash_next) {
+			if (n->hash == hash && !strcmp(n->name, name)) {
+				n->refcount++;
+				return n->name;
+			}
+		}
+	}
+
+	if (reg_nr_names >= reg_name_size && reg_grow_names())
+		return NULL;
+
+	n = reg_alloc(sizeof(struct reg_name) + len + 1);
+	if (!n)
+		return NULL;
+
+	n->hash = hash;
+	n->refcount = 1;
+	memcpy(n->name, name, len + 1);
+	bucket = &reg_name_table[hash & (reg_name_size - 1)];
+	n->hash_next = *bucket;
+	*bucket = n;
+	reg_nr_names++;
+	return n->name;
+}
+
+/**
+ * reg_name_put() - drop a reference taken by reg_name_get()
+ * @name:	interned name
+ */
+static void reg_name_put(const char *name)
+{
+	struct reg_name *n = reg_name_entry(name);
+	struct reg_name **pos;
+
+	if (--n->refcount)
+		return;
+
+	pos = &reg_name_table[n->hash & (reg_name_size - 1)];
+	while (*pos != n)
+		pos = &(*pos)->hash_next;
+	*pos = n->hash_next;
+	reg_nr_names--;
+	reg_free(n, sizeof(struct reg_name) + strlen(n->name) + 1);
+}
+
+/*
+ * Value data too large to be kept inline is interned the same way, as
+ * refcounted blobs looked up by content: the same binary or string data
+ * set under many keys, like printer defaults, is stored once. Blobs are
+ * never changed, setting a value points it at another one.
+ */
+#define REG_BLOB_MIN_HASH_SIZE	256
+
+struct reg_blob {
+	struct reg_blob *hash_next;
+	unsigned int hash;
+	unsigned int refcount;
+	__u32 size;
+	char data[0];
+};
+
+static struct reg_blob **reg_blob_table;
+static unsigned int reg_blob_size;
+static unsigned int reg_nr_blobs;
+
+static inline struct reg_blob *reg_blob_entry(const char *data)
+{
+	return (struct reg_blob *)(data - offsetof(struct reg_blob, data));
+}
+
+static unsigned int reg_blob_hash(const char *data, __u32 size)
+{
+	unsigned int hash = 2166136261u;
+	__u32 word, i;
+
+	/* FNV-1a a word at a time, the data can be large */
+	for (i = 0; i + 4 <= size; i += 4) {
+		memcpy(&word, data + i, 4);
+		hash ^= word;
+		hash *= 16777619u;
+	}
+	for (; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619u;
+	}
+
+	/*
+	 * The low bits pick the bucket but only see the low bits of the
+	 * data, which for UTF-16 strings that differ in a digit or two is
+	 * not enough. Mix the high bits in, as murmur3 finishes its hash.
+	 */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	return hash ^ (hash >> 16);
+}
+
+static int reg_grow_blobs(void)
+{
+	struct reg_blob **table, *b;
+	unsigned int i, size;
+
+	size = reg_blob_size ? reg_blob_size * 2 : REG_BLOB_MIN_HASH_SIZE;
+	table = calloc(size, sizeof(struct reg_blob *));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < reg_blob_size; i++) {
+		while ((b = reg_blob_table[i])) {
+			reg_blob_table[i] = b->hash_next;
+			b->hash_next = table[b->hash & (size - 1)];
+			table[b->hash & (size - 1)] = b;
+		}
+	}
+
+	free(reg_blob_table);
+	reg_blob_table = table;
+	reg_blob_size = size;
+	return 0;
+}
+
+/**
+ * reg_blob_get() - take a reference to the interned copy of value data
+ * @data:	value data
+ * @size:	size of the data, more than REG_VALUE_INLINE
+ *
+ * Return:	interned data, or NULL if out of memory
+ */
+static const char *reg_blob_get(const char *data, __u32 size)
+{
+	unsigned int hash = reg_blob_hash(data, size);
+	struct reg_blob **bucket, *b;
+
+	if (reg_blob_size) {
+		b = reg_blob_table[hash & (reg_blob_size - 1)];
+		for (; b; b = b->hash_next) {
+			if (b->hash == hash && b->size == size &&
+			    !memcmp(b->data, data, size)) {
+				b->refcount++;
+				return b->data;
+			}
+		}
+	}
+
+	if (reg_nr_blobs >= reg_blob_size && reg_grow_blobs())
+		return NULL;
+
+	b = reg_alloc(offsetof(struct reg_blob, data) + size);
+	if (!b)
+		return NULL;
+
+	b->hash = hash;
+	b->refcount = 1;
+	b->size = size;
+	memcpy(b->data, data, size);
+	bucket = &reg_blob_table[hash & (reg_blob_size - 1)];
+	b->hash_next = *bucket;
+	*bucket = b;
+	reg_nr_blobs++;
+	return b->data;
+}
+
+/**
+ * reg_blob_put() - drop a reference taken by reg_blob_get()
+ * @data:	interned data
+ */
+static void reg_blob_put(const char *data)
+{
+	struct reg_blob *b = reg_blob_entry(data);
+	struct reg_blob **pos;
+
+	if (--b->refcount)
+		return;
+
+	pos = &reg_blob_table[b->hash & (reg_blob_size - 1)];
+	while (*pos != b)
+		pos = &(*pos)->hash_next;
+	*pos = b->hash_next;
+	reg_nr_blobs--;
+	reg_free(b, offsetof(struct reg_blob, data) + b->size);
+}
+
+/**
+ * reg_alloc_key() - allocate a registry key that is not linked anywhere
+ * @name:	key name
+ *
+ * Return:	new key on success, otherwise error pointer
+ */
+static struct registry_node *reg_alloc_key(const char *name)
+{
+	struct registry_node *key;
+	size_t len = strlen(name);
+
+	if (len > REG_MAX_KEY_NAME)
+		return ERR_PTR(-EINVAL);
+
+	key = reg_alloc(sizeof(struct registry_node));
+	if (!key)
+		return ERR_PTR(-ENOMEM);
+
+	memset(key, 0, sizeof(struct registry_node));
+	key->last_write = time(NULL);
+	key->name_hash = reg_name_hash(name);
+	key->key_name = reg_name_get(name, len, key->name_hash);
+	if (!key->key_name) {
+		reg_free(key, sizeof(struct registry_node));
+		return ERR_PTR(-ENOMEM);
+	}
+	return key;
+}
+
+static void reg_free_key(struct registry_node *key)
+{
+	reg_name_put(key->key_name);
+	if (key->values)
+		reg_free(key->values, key->values_size * sizeof(void *));
+	if (key->children)
+		reg_free(key->children, key->hash_size * sizeof(void *));
+	free(key->child_hash);
+	reg_free(key, sizeof(struct registry_node));
+}
+
+/**
+ * reg_alloc_value() - allocate a registry value with no data
+ * @name:	value name
+ *
+ * Return:	new value on success, otherwise error pointer
+ */
+static struct registry_value *reg_alloc_value(const char *name)
+{
+	struct registry_value *value;
+	size_t len = strlen(name);
+
+	if (len > REG_MAX_VALUE_NAME)
+		return ERR_PTR(-EINVAL);
+
+	value = reg_alloc(sizeof(struct registry_value));
+	if (!value)
+		return ERR_PTR(-ENOMEM);
+
+	memset(value, 0, sizeof(struct registry_value));
+	value->value_name = reg_name_get(name, len, reg_name_hash(name));
+	if (!value->value_name) {
+		reg_free(value, sizeof(struct registry_value));
+		return ERR_PTR(-ENOMEM);
+	}
+	return value;
+}
+
+static void reg_free_value(struct registry_value *value)
+{
+	reg_name_put(value->value_name);
+	if (value->value_size > REG_VALUE_INLINE)
+		reg_blob_put(value->value_buffer);
+	reg_free(value, sizeof(struct registry_value));
+}
+
+/**
+ * reg_value_store() - replace the data of a value
+ * @value:	value
+ * @data:	new data
+ * @size:	size of the new data
+ *
+ * Return:	0 on success, otherwise -ENOMEM and the value is unchanged
+ */
+static int reg_value_store(struct registry_value *value, const char *data,
+		__u32 size)
+{
+	const char *blob = NULL;
+
+	if (size > REG_VALUE_INLINE) {
+		blob = reg_blob_get(data, size);
+		if (!blob)
+			return -ENOMEM;
+	}
+
+	if (value->value_size > REG_VALUE_INLINE)
+		reg_blob_put(value->value_buffer);
+	if (blob)
+		value->value_buffer = blob;
+	else if (size)
+		memcpy(value->value_inline, data, size);
+	value->value_size = size;
+	return 0;
+}
+
+/**
+ * reg_find_child() - look up a direct child of a key
+ * @key:	parent key
+ * @name:	child name, compared case insensitively
+ *
+ * Return:	child key, or NULL if there is none
+ */
+static struct registry_node *reg_find_child(struct registry_node *key,
+		const char *name)
+{
+	struct registry_node *child;
+	unsigned int hash;
+
+	if (!key->hash_size)
+		return NULL;
+
+	hash = reg_name_hash(name);
+	child = key->child_hash[hash & (key->hash_size - 1)];
+	for (; child; child = child->hash_next) {
+		if (child->name_hash == hash &&
+				!strcasecmp(child->key_name, name))
+			return child;
+	}
+	return NULL;
+}
+
+/**
+ * reg_grow_children() - double the children array and hash table of a key
+ * @key:	parent key
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+static int reg_grow_children(struct registry_node *key)
+{
+	struct registry_node **table, **children, **bucket;
+	unsigned int size, i;
+
+	size = key->hash_size ? key->hash_size * 2 : REG_MIN_HASH_SIZE;
+	table = calloc(size, sizeof(struct registry_node *));
+	if (!table)
+		return -ENOMEM;
+
+	children = reg_grow_array(key->children, key->nr_children,
+			key->hash_size, size);
+	if (!children) {
+		free(table);
+		return -ENOMEM;
+	}
+	key->children = children;
+
+	for (i = 0; i < key->nr_children; i++) {
+		bucket = &table[children[i]->name_hash & (size - 1)];
+		children[i]->hash_next = *bucket;
+		*bucket = children[i];
+	}
+
+	free(key->child_hash);
+	key->child_hash = table;
+	key->hash_size = size;
+	return 0;
+}
+
+/**
+ * reg_add_child() - link a new key under a parent key
+ * @key:	parent key
+ * @child:	key from reg_alloc_key()
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+static int reg_add_child(struct registry_node *key,
+		struct registry_node *child)
+{
+	struct registry_node **bucket;
+	size_t len;
+	int ret;
+
+	if (key->nr_children >= key->hash_size) {
+		ret = reg_grow_children(key);
+		if (ret)
+			return ret;
+	}
+
+	bucket = &key->child_hash[child->name_hash & (key->hash_size - 1)];
+	child->hash_next = *bucket;
+	*bucket = child;
+	key->children[key->nr_children++] = child;
+	child->parent = key;
+
+	len = strlen(child->key_name);
+	if (len > key->max_child_name)
+		key->max_child_name = len;
+	return 0;
+}
+
+/**
+ * reg_unlink_child() - unlink a key from its parent key
+ * @key:	parent key
+ * @child:	child key to unlink
+ *
+ * Later children move down one index, as they do on Windows.
+ */
+static void reg_unlink_child(struct registry_node *key,
+		struct registry_node *child)
+{
+	struct registry_node **pos;
+	unsigned int i;
+
+	pos = &key->child_hash[child->name_hash & (key->hash_size - 1)];
+	while (*pos != child)
+		pos = &(*pos)->hash_next;
+	*pos = child->hash_next;
+
+	for (i = 0; key->children[i] != child; i++)
+		;
+	key->nr_children--;
+	memmove(&key->children[i], &key->children[i + 1],
+			(key->nr_children - i) * sizeof(struct registry_node *));
+	if (strlen(child->key_name) == key->max_child_name)
+		key->info_stale = 1;
+
+	child->parent = NULL;
+	child->hash_next = NULL;
+}
+
+/**
+ * reg_value_info() - account for a value in the QueryInfoKey maxima
+ * @key:	key
+ * @value:	value added or grown
+ */
+static void reg_value_info(struct registry_node *key,
+		struct registry_value *value)
+{
+	size_t len = strlen(value->value_name);
+
+	if (len > key->max_value_name)
+		key->max_value_name = len;
+	if (value->value_size > key->max_value_size)
+		key->max_value_size = value->value_size;
+}
+
+/**
+ * reg_update_info() - recompute the QueryInfoKey maxima of a key
+ * @key:	key
+ *
+ * The maxima only grow as children and values are added. Removing the
+ * child or value that set one marks them stale instead, and they are
+ * recomputed here by the next QueryInfoKey.
+ */
+static void reg_update_info(struct registry_node *key)
+{
+	unsigned int i;
+	size_t len;
+
+	if (!key->info_stale)
+		return;
+
+	key->max_child_name = 0;
+	for (i = 0; i < key->nr_children; i++) {
+		len = strlen(key->children[i]->key_name);
+		if (len > key->max_child_name)
+			key->max_child_name = len;
+	}
+
+	key->max_value_name = 0;
+	key->max_value_size = 0;
+	for (i = 0; i < key->nr_values; i++)
+		reg_value_info(key, key->values[i]);
+	key->info_stale = 0;
+}
+
+/**
+ * reg_base_child() - make a registry node of a predefined key
+ * @key:	parent key
+ * @base:	table entry of the child
+ *
+ * Return:	child key on success, otherwise error pointer
+ */
+static struct registry_node *reg_base_child(struct registry_node *key,
+		const struct reg_base_key *base)
+{
+	struct registry_node *child;
+	int ret;
+
+	child = reg_alloc_key(base->name);
+	if (IS_ERR(child))
+		return child;
+
+	if (base->nr_children)
+		child->base = base;
+	ret = reg_add_child(key, child);
+	if (ret) {
+		reg_free_key(child);
+		return ERR_PTR(ret);
+	}
+	return child;
+}
+
+/**
+ * reg_lookup_child() - look up a direct child of a key, including a
+ *			predefined key that is not a node yet
+ * @key:	parent key
+ * @name:	child name, compared case insensitively
+ *
+ * Return:	child key, NULL if there is none, otherwise error pointer
+ */
+static struct registry_node *reg_lookup_child(struct registry_node *key,
+		const char *name)
+{
+	const struct reg_base_key *base;
+	struct registry_node *child;
+	int i;
+
+	child = reg_find_child(key, name);
+	if (child || !key->base)
+		return child;
+
+	base = &reg_base_hive[key->base->first_child];
+	for (i = 0; i < key->base->nr_children; i++, base++) {
+		if (!strcasecmp(base->name, name))
+			return reg_base_child(key, base);
+	}
+	return NULL;
+}
+
+/**
+ * reg_materialize() - make nodes of all predefined children of a key
+ * @key:	key
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+int reg_materialize(struct registry_node *key)
+{
+	const struct reg_base_key *base;
+	struct registry_node *child;
+	int i;
+
+	if (!key->base)
+		return 0;
+
+	base = &reg_base_hive[key->base->first_child];
+	for (i = 0; i < key->base->nr_children; i++, base++) {
+		if (reg_find_child(key, base->name))
+			continue;
+		child = reg_base_child(key, base);
+		if (IS_ERR(child))
+			return PTR_ERR(child);
+	}
+	key->base = NULL;
+	return 0;
+}
+
+/*
+ * Open keys are handed to clients as policy handles with a random uuid.
+ * The handle table maps the uuid back to the key and the pipe that opened
+ * it, so a handle from another pipe, a closed handle or a made up one is
+ * refused rather than dereferenced. The uuid is random already, so its
+ * first word picks the bucket. Each pipe also lists its own handles, so
+ * they are all released when the pipe goes away, see
+ * winreg_release_pipe().
+ */
+#define REG_HANDLE_MIN_SIZE	64
+
+struct reg_handle {
+	KEY_HANDLE handle;
+	/* NULL once the key is deleted under the handle */
+	struct registry_node *key;
+	struct cifssrv_pipe *pipe;
+	struct reg_handle *hash_next;
+	struct list_head pipe_list;
+};
+
+static struct reg_handle **reg_handle_table;
+static unsigned int reg_handle_size;
+static unsigned int reg_nr_handles;
+
+static inline unsigned int reg_handle_hash(const KEY_HANDLE *handle)
+{
+	__u32 hash;
+
+	memcpy(&hash, handle->uuid, sizeof(hash));
+	return hash & (reg_handle_size - 1);
+}
+
+/**
+ * reg_grow_handles() - double the handle hash table
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+static int reg_grow_handles(void)
+{
+	struct reg_handle **table, **old = reg_handle_table;
+	struct reg_handle *h;
+	unsigned int i, old_size = reg_handle_size;
+
+	reg_handle_size = old_size ? old_size * 2 : REG_HANDLE_MIN_SIZE;
+	table = calloc(reg_handle_size, sizeof(struct reg_handle *));
+	if (!table) {
+		reg_handle_size = old_size;
+		return -ENOMEM;
+	}
+
+	reg_handle_table = table;
+	for (i = 0; i < old_size; i++) {
+		while ((h = old[i])) {
+			old[i] = h->hash_next;
+			h->hash_next = table[reg_handle_hash(&h->handle)];
+			table[reg_handle_hash(&h->handle)] = h;
+		}
+	}
+	free(old);
+	return 0;
+}
+
+/**
+ * reg_handle_open() - hand out a new handle to a key
+ * @pipe:	pipe the handle belongs to
+ * @key:	opened key
+ * @handle:	filled with the handle to return to the client
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int reg_handle_open(struct cifssrv_pipe *pipe,
+		struct registry_node *key, KEY_HANDLE *handle)
+{
+	struct reg_handle *h;
+	unsigned int idx;
+	int ret;
+
+	if (reg_nr_handles >= reg_handle_size) {
+		ret = reg_grow_handles();
+		if (ret)
+			return ret;
+	}
+
+	h = malloc(sizeof(struct reg_handle));
+	if (!h)
+		return -ENOMEM;
+
+	h->handle.handle_type = 0;
+	ret = get_random_bytes(h->handle.uuid, sizeof(h->handle.uuid));
+	if (ret) {
+		free(h);
+		return ret;
+	}
+
+	h->key = key;
+	h->pipe = pipe;
+	idx = reg_handle_hash(&h->handle);
+	h->hash_next = reg_handle_table[idx];
+	reg_handle_table[idx] = h;
+	reg_nr_handles++;
+	key->nr_handles++;
+
+	list_add(&h->pipe_list, &pipe->reg_handles);
+	pipe->nr_reg_handles++;
+	if (pipe->client)
+		pipe->client->nr_reg_handles++;
+
+	memcpy(handle, &h->handle, sizeof(KEY_HANDLE));
+	return 0;
+}
+
+/**
+ * reg_handle_free() - free a handle that is already off the hash table
+ * @h:		handle
+ */
+static void reg_handle_free(struct reg_handle *h)
+{
+	struct cifssrv_pipe *pipe = h->pipe;
+
+	if (h->key)
+		h->key->nr_handles--;
+	list_del(&h->pipe_list);
+	pipe->nr_reg_handles--;
+	if (pipe->client)
+		pipe->client->nr_reg_handles--;
+	reg_nr_handles--;
+	free(h);
+}
+
+/**
+ * reg_handle_find() - find the table slot of a client handle
+ * @pipe:	pipe the request came in on
+ * @handle:	handle sent by the client
+ *
+ * Return:	pointer to the link to the handle, or NULL if it is unknown
+ */
+static struct reg_handle **reg_handle_find(struct cifssrv_pipe *pipe,
+		const KEY_HANDLE *handle)
+{
+	struct reg_handle **pos;
+
+	if (!reg_nr_handles)
+		return NULL;
+
+	pos = &reg_handle_table[reg_handle_hash(handle)];
+	for (; *pos; pos = &(*pos)->hash_next) {
+		if ((*pos)->pipe == pipe &&
+				!memcmp(&(*pos)->handle, handle,
+					sizeof(KEY_HANDLE)))
+			return pos;
+	}
+	return NULL;
+}
+
+/**
+ * reg_handle_key() - resolve a client handle to its key
+ * @pipe:	pipe the request came in on
+ * @handle:	handle sent by the client
+ *
+ * Return:	open key, or NULL if the handle is not valid on this pipe
+ */
+static struct registry_node *reg_handle_key(struct cifssrv_pipe *pipe,
+		const KEY_HANDLE *handle)
+{
+	struct reg_handle **pos = reg_handle_find(pipe, handle);
+
+	return pos ? (*pos)->key : NULL;
+}
+
+/**
+ * reg_handle_close() - release a client handle
+ * @pipe:	pipe the request came in on
+ * @handle:	handle sent by the client
+ *
+ * Return:	0 on success, -ENOENT if the handle is not valid on this pipe
+ */
+static int reg_handle_close(struct cifssrv_pipe *pipe,
+		const KEY_HANDLE *handle)
+{
+	struct reg_handle **pos = reg_handle_find(pipe, handle);
+	struct reg_handle *h;
+
+	if (!pos)
+		return -ENOENT;
+
+	h = *pos;
+	*pos = h->hash_next;
+	reg_handle_free(h);
+	return 0;
+}
+
+/**
+ * winreg_release_pipe() - close all winreg handles opened on a pipe
+ * @pipe:	pipe being destroyed
+ */
+void winreg_release_pipe(struct cifssrv_pipe *pipe)
+{
+	struct reg_handle **pos, *h;
+
+	winreg_cancel_watch(pipe);
+	if (pipe->nr_reg_handles)
+		cifssrv_debug("closing %u registry handles of pipe %p\n",
+				pipe->nr_reg_handles, pipe);
+
+	while (!list_empty(&pipe->reg_handles)) {
+		h = list_entry(pipe->reg_handles.next, struct reg_handle,
+				pipe_list);
+		pos = &reg_handle_table[reg_handle_hash(&h->handle)];
+		while (*pos != h)
+			pos = &(*pos)->hash_next;
+		*pos = h->hash_next;
+		reg_handle_free(h);
+	}
+}
+
+/**
+ * reg_handle_forget() - detach the handles of a key that goes away
+ * @key:	key being freed
+ *
+ * The handles stay in the table until the client closes them, but no
+ * longer resolve to a key.
+ */
+static void reg_handle_forget(struct registry_node *key)
+{
+	struct reg_handle *h;
+	unsigned int i;
+
+	for (i = 0; i < reg_handle_size && key->nr_handles; i++) {
+		for (h = reg_handle_table[i]; h; h = h->hash_next) {
+			if (h->key == key) {
+				h->key = NULL;
+				key->nr_handles--;
+			}
+		}
+	}
+}
+
+/*
+ * NotifyChangeKeyValue is not answered right away: the request arms a
+ * watch and the pipe holds its response back, see cifssrv_pipe_complete().
+ * A change to a key fires the watches on the key and the subtree watches
+ * on its ancestors. Fired watches are answered by winreg_run_watches()
+ * from the main loop, after the request that made the change. A watch
+ * that sees no change in REG_WATCH_TIMEOUT seconds is answered all the
+ * same, so the client looks at the key and watches it again, and a pipe
+ * is never held by a client that went quiet. The armed list is in expiry
+ * order since the timeout is fixed.
+ */
+#define REG_WATCH_TIMEOUT	60
+
+struct reg_watch {
+	/* on reg_watches until fired, then on reg_fired */
+	struct list_head list;
+	struct cifssrv_pipe *pipe;
+	/* NULL once fired */
+	struct registry_node *key;
+	__u32 filter;
+	int subtree;
+	time_t expires;
+	WINREG_COMMON_RSP *rsp;
+};
+
+static LIST_HEAD(reg_watches);
+static LIST_HEAD(reg_fired);
+static unsigned int reg_nr_watches;
+
+static inline time_t reg_watch_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * reg_watch_fire() - queue the response of a watch
+ * @w:		armed watch
+ */
+static void reg_watch_fire(struct reg_watch *w)
+{
+	w->key->nr_watches--;
+	w->key = NULL;
+	reg_nr_watches--;
+	list_move_tail(&w->list, &reg_fired);
+}
+
+/**
+ * reg_notify() - fire the watches a change to a key satisfies
+ * @key:	changed key
+ * @filter:	REG_NOTIFY_CHANGE_* kind of the change
+ *
+ * Only keys with watches on them look at the armed list, so a change
+ * costs a walk up the tree while any watch is armed, and nothing
+ * otherwise.
+ */
+static void reg_notify(struct registry_node *key, __u32 filter)
+{
+	struct reg_watch *w, *tmp;
+	struct registry_node *k;
+
+	for (k = key; k && reg_nr_watches; k = k->parent) {
+		if (!k->nr_watches)
+			continue;
+
+		list_for_each_entry_safe(w, tmp, &reg_watches, list) {
+			if (w->key == k && (w->filter & filter) &&
+			    (k == key || w->subtree))
+				reg_watch_fire(w);
+		}
+	}
+}
+
+/**
+ * reg_watch_forget() - fire the watches on a key that goes away
+ * @key:	key being freed
+ */
+static void reg_watch_forget(struct registry_node *key)
+{
+	struct reg_watch *w, *tmp;
+
+	list_for_each_entry_safe(w, tmp, &reg_watches, list) {
+		if (w->key == key)
+			reg_watch_fire(w);
+	}
+}
+
+/**
+ * winreg_cancel_watch() - drop the armed NotifyChangeKeyValue of a pipe
+ * @pipe:	pipe that got another request or is going away
+ */
+void winreg_cancel_watch(struct cifssrv_pipe *pipe)
+{
+	struct reg_watch *w = pipe->reg_watch;
+
+	if (!w)
+		return;
+
+	if (w->key) {
+		w->key->nr_watches--;
+		reg_nr_watches--;
+	}
+	list_del(&w->list);
+	free(w->rsp);
+	free(w);
+	pipe->reg_watch = NULL;
+	pipe->rsp_deferred = 0;
+}
+
+/**
+ * winreg_run_watches() - answer fired and expired NotifyChangeKeyValue
+ *
+ * Return:	seconds until the next watch expires, or -1 if none is armed
+ */
+int winreg_run_watches(void)
+{
+	struct cifssrv_pipe *pipe;
+	struct reg_watch *w;
+	time_t now;
+
+	if (list_empty(&reg_watches) && list_empty(&reg_fired))
+		return -1;
+
+	now = reg_watch_clock();
+	while (!list_empty(&reg_watches)) {
+		w = list_entry(reg_watches.next, struct reg_watch, list);
+		if (w->expires > now)
+			break;
+		cifssrv_debug("watch on %s timed out\n", w->key->key_name);
+		reg_watch_fire(w);
+	}
+
+	while (!list_empty(&reg_fired)) {
+		w = list_entry(reg_fired.next, struct reg_watch, list);
+		list_del(&w->list);
+		pipe = w->pipe;
+		pipe->reg_watch = NULL;
+		pipe->data = (char *)w->rsp;
+		free(w);
+		cifssrv_pipe_complete(pipe);
+	}
+
+	if (list_empty(&reg_watches))
+		return -1;
+	w = list_entry(reg_watches.next, struct reg_watch, list);
+	return w->expires - now;
+}
+
+/**
+ * cifssrv_init_registry() - set up the registry tree
+ * @path:	snapshot file of the persistent registry, or NULL to keep the
+ *		registry in memory only
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifssrv_init_registry(const char *path)
 {
 	int ret = 0;
 
@@ -67,93 +1249,126 @@ int cifssrv_init_registry(void)
 	if (IS_ERR(reg_openhku))
 		return -ENOMEM;
 
-	ret = init_predefined_registry();
-	if (ret == -ENOMEM)
-		return -ENOMEM;
+	if (path) {
+		ret = reg_db_open(path);
+		if (ret && ret != -ENOENT)
+			return ret;
+	}
+
+	/* a snapshot has the predefined keys unless they were deleted */
+	if (!path || ret == -ENOENT) {
+		ret = init_predefined_registry();
+		if (ret == -ENOMEM)
+			return -ENOMEM;
+	}
+
+	if (path)
+		return reg_db_start_log();
 	return 0;
 }
 
 struct registry_node *init_root_key(char *name)
 {
-	struct registry_node *root_key = malloc(sizeof(struct registry_node));
-	if (!root_key)
-		return ERR_PTR(-ENOMEM);
-	strcpy(root_key->key_name, name);
-	root_key->value_list = NULL;
-	root_key->child = NULL;
-	root_key->neighbour = NULL;
+	struct registry_node *root_key = reg_alloc_key(name);
+
+	if (IS_ERR(root_key))
+		return root_key;
 	root_key->access_status = 1;
-	root_key->open_status = 0;
 	return root_key;
 }
 
 void cifssrv_free_registry(void)
 {
+	struct reg_handle *h;
+	unsigned int i;
+
+	reg_db_close();
+
+	for (i = 0; i < reg_handle_size; i++) {
+		while ((h = reg_handle_table[i])) {
+			reg_handle_table[i] = h->hash_next;
+			reg_handle_free(h);
+		}
+	}
+	free(reg_handle_table);
+	reg_handle_table = NULL;
+	reg_handle_size = 0;
+
 	free_registry(reg_openhkcr);
 	free_registry(reg_openhkcu);
 	free_registry(reg_openhklm);
 	free_registry(reg_openhku);
+
+	free(reg_name_table);
+	reg_name_table = NULL;
+	reg_name_size = 0;
+	free(reg_blob_table);
+	reg_blob_table = NULL;
+	reg_blob_size = 0;
+	reg_arena_release();
 }
 
 int init_predefined_registry(void)
 {
-	struct registry_node *ret;
+	struct registry_node *roots[] = {
+		reg_openhkcr, reg_openhkcu, reg_openhklm, reg_openhku,
+	};
 	int i;
 
-	char *(*ptr)[npre_def_keys] = &pre_def_key;
-
-	for (i = 0; i < npre_def_keys; i++) {
-		ret = create_key((*ptr)[i], reg_openhklm);
-		if (IS_ERR(ret))
-			return -ENOMEM;
+	for (i = 0; i < sizeof(roots) / sizeof(roots[0]); i++) {
+		if (reg_base_hive[i].nr_children)
+			roots[i]->base = &reg_base_hive[i];
 	}
-
 	return 0;
 }
 
-int winreg_open_root_key(struct cifssrv_pipe *pipe, int opnum,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+int winreg_open_root_key(struct cifssrv_pipe *pipe,
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
-	OPENHKEY_RSP *winreg_rsp = malloc(sizeof(OPENHKEY_RSP));
-
-	if (!winreg_rsp)
-		return -ENOMEM;
+	OPENHKEY_RSP *winreg_rsp;
+	struct registry_node *root_key;
+	int ret;
 
-	pipe->data = (char *)winreg_rsp;
-	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
-	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
-				RPC_FLAG_FIRST | RPC_FLAG_LAST,
-				rpc_request_req->hdr.call_id);
-	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	switch (opnum) {
+	switch (pipe->opnum) {
 	case WINREG_OPENHKCR:
-		winreg_rsp->key_handle.addr = (__u32)reg_openhkcr;
-		reg_openhkcr->open_status = 1;
+		root_key = reg_openhkcr;
 		break;
 	case WINREG_OPENHKCU:
-		winreg_rsp->key_handle.addr = (__u32)reg_openhkcu;
-		reg_openhkcu->open_status = 1;
+		root_key = reg_openhkcu;
 		break;
 	case WINREG_OPENHKLM:
-		winreg_rsp->key_handle.addr = (__u32)reg_openhklm;
-		reg_openhklm->open_status = 1;
+		root_key = reg_openhklm;
 		break;
 	case WINREG_OPENHKU:
-		winreg_rsp->key_handle.addr = (__u32)reg_openhku;
-		reg_openhku->open_status = 1;
+		root_key = reg_openhku;
 		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	winreg_rsp = malloc(sizeof(OPENHKEY_RSP));
+	if (!winreg_rsp)
+		return -ENOMEM;
+
+	ret = reg_handle_open(pipe, root_key, &winreg_rsp->key_handle);
+	if (ret) {
+		free(winreg_rsp);
+		return ret;
 	}
-	reg_openhkcr->open_status = 1;
-	winreg_rsp->key_handle.addr = (__u32)reg_openhkcr;
+
+	pipe->data = (char *)winreg_rsp;
+	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
+	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
+				RPC_FLAG_FIRST | RPC_FLAG_LAST,
+				rpc_request_req->hdr.call_id);
+	rpc_request_rsp->context_id = rpc_request_req->context_id;
 	winreg_rsp->werror = cpu_to_le32(WERR_OK);
-	cifssrv_debug("open_key ptr to handle = %x\n",
-					winreg_rsp->key_handle.addr);
+	cifssrv_debug("open root key %s\n", root_key->key_name);
 	return 0;
 }
-
 int winreg_get_version(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	GET_VERSION_RSP *winreg_rsp =
@@ -176,32 +1391,24 @@ int winreg_get_version(struct cifssrv_pipe *pipe,
 }
 
 int winreg_delete_key(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	WINREG_COMMON_RSP *winreg_rsp;
 	struct registry_node *ret;
-	int key_addr;
 	char *relative_name;
 	struct registry_node *base_key;
-	struct registry_node *key;
-	struct registry_node *prev_key;
-	char *token;
-	char *name;
-	KEY_HANDLE *key_handle = (KEY_HANDLE *)in_data;
-	NAME_INFO *name_info = (NAME_INFO *)(((char *)in_data) +
-							sizeof(KEY_HANDLE));
-
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
-	relative_name = smb_strndup_from_utf16(name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	KEY_HANDLE *key_handle;
+	struct ndr_unistr key_name;
+
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_lsa_string(ndr, &key_name))
+		return -EINVAL;
+
+	base_key = reg_handle_key(pipe, key_handle);
+	relative_name = ndr_unistr_dup(&key_name, pipe->codepage);
 	if (IS_ERR(relative_name))
 		return PTR_ERR(relative_name);
-	name = malloc(sizeof(strlen(relative_name)));
-	strcpy(name, relative_name);
-	ret = search_registry(relative_name, (struct registry_node *)key_addr);
-	cifssrv_debug("ret %x\n", (__u32)ret);
 
 	winreg_rsp = malloc(sizeof(WINREG_COMMON_RSP) );
 	if (!winreg_rsp) {
@@ -210,34 +1417,22 @@ int winreg_delete_key(struct cifssrv_pipe *pipe,
 	}
 
 	pipe->data = (char *)winreg_rsp;
-	if (base_key == NULL || base_key->open_status == 0 ||
-				relative_name == NULL) {
-		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_PARAMETER);
-	} else if (IS_ERR(ret)) {
-		winreg_rsp->werror = cpu_to_le32(WERR_BAD_FILE);
+	if (base_key == NULL) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
 	} else {
-		key = base_key;
-		token = strsep(&name, "\\");
-		while (token) {
-			if (key->child == ret) {
-				key->child = key->child->neighbour;
-			} else {
-				prev_key = NULL;
-				key = key->child;
-				while ((key != NULL) &&
-					(strcmp(key->key_name, token) != 0)) {
-					prev_key = key;
-					key = key->neighbour;
-				}
-				if (key == ret) {
-					prev_key->neighbour = key->neighbour;
-					break;
-				}
-			}
-			token = strsep(&name, "\\");
+		ret = search_registry(relative_name, base_key);
+		if (IS_ERR(ret) || ret == base_key) {
+			winreg_rsp->werror = cpu_to_le32(WERR_BAD_FILE);
+		} else if (reg_materialize(ret->parent)) {
+			pipe->data = NULL;
+			free(winreg_rsp);
+			free(relative_name);
+			return -ENOMEM;
+		} else {
+			reg_db_delete_key(ret);
+			delete_key(ret);
+			winreg_rsp->werror = cpu_to_le32(WERR_OK);
 		}
-		free_registry(ret);
-		winreg_rsp->werror = cpu_to_le32(WERR_OK);
 	}
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
@@ -249,9 +1444,8 @@ int winreg_delete_key(struct cifssrv_pipe *pipe,
 	cifssrv_debug("delete_key\n");
 	return 0;
 }
-
 int winreg_flush_key(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	WINREG_COMMON_RSP *winreg_rsp =
@@ -272,26 +1466,26 @@ int winreg_flush_key(struct cifssrv_pipe *pipe,
 }
 
 int winreg_create_key(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	CREATE_KEY_RSP *winreg_rsp;
 	struct registry_node *ret;
-	int key_addr;
 	char *relative_name;
 	struct registry_node *base_key;
+	KEY_HANDLE *key_handle;
+	struct ndr_unistr key_name;
+	int created;
+	int err;
 
-	KEY_HANDLE *key_handle = (KEY_HANDLE *)in_data;
-	NAME_INFO *name_info = (NAME_INFO *)(((char *)in_data) +
-						sizeof(KEY_HANDLE));
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_lsa_string(ndr, &key_name))
+		return -EINVAL;
 
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
-	relative_name = smb_strndup_from_utf16(name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	base_key = reg_handle_key(pipe, key_handle);
+	relative_name = ndr_unistr_dup(&key_name, pipe->codepage);
 	if (IS_ERR(relative_name))
 		return PTR_ERR(relative_name);
-	ret = create_key(relative_name, (struct registry_node *)key_addr);
 
 	winreg_rsp = malloc(sizeof(CREATE_KEY_RSP));
 	if (!winreg_rsp) {
@@ -301,42 +1495,69 @@ int winreg_create_key(struct cifssrv_pipe *pipe,
 
 	pipe->data = (char *)winreg_rsp;
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
-	winreg_rsp->key_handle.addr = (__u32)ret;
+	memset(&winreg_rsp->key_handle, 0, sizeof(KEY_HANDLE));
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
 	winreg_rsp->ref_id = cpu_to_le32(0x00020008);
-	winreg_rsp->action_taken = cpu_to_le32(REG_CREATED_NEW_KEY);
-	winreg_rsp->werror = cpu_to_le32(WERR_OK);
+	winreg_rsp->action_taken = cpu_to_le32(REG_ACTION_NONE);
+
+	if (base_key == NULL) {
+		free(relative_name);
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
+		return 0;
+	}
+
+	ret = create_key(relative_name, base_key, &created);
 	free(relative_name);
-	cifssrv_debug("create_key ptr to handle = %x\n",
-					winreg_rsp->key_handle.addr);
+	if (IS_ERR(ret)) {
+		err = PTR_ERR(ret);
+		goto out_err;
+	}
+
+	if (created)
+		reg_db_create_key(ret);
+	err = reg_handle_open(pipe, ret, &winreg_rsp->key_handle);
+	if (err)
+		goto out_err;
+
+	winreg_rsp->action_taken = cpu_to_le32(created ?
+			REG_CREATED_NEW_KEY : REG_OPENED_EXISTING_KEY);
+	winreg_rsp->werror = cpu_to_le32(WERR_OK);
+	cifssrv_debug("create_key %s\n", ret->key_name);
 	return 0;
-}
 
+out_err:
+	if (err == -EINVAL) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_PARAMETER);
+		return 0;
+	}
+	pipe->data = NULL;
+	free(winreg_rsp);
+	return err;
+}
 
 int winreg_open_key(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	OPENHKEY_RSP *winreg_rsp;
 	struct registry_node *ret;
-	int key_addr;
 	char *relative_name;
 	struct registry_node *base_key;
+	KEY_HANDLE *key_handle;
+	struct ndr_unistr key_name;
+	int err;
 
-	KEY_HANDLE *key_handle = (KEY_HANDLE *)in_data;
-	NAME_INFO *name_info = (NAME_INFO *)(((char *)in_data) +
-						sizeof(KEY_HANDLE));
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_lsa_string(ndr, &key_name))
+		return -EINVAL;
 
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
-	relative_name = smb_strndup_from_utf16(name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	base_key = reg_handle_key(pipe, key_handle);
+	relative_name = ndr_unistr_dup(&key_name, pipe->codepage);
 	if (IS_ERR(relative_name))
 		return PTR_ERR(relative_name);
-	ret = search_registry(relative_name, (struct registry_node *)key_addr);
 
 	winreg_rsp = malloc(sizeof(OPENHKEY_RSP));
 	if (!winreg_rsp) {
@@ -344,43 +1565,45 @@ int winreg_open_key(struct cifssrv_pipe *pipe,
 		return -ENOMEM;
 	}
 
-	pipe->data = (char *)winreg_rsp;
-
-	if (base_key == NULL || base_key->open_status == 0
-				|| relative_name == NULL) {
-		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_PARAMETER);
-		winreg_rsp->key_handle.addr = 0;
-	} else if (IS_ERR(ret)) {
-		winreg_rsp->werror = cpu_to_le32(WERR_BAD_FILE);
-		winreg_rsp->key_handle.addr = 0;
+	memset(&winreg_rsp->key_handle, 0, sizeof(KEY_HANDLE));
+	if (base_key == NULL) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
 	} else {
-		ret->open_status = 1;
-		winreg_rsp->key_handle.addr = (__u32)ret;
-		winreg_rsp->werror = cpu_to_le32(WERR_OK);
+		ret = search_registry(relative_name, base_key);
+		if (IS_ERR(ret)) {
+			winreg_rsp->werror = cpu_to_le32(WERR_BAD_FILE);
+		} else {
+			err = reg_handle_open(pipe, ret,
+					&winreg_rsp->key_handle);
+			if (err) {
+				free(winreg_rsp);
+				free(relative_name);
+				return err;
+			}
+			winreg_rsp->werror = cpu_to_le32(WERR_OK);
+		}
 	}
+
+	pipe->data = (char *)winreg_rsp;
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
 	free(relative_name);
-	cifssrv_debug("open_key ptr to handle = %x\n",
-					winreg_rsp->key_handle.addr);
+	cifssrv_debug("open_key\n");
 
 	return 0;
 }
-
 int winreg_close_key(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	OPENHKEY_RSP *winreg_rsp;
-	int key_addr;
-	struct registry_node *base_key;
-	KEY_HANDLE *key_handle = (KEY_HANDLE *)in_data;
+	KEY_HANDLE *key_handle;
 
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)))
+		return -EINVAL;
 
 	winreg_rsp = malloc(sizeof(OPENHKEY_RSP));
 	if (!winreg_rsp)
@@ -388,119 +1611,268 @@ int winreg_close_key(struct cifssrv_pipe *pipe,
 
 	pipe->data = (char *)winreg_rsp;
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
-	if (base_key == NULL || base_key->open_status == 0) {
-		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_PARAMETER);
-		winreg_rsp->key_handle.addr = key_handle->addr;
+	if (reg_handle_close(pipe, key_handle)) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
+		memcpy(&winreg_rsp->key_handle, key_handle,
+				sizeof(KEY_HANDLE));
 	} else {
-		base_key->open_status = 0;
-		winreg_rsp->key_handle.addr = 0;
+		memset(&winreg_rsp->key_handle, 0, sizeof(KEY_HANDLE));
 		winreg_rsp->werror = cpu_to_le32(WERR_OK);
 	}
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	cifssrv_debug("close_key ptr to handle = %x\n",
-					winreg_rsp->key_handle.addr);
+	cifssrv_debug("close_key\n");
 	return 0;
 }
 
+/**
+ * reg_utf16_name() - encode a key or value name for the client
+ * @pipe:	winreg pipe
+ * @name:	name
+ * @len:	set to the length in bytes, including the NUL
+ *
+ * Return:	allocated UTF-16LE name on success, otherwise error pointer
+ */
+static __le16 *reg_utf16_name(struct cifssrv_pipe *pipe, const char *name,
+		__u16 *len)
+{
+	__le16 *str;
+	int units;
+
+	str = smb_utf16_encode((char *)name, pipe->codepage, &units);
+	if (!IS_ERR(str))
+		*len = units * 2;
+	return str;
+}
+
 int winreg_enum_key(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
-	ENUM_KEY_RSP *winreg_rsp = malloc(sizeof(ENUM_KEY_RSP));
-
+	ENUM_KEY_RSP *winreg_rsp;
+	struct registry_node *key;
+	KEY_HANDLE *key_handle;
+	struct ndr_unistr name, class_name;
+	__u32 index, class_ptr, time_ptr, time;
+	__u16 len, size, class_size = 0;
+	__le16 *str;
+
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_u32(ndr, &index) ||
+	    ndr_pull_u16(ndr, &len) ||
+	    ndr_pull_u16(ndr, &size) ||
+	    ndr_pull_unique_unistr(ndr, &name) ||
+	    ndr_pull_u32(ndr, &class_ptr) ||
+	    (class_ptr && (ndr_pull_u16(ndr, &len) ||
+			   ndr_pull_u16(ndr, &class_size) ||
+			   ndr_pull_unique_unistr(ndr, &class_name))) ||
+	    ndr_pull_u32(ndr, &time_ptr) ||
+	    (time_ptr && (ndr_pull_u32(ndr, &time) ||
+			  ndr_pull_u32(ndr, &time))))
+		return -EINVAL;
+
+	winreg_rsp = calloc(1, sizeof(ENUM_KEY_RSP));
 	if (!winreg_rsp)
 		return -ENOMEM;
+	winreg_rsp->name_size = size;
+	winreg_rsp->class_ptr = class_ptr;
+	winreg_rsp->class_size = class_size;
+	winreg_rsp->time_ptr = time_ptr;
+
+	key = reg_handle_key(pipe, key_handle);
+	if (!key) {
+		winreg_rsp->werror = WERR_INVALID_HANDLE;
+		goto out;
+	}
+
+	/* predefined children are enumerated too, make them nodes for good */
+	if (reg_materialize(key)) {
+		free(winreg_rsp);
+		return -ENOMEM;
+	}
+
+	if (index >= key->nr_children) {
+		winreg_rsp->werror = WERR_NO_MORE_DATA;
+		goto out;
+	}
 
+	str = reg_utf16_name(pipe, key->children[index]->key_name, &len);
+	if (IS_ERR(str)) {
+		free(winreg_rsp);
+		return PTR_ERR(str);
+	}
+	if (len > size) {
+		free(str);
+		winreg_rsp->werror = WERR_MORE_DATA;
+		goto out;
+	}
+
+	winreg_rsp->name = str;
+	winreg_rsp->name_len = len;
+	winreg_rsp->werror = WERR_OK;
+	cifssrv_debug("enum_key %s[%u] %s\n", key->key_name, index,
+			key->children[index]->key_name);
+out:
 	pipe->data = (char *)winreg_rsp;
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
-	winreg_rsp->key_name.size = 1024;
-	winreg_rsp->key_class_ref_id = 0X0002000c;
-	winreg_rsp->key_class.key_packet_size = 1024;
-	winreg_rsp->key_class.ref_id = 0x00020010;
-	winreg_rsp->last_changed_time_ref_id = 0x00020014;
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	winreg_rsp->werror = cpu_to_le32(WERR_NO_MORE_DATA);
-	cifssrv_debug("enum_key\n");
 	return 0;
 }
 
 int winreg_query_info_key(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
-	QUERY_INFO_KEY_RSP *winreg_rsp =
-				malloc(sizeof(QUERY_INFO_KEY_RSP));
+	QUERY_INFO_KEY_RSP *winreg_rsp;
+	struct registry_node *key;
+	KEY_HANDLE *key_handle;
+	struct ndr_unistr class_name;
+	KEY_INFO *info;
+
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_lsa_string(ndr, &class_name))
+		return -EINVAL;
+
+	winreg_rsp = calloc(1, sizeof(QUERY_INFO_KEY_RSP));
 	if (!winreg_rsp)
 		return -ENOMEM;
 
+	key = reg_handle_key(pipe, key_handle);
+	if (!key) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
+		goto out;
+	}
+
+	/* predefined children are counted, make them nodes for good */
+	if (reg_materialize(key)) {
+		free(winreg_rsp);
+		return -ENOMEM;
+	}
+	reg_update_info(key);
+
+	/*
+	 * Lengths are in bytes of UTF-16, from names counted in bytes of
+	 * UTF-8, which is never less. Value names get room for the NUL,
+	 * as Samba reports them.
+	 */
+	info = &winreg_rsp->key_info;
+	info->ptr_num_subkeys = cpu_to_le32(key->nr_children);
+	info->ptr_max_subkeylen = cpu_to_le32(key->max_child_name * 2);
+	info->ptr_num_values = cpu_to_le32(key->nr_values);
+	info->ptr_num_valnamelen = cpu_to_le32((key->max_value_name + 1) * 2);
+	info->ptr_max_valbufsize = cpu_to_le32(key->max_value_size);
+	info->last_changed_time = cpu_to_le64((key->last_write +
+				REG_FILETIME_EPOCH) * 10000000);
+	winreg_rsp->werror = cpu_to_le32(WERR_OK);
+	cifssrv_debug("query_info_key %s: %u subkeys, %u values\n",
+			key->key_name, key->nr_children, key->nr_values);
+out:
 	pipe->data = (char *)winreg_rsp;
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	winreg_rsp->werror = cpu_to_le32(WERR_OK);
-	cifssrv_debug("flush_key\n");
 	return 0;
 }
 
 int winreg_notify_change_key_value(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
-	WINREG_COMMON_RSP *winreg_rsp =
-				malloc(sizeof(WINREG_COMMON_RSP));
+	WINREG_COMMON_RSP *winreg_rsp;
+	struct registry_node *key;
+	KEY_HANDLE *key_handle;
+	struct reg_watch *w;
+	char *subtree;
+	__u32 filter;
+
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_bytes(ndr, &subtree, 1) ||
+	    ndr_pull_u32(ndr, &filter))
+		return -EINVAL;
+
+	winreg_rsp = malloc(sizeof(WINREG_COMMON_RSP));
 	if (!winreg_rsp)
 		return -ENOMEM;
 
-	pipe->data = (char *)winreg_rsp;
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	winreg_rsp->werror = cpu_to_le32(WERR_NOT_SUPPORTED);
-	cifssrv_debug("flush_key\n");
+
+	key = reg_handle_key(pipe, key_handle);
+	if (!key) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
+		goto out;
+	}
+
+	if (!filter || filter & ~REG_NOTIFY_CHANGE_ALL) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_PARAMETER);
+		goto out;
+	}
+
+	w = malloc(sizeof(struct reg_watch));
+	if (!w) {
+		free(winreg_rsp);
+		return -ENOMEM;
+	}
+
+	/* answered when the watch fires, see winreg_run_watches() */
+	winreg_rsp->werror = cpu_to_le32(WERR_OK);
+	w->pipe = pipe;
+	w->key = key;
+	w->filter = filter;
+	w->subtree = *subtree != 0;
+	w->expires = reg_watch_clock() + REG_WATCH_TIMEOUT;
+	w->rsp = winreg_rsp;
+	list_add_tail(&w->list, &reg_watches);
+	key->nr_watches++;
+	reg_nr_watches++;
+
+	pipe->reg_watch = w;
+	pipe->rsp_deferred = 1;
+	cifssrv_debug("watching %s, filter 0x%x%s\n", key->key_name, filter,
+			w->subtree ? ", subtree" : "");
+	return 0;
+
+out:
+	pipe->data = (char *)winreg_rsp;
 	return 0;
 }
+
 int winreg_set_value(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	struct registry_value *ret;
-	int offset = 0;
-	int value_len = 0;
-	int key_addr;
 	struct registry_node *base_key;
 	char *value_name;
 	KEY_HANDLE *key_handle;
-	NAME_INFO *name_info;
-	VALUE_BUFFER *value_buffer;
+	struct ndr_unistr name;
+	__u32 value_type, value_size, size;
+	char *value_data;
 	WINREG_COMMON_RSP *winreg_rsp;
 
-	key_handle = (KEY_HANDLE *)in_data;
-	offset += sizeof(KEY_HANDLE);
-	name_info = (NAME_INFO *)(((char *)in_data) + offset);
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_lsa_string(ndr, &name) ||
+	    ndr_pull_u32(ndr, &value_type) ||
+	    ndr_pull_array(ndr, &value_data, &value_size) ||
+	    ndr_pull_u32(ndr, &size) || size != value_size)
+		return -EINVAL;
 
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
+	base_key = reg_handle_key(pipe, key_handle);
 
-	value_name = smb_strndup_from_utf16(name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	value_name = ndr_unistr_dup(&name, pipe->codepage);
 	if (IS_ERR(value_name))
 		return PTR_ERR(value_name);
-	value_len = name_info->key_packet_len;
-	value_len = ((value_len + 3) & ~3);
-	offset += (sizeof(NAME_INFO) + value_len);
 
-	value_buffer =  (VALUE_BUFFER *)(((char *)in_data) + offset);
-	offset += (sizeof(__u32)*2);
 	winreg_rsp = malloc(sizeof(WINREG_COMMON_RSP));
 	if (!winreg_rsp) {
 		free(value_name);
@@ -513,43 +1885,42 @@ int winreg_set_value(struct cifssrv_pipe *pipe,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	if (base_key == NULL || base_key->open_status == 0) {
-		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_PARAMETER);
+	if (base_key == NULL) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
 	} else {
-		ret = set_value(value_name, value_buffer,
-			(struct registry_node *)key_handle->addr);
-		if (IS_ERR(ret))
+		ret = set_value(value_name, value_type, value_data,
+			value_size, base_key);
+		if (PTR_ERR(ret) == -EINVAL || PTR_ERR(ret) == -EFBIG) {
+			winreg_rsp->werror = cpu_to_le32(WERR_INVALID_PARAMETER);
+		} else if (IS_ERR(ret)) {
+			free(value_name);
 			return -ENOMEM;
-		winreg_rsp->werror = cpu_to_le32(WERR_OK);
+		} else {
+			reg_db_set_value(base_key, ret);
+			winreg_rsp->werror = cpu_to_le32(WERR_OK);
+		}
 	}
 	free(value_name);
 	return 0;
 }
 
 int winreg_delete_value(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
-	struct registry_value *ret;
-	int offset = 0;
-	int key_addr;
 	struct registry_node *base_key;
-	struct registry_value *value;
-	struct registry_value *prev_value;
 	char *value_name;
 	KEY_HANDLE *key_handle;
-	NAME_INFO *name_info;
+	struct ndr_unistr name;
 	WINREG_COMMON_RSP *winreg_rsp;
 
-	key_handle = (KEY_HANDLE *)in_data;
-	offset += sizeof(KEY_HANDLE);
-	name_info = (NAME_INFO *)(((char *)in_data) + offset);
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_lsa_string(ndr, &name))
+		return -EINVAL;
 
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
+	base_key = reg_handle_key(pipe, key_handle);
 
-	value_name = smb_strndup_from_utf16(name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	value_name = ndr_unistr_dup(&name, pipe->codepage);
 	if (IS_ERR(value_name))
 		return PTR_ERR(value_name);
 	winreg_rsp = malloc(sizeof(WINREG_COMMON_RSP));
@@ -564,32 +1935,12 @@ int winreg_delete_value(struct cifssrv_pipe *pipe,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	if (base_key == NULL || base_key->open_status == 0) {
-		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_PARAMETER);
+	if (base_key == NULL) {
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
 	} else {
-		ret = search_value(value_name,
-					(struct registry_node *)key_addr);
-		if (IS_ERR(ret))
-			winreg_rsp->werror = cpu_to_le32(WERR_OK);
-		else {
-			value = base_key->value_list;
-			prev_value = NULL;
-			while ((strcmp(value->value_name, value_name) != 0)) {
-				prev_value = value;
-				value = value->neighbour;
-			}
-			if (prev_value == NULL) {
-				value = base_key->value_list->neighbour;
-				free(base_key->value_list->value_buffer);
-				free(base_key->value_list);
-				base_key->value_list = value;
-			} else {
-				prev_value->neighbour = value->neighbour;
-				free(value->value_buffer);
-				free(value);
-			}
-			winreg_rsp->werror = cpu_to_le32(WERR_OK);
-		}
+		if (!delete_value(value_name, base_key))
+			reg_db_delete_value(base_key, value_name);
+		winreg_rsp->werror = cpu_to_le32(WERR_OK);
 	}
 	free(value_name);
 	cifssrv_debug("delete_value\n");
@@ -597,24 +1948,42 @@ int winreg_delete_value(struct cifssrv_pipe *pipe,
 }
 
 int winreg_query_value(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
 	struct registry_value *ret;
-	int offset = 0;
-	int value_len = 0;
-	int key_addr;
 	struct registry_node *base_key;
 	struct registry_value *value;
 	char *value_name;
 	QUERY_VALUE_RSP *winreg_rsp;
 	KEY_HANDLE *key_handle;
-	NAME_INFO *name_info;
-	BUFFER_INFO *buffer_info;
-	__u32 *ptr_check;
+	struct ndr_unistr name;
+	__u32 type_ptr, data_ptr, size_ptr, length_ptr, val;
+	__u32 max_count = 0, offset, actual_count;
+	char *data;
 	QUERY_INFO *query_info;
 
-	winreg_rsp = malloc(sizeof(QUERY_VALUE_RSP));
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_lsa_string(ndr, &name) ||
+	    ndr_pull_u32(ndr, &type_ptr) ||
+	    (type_ptr && ndr_pull_u32(ndr, &val)) ||
+	    ndr_pull_u32(ndr, &data_ptr))
+		return -EINVAL;
+
+	/* only the size of the client data buffer matters, not its contents */
+	if (data_ptr && (ndr_pull_u32(ndr, &max_count) ||
+			 ndr_pull_u32(ndr, &offset) ||
+			 ndr_pull_u32(ndr, &actual_count) ||
+			 ndr_pull_bytes(ndr, &data, actual_count)))
+		return -EINVAL;
+
+	if (ndr_pull_u32(ndr, &size_ptr) ||
+	    (size_ptr && ndr_pull_u32(ndr, &val)) ||
+	    ndr_pull_u32(ndr, &length_ptr) ||
+	    (length_ptr && ndr_pull_u32(ndr, &val)))
+		return -EINVAL;
+
+	winreg_rsp = calloc(1, sizeof(QUERY_VALUE_RSP));
 	if (!winreg_rsp)
 		return -ENOMEM;
 
@@ -625,21 +1994,21 @@ int winreg_query_value(struct cifssrv_pipe *pipe,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
 
-	key_handle = (KEY_HANDLE *)in_data;
-	offset += sizeof(KEY_HANDLE);
-	name_info = (NAME_INFO *)(((char *)in_data) + offset);
+	base_key = reg_handle_key(pipe, key_handle);
 
-	key_addr = key_handle->addr;
-	base_key = (struct registry_node *)key_addr;
-
-	value_name = smb_strndup_from_utf16(name_info->Buffer,
-			name_info->key_packet_len, 1, pipe->codepage);
+	value_name = ndr_unistr_dup(&name, pipe->codepage);
 	if (IS_ERR(value_name))
 		return PTR_ERR(value_name);
-	cifssrv_debug("base key addr %x, value name %s\n", key_addr,
+
+	if (base_key == NULL) {
+		free(value_name);
+		winreg_rsp->werror = cpu_to_le32(WERR_INVALID_HANDLE);
+		return 0;
+	}
+	cifssrv_debug("base key %s, value name %s\n", base_key->key_name,
 								value_name);
 
-	ret = search_value(value_name, (struct registry_node *)key_addr);
+	ret = search_value(value_name, base_key);
 	if (IS_ERR(ret)) {
 		if ((strcmp(value_name, "") == 0) ||
 			(strcmp(value_name, "Default") == 0))
@@ -649,36 +2018,11 @@ int winreg_query_value(struct cifssrv_pipe *pipe,
 	}
 	value = (struct registry_value *)ret;
 
-	value_len = name_info->key_packet_len;
-	value_len = ((value_len + 3) & ~3);
-	offset += (sizeof(NAME_INFO) + value_len);
-
-	ptr_check = (__u32 *)((in_data) + offset);
-	if (*ptr_check == 0)
-		goto err_invalid_param;
-
-	offset += (sizeof(DATA_INFO));
-
-	buffer_info = (BUFFER_INFO *)(in_data + offset);
-
-	if (buffer_info->ref_id != 0)
-		offset += (sizeof(__u32)*4);
-	else
-		offset += (sizeof(__u32));
-
-	ptr_check = (__u32 *)((in_data) + offset);
-	if (*ptr_check == 0)
-		goto err_invalid_param;
-
-	offset += (sizeof(DATA_INFO));
-
-	ptr_check = (__u32 *)((in_data) + offset);
-	if (*ptr_check == 0)
+	if (!type_ptr || !size_ptr || !length_ptr)
 		goto err_invalid_param;
 
-	offset += (sizeof(DATA_INFO));
 	query_info = malloc(sizeof(QUERY_INFO));
-	if (!winreg_rsp) {
+	if (!query_info) {
 		free(value_name);
 		return -ENOMEM;
 	}
@@ -695,23 +2039,25 @@ int winreg_query_value(struct cifssrv_pipe *pipe,
 	query_info->data_info.offset = 0;
 	query_info->data_ref_id = cpu_to_le32(0x00020014);
 
-	if (query_info->size_info.info < sizeof(__u32))
-		query_info->Buffer = malloc(sizeof(__u32));
-	else
-		query_info->Buffer = malloc(value->value_size + 1);
-	if (!winreg_rsp)
-		return -ENOMEM;
-
-	memcpy(query_info->Buffer, value->value_buffer, value->value_size);
-	if (buffer_info->ref_id != 0) {
+	query_info->Buffer = NULL;
+	winreg_rsp->werror = cpu_to_le32(WERR_OK);
+	if (data_ptr) {
 		cifssrv_debug("client buffer size %d value buffer size %d\n",
-			buffer_info->data_info.max_count, value->value_size);
-		if (buffer_info->data_info.max_count >= value->value_size)
-			winreg_rsp->werror = cpu_to_le32(WERR_OK);
-		else
+			max_count, value->value_size);
+		if (max_count < value->value_size) {
+			/* only the size is sent back */
 			winreg_rsp->werror = cpu_to_le32(WERR_MORE_DATA);
-	} else {
-		winreg_rsp->werror = cpu_to_le32(WERR_OK);
+			free(value_name);
+			return 0;
+		}
+
+		query_info->Buffer = malloc(value->value_size + 1);
+		if (!query_info->Buffer) {
+			free(value_name);
+			return -ENOMEM;
+		}
+		memcpy(query_info->Buffer, reg_value_data(value),
+				value->value_size);
 	}
 	free(value_name);
 	return 0;
@@ -729,236 +2075,357 @@ err_bad_file:
 }
 
 int winreg_enum_value(struct cifssrv_pipe *pipe,
-				RPC_REQUEST_REQ *rpc_request_req, char *in_data)
+				RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr)
 {
 	RPC_REQUEST_RSP *rpc_request_rsp;
-	ENUM_VALUE_RSP *winreg_rsp = malloc(sizeof(ENUM_VALUE_RSP));
+	ENUM_VALUE_RSP *winreg_rsp;
+	struct registry_value *value;
+	struct registry_node *key;
+	KEY_HANDLE *key_handle;
+	struct ndr_unistr name;
+	__u32 index, type_ptr, data_ptr, size_ptr, length_ptr, val;
+	__u32 max_count = 0, offset, actual_count;
+	__u16 len, size;
+	char *data;
+	__le16 *str;
+
+	/* only the size of the client data buffer matters, as in QueryValue */
+	if (ndr_pull_bytes(ndr, (char **)&key_handle, sizeof(KEY_HANDLE)) ||
+	    ndr_pull_u32(ndr, &index) ||
+	    ndr_pull_u16(ndr, &len) ||
+	    ndr_pull_u16(ndr, &size) ||
+	    ndr_pull_unique_unistr(ndr, &name) ||
+	    ndr_pull_u32(ndr, &type_ptr) ||
+	    (type_ptr && ndr_pull_u32(ndr, &val)) ||
+	    ndr_pull_u32(ndr, &data_ptr) ||
+	    (data_ptr && (ndr_pull_u32(ndr, &max_count) ||
+			  ndr_pull_u32(ndr, &offset) ||
+			  ndr_pull_u32(ndr, &actual_count) ||
+			  ndr_pull_bytes(ndr, &data, actual_count))) ||
+	    ndr_pull_u32(ndr, &size_ptr) ||
+	    (size_ptr && ndr_pull_u32(ndr, &val)) ||
+	    ndr_pull_u32(ndr, &length_ptr) ||
+	    (length_ptr && ndr_pull_u32(ndr, &val)))
+		return -EINVAL;
+
+	winreg_rsp = calloc(1, sizeof(ENUM_VALUE_RSP));
 	if (!winreg_rsp)
 		return -ENOMEM;
+	winreg_rsp->name_size = size;
+	winreg_rsp->type_ptr = type_ptr;
+	winreg_rsp->data_ptr = data_ptr;
+	winreg_rsp->data_size = max_count;
+	winreg_rsp->size_ptr = size_ptr;
+	winreg_rsp->length_ptr = length_ptr;
+
+	key = reg_handle_key(pipe, key_handle);
+	if (!key) {
+		winreg_rsp->werror = WERR_INVALID_HANDLE;
+		goto out;
+	}
+
+	if (index >= key->nr_values) {
+		winreg_rsp->werror = WERR_NO_MORE_DATA;
+		goto out;
+	}
+
+	if (data_ptr && (!size_ptr || !length_ptr)) {
+		winreg_rsp->werror = WERR_INVALID_PARAMETER;
+		goto out;
+	}
 
+	value = key->values[index];
+	str = reg_utf16_name(pipe, strcmp(value->value_name, "Default") ?
+			value->value_name : "", &len);
+	if (IS_ERR(str)) {
+		free(winreg_rsp);
+		return PTR_ERR(str);
+	}
+	if (len > size) {
+		free(str);
+		winreg_rsp->werror = WERR_MORE_DATA;
+		goto out;
+	}
+
+	winreg_rsp->name = str;
+	winreg_rsp->name_len = len;
+	winreg_rsp->type = value->value_type;
+	winreg_rsp->value_size = value->value_size;
+	winreg_rsp->werror = WERR_OK;
+
+	if (data_ptr && value->value_size > max_count) {
+		winreg_rsp->data_size = value->value_size;
+		winreg_rsp->werror = WERR_MORE_DATA;
+	} else if (data_ptr) {
+		/* copied, the value may change before the response is read */
+		winreg_rsp->data = malloc(value->value_size);
+		if (!winreg_rsp->data) {
+			free(str);
+			free(winreg_rsp);
+			return -ENOMEM;
+		}
+		memcpy(winreg_rsp->data, reg_value_data(value),
+				value->value_size);
+		winreg_rsp->data_len = value->value_size;
+	}
+	cifssrv_debug("enum_value %s[%u] %s\n", key->key_name, index,
+			value->value_name);
+out:
 	pipe->data = (char *)winreg_rsp;
 	rpc_request_rsp = &winreg_rsp->rpc_request_rsp;
-	winreg_rsp->name_ref_id = 0x00020014;
-	winreg_rsp->type_info.ref_id = 0x00020018;
-	winreg_rsp->length_info.ref_id = 0x00020020;
-	winreg_rsp->size_info.ref_id = 0x00020024;
 	dcerpc_header_init(&rpc_request_rsp->hdr, RPC_RESPONSE,
 				RPC_FLAG_FIRST | RPC_FLAG_LAST,
 				rpc_request_req->hdr.call_id);
 	rpc_request_rsp->context_id = rpc_request_req->context_id;
-	winreg_rsp->werror = cpu_to_le32(WERR_NO_MORE_DATA);
-	cifssrv_debug("enum_value\n");
 	return 0;
 }
 
-struct registry_value *search_value(char *name, struct registry_node *key_addr)
+/**
+ * reg_value_index() - look up a value of a key
+ * @key:	key
+ * @name:	value name, "" for the default value
+ *
+ * Return:	index of the value, otherwise -ENOENT
+ */
+static int reg_value_index(struct registry_node *key, const char *name)
 {
-	struct registry_node *base_key_addr =  (struct registry_node *)key_addr;
-	struct registry_value *value;
+	unsigned int i;
 
-	cifssrv_debug("value name %s\n", name);
 	if (strcmp(name, "") == 0)
-		strcpy(name, "Default");
-	if (base_key_addr->value_list == NULL)
-		return ERR_PTR(-EINVAL);
+		name = "Default";
 
-	value = base_key_addr->value_list;
-	while ((value != NULL) && (strcmp(value->value_name, name) != 0))
-			value = value->neighbour;
-	if (value == NULL)
-		return ERR_PTR(-EINVAL);
-	else
-		return value;
+	for (i = 0; i < key->nr_values; i++) {
+		if (strcmp(key->values[i]->value_name, name) == 0)
+			return i;
+	}
+	return -ENOENT;
+}
+
+struct registry_value *search_value(const char *name,
+				struct registry_node *key_addr)
+{
+	int i;
 
+	cifssrv_debug("value name %s\n", name);
+	i = reg_value_index(key_addr, name);
+	if (i < 0)
+		return ERR_PTR(-EINVAL);
+	return key_addr->values[i];
 }
 
-struct registry_value *set_value(char *name, VALUE_BUFFER *buffer_info,
-					struct registry_node *key_addr)
+struct registry_value *set_value(const char *name, __u32 type,
+				const char *data, __u32 size,
+				struct registry_node *key_addr)
 {
-	struct registry_node *base_key_addr = (struct registry_node *)key_addr;
-	struct registry_value *value;
-	struct registry_value *ret = NULL;
+	struct registry_value *value, **values;
+	unsigned int values_size;
+	int ret;
+
+	if (size > REG_MAX_VALUE_SIZE)
+		return ERR_PTR(-EFBIG);
 
 	if (strcmp(name, "") == 0)
-		strcpy(name, "Default");
-	if (base_key_addr->value_list == NULL) {
-		value = malloc(sizeof(struct registry_value));
-		if (!value)
-			return ERR_PTR(-ENOMEM);
-
-		strcpy(value->value_name, name);
-		value->value_type = buffer_info->value_type;
-		value->value_size = buffer_info->buffer_count;
-		cifssrv_debug("type %d, size %d, name %s\n",
-			value->value_type, value->value_size,
-				value->value_name);
-		value->value_buffer = malloc(value->value_size);
-		if (!value->value_buffer)
-			return ERR_PTR(-ENOMEM);
-
-		memcpy(value->value_buffer, buffer_info->Buffer,
-							value->value_size);
-		value->neighbour = NULL;
-		base_key_addr->value_list = value;
-	} else {
-		ret = search_value(name, key_addr);
-		if (IS_ERR(ret)) {
-			value = malloc(sizeof(struct registry_value));
-			if (!value)
+		name = "Default";
+
+	value = search_value(name, key_addr);
+	if (IS_ERR(value)) {
+		if (key_addr->nr_values == key_addr->values_size) {
+			values_size = key_addr->values_size ?
+				key_addr->values_size * 2 : REG_MIN_VALUES;
+			values = reg_grow_array(key_addr->values,
+					key_addr->nr_values,
+					key_addr->values_size, values_size);
+			if (!values)
 				return ERR_PTR(-ENOMEM);
+			key_addr->values = values;
+			key_addr->values_size = values_size;
+		}
 
-			strcpy(value->value_name, name);
-			value->value_type = buffer_info->value_type;
-			value->value_size = buffer_info->buffer_count;
-			value->value_buffer = malloc(value->value_size);
-			if (!value->value_buffer)
-				return ERR_PTR(-ENOMEM);
+		value = reg_alloc_value(name);
+		if (IS_ERR(value))
+			return value;
 
-			memcpy(value->value_buffer, buffer_info->Buffer,
-							value->value_size);
-			value->neighbour = base_key_addr->value_list;
-			base_key_addr->value_list = value;
-		} else {
-			value = (struct registry_value *)ret;
-			value->value_size = buffer_info->buffer_count;
-			value->value_type = buffer_info->value_type;
-			memcpy(value->value_buffer, buffer_info->Buffer,
-							value->value_size);
+		cifssrv_debug("type %d, size %d, name %s\n", type, size,
+				value->value_name);
+		ret = reg_value_store(value, data, size);
+		if (ret) {
+			reg_free_value(value);
+			return ERR_PTR(ret);
 		}
+
+		value->value_type = type;
+		key_addr->values[key_addr->nr_values++] = value;
+	} else {
+		if (size < value->value_size &&
+		    value->value_size == key_addr->max_value_size)
+			key_addr->info_stale = 1;
+
+		ret = reg_value_store(value, data, size);
+		if (ret)
+			return ERR_PTR(ret);
+		value->value_type = type;
 	}
-	return ret;
+	reg_value_info(key_addr, value);
+	key_addr->last_write = time(NULL);
+	reg_notify(key_addr, REG_NOTIFY_CHANGE_LAST_SET);
+	return value;
 }
 
 void free_registry(struct registry_node *key_addr)
 {
-	struct registry_node *base_key_addr = (struct registry_node *)key_addr;
-	struct registry_node *key;
-	struct registry_node *prev_key;
-	struct registry_value *value;
-	struct registry_value *prev_value;
-
-	if (base_key_addr->child == NULL) {
-		cifssrv_debug("free address %x key name %s\n",
-			(__u32)base_key_addr, base_key_addr->key_name);
-		if (base_key_addr->value_list != NULL) {
-			value = base_key_addr->value_list;
-			while (value != NULL) {
-				prev_value = value;
-				value = value->neighbour;
-				free(prev_value->value_buffer);
-				cifssrv_debug("free address %x value name %s\n",
-					(__u32)prev_value,
-					prev_value->value_name);
-				free(prev_value);
-			}
-		}
-		free(base_key_addr);
-	} else {
-		key = base_key_addr->child;
-		while (key != NULL) {
-			prev_key = key;
-			key = key->neighbour;
-			free_registry(prev_key);
-		}
-		cifssrv_debug("free address %x key name%s\n",
-				(__u32)base_key_addr, base_key_addr->key_name);
-		if (base_key_addr->value_list != NULL) {
-			value = base_key_addr->value_list;
-			while (value != NULL) {
-				prev_value = value;
-				value = value->neighbour;
-				cifssrv_debug("free address %x value name %s\n",
-					(__u32)prev_value,
-					prev_value->value_name);
-				free(prev_value->value_buffer);
-				free(prev_value);
-			}
-		}
-		free(base_key_addr);
+	unsigned int i;
+
+	if (key_addr->nr_handles)
+		reg_handle_forget(key_addr);
+	if (key_addr->nr_watches)
+		reg_watch_forget(key_addr);
+
+	for (i = 0; i < key_addr->nr_children; i++)
+		free_registry(key_addr->children[i]);
+
+	cifssrv_debug("free key %s\n", key_addr->key_name);
+	for (i = 0; i < key_addr->nr_values; i++) {
+		cifssrv_debug("free value %s\n",
+				key_addr->values[i]->value_name);
+		reg_free_value(key_addr->values[i]);
 	}
+	reg_free_key(key_addr);
 }
 
 struct registry_node *search_registry(char *name,
 					struct registry_node *key_addr)
 {
-	struct registry_node *base_key_addr = key_addr;
-	struct registry_node *key = base_key_addr;
-	struct registry_node *prev_key;
+	struct registry_node *key = key_addr;
 	char *token = strsep(&name, "\\");
 
 	while (token) {
-		if (key->child == NULL) {
+		key = reg_lookup_child(key, token);
+		if (key == NULL)
 			return ERR_PTR(-EINVAL);
-		} else {
-			prev_key = key;
-			key = key->child;
-			while ((key != NULL) &&
-				(strcmp(key->key_name, token) != 0))
-				key = key->neighbour;
-			if (key == NULL)
-				return ERR_PTR(-EINVAL);
-
-		}
+		if (IS_ERR(key))
+			return key;
 		token = strsep(&name, "\\");
 	}
 	return key;
 }
 
-struct registry_node *create_key(char *key_name, struct registry_node *key_addr)
+/**
+ * create_key() - look up a key path below a key, creating missing keys
+ * @key_name:	backslash separated path
+ * @key_addr:	key the path is relative to
+ * @created:	set to 1 if any key on the path was created, may be NULL
+ *
+ * Return:	last key of the path on success, otherwise error pointer
+ */
+struct registry_node *create_key(char *key_name, struct registry_node *key_addr,
+		int *created)
 {
-	struct registry_node *base_key_addr = key_addr;
-	struct registry_node *key = base_key_addr;
-	struct registry_node *child;
-	struct registry_node *prev_key;
+	struct registry_node *key = key_addr;
 	char *token;
 	char *name, *kname;
 
 	cifssrv_debug("key name %s\n", key_name);
+	if (created)
+		*created = 0;
 	name = kname = strdup(key_name);
 	if (!name)
 		return ERR_PTR(-ENOMEM);
 
 	token = strsep(&name, "\\");
 	while (token) {
-		if (key->child == NULL) {
-			child = malloc(sizeof(struct registry_node));
-			if (!child) {
-				free(kname);
-				return ERR_PTR(-ENOMEM);
-			}
-			strcpy(child->key_name, token);
-			child->value_list = NULL;
-			child->child = NULL;
-			child->neighbour = NULL;
-			child->open_status = 1;
-			key->child = child;
-			key = key->child;
-		} else {
-			prev_key = key;
-			key = key->child;
-			while ((key != NULL) &&
-				(strcmp(key->key_name, token) != 0))
-				key = key->neighbour;
-			if (key == NULL) {
-				child = malloc(sizeof(struct registry_node));
-				if (!child) {
-					free(kname);
-					return ERR_PTR(-ENOMEM);
-				}
-				strcpy(child->key_name, token);
-				child->value_list = NULL;
-				child->child = NULL;
-				child->open_status = 1;
-				key = prev_key;
-				child->neighbour = key->child;
-				key->child = child;
-				key = key->child;
-			} else {
-				key->open_status = 1;
-			}
-		}
+		key = reg_create_child(key, token, created);
+		if (IS_ERR(key))
+			break;
 		token = strsep(&name, "\\");
 	}
 	free(kname);
 	return key;
 }
+
+/**
+ * reg_create_child() - look up a direct child of a key, creating it if
+ *			it does not exist
+ * @key:	parent key
+ * @name:	child name
+ * @created:	set to 1 if the child was created, left alone otherwise,
+ *		may be NULL
+ *
+ * Return:	child key on success, otherwise error pointer
+ */
+struct registry_node *reg_create_child(struct registry_node *key,
+		const char *name, int *created)
+{
+	struct registry_node *child;
+	int ret;
+
+	child = reg_lookup_child(key, name);
+	if (child)
+		return child;
+
+	child = reg_alloc_key(name);
+	if (IS_ERR(child))
+		return child;
+
+	ret = reg_add_child(key, child);
+	if (ret) {
+		reg_free_key(child);
+		return ERR_PTR(ret);
+	}
+	key->last_write = child->last_write;
+	reg_notify(key, REG_NOTIFY_CHANGE_NAME);
+	if (created)
+		*created = 1;
+	return child;
+}
+
+/**
+ * delete_key() - unlink a key from its parent and free its subtree
+ * @key:	key, not a root key
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+int delete_key(struct registry_node *key)
+{
+	struct registry_node *parent = key->parent;
+	int ret;
+
+	ret = reg_materialize(parent);
+	if (ret)
+		return ret;
+
+	reg_unlink_child(parent, key);
+	free_registry(key);
+	parent->last_write = time(NULL);
+	reg_notify(parent, REG_NOTIFY_CHANGE_NAME);
+	return 0;
+}
+
+/**
+ * delete_value() - remove a value from a key
+ * @name:	value name
+ * @key:	key
+ *
+ * Return:	0 on success, -ENOENT if the key has no such value
+ */
+int delete_value(const char *name, struct registry_node *key)
+{
+	struct registry_value *value;
+	int i;
+
+	i = reg_value_index(key, name);
+	if (i < 0)
+		return -ENOENT;
+
+	value = key->values[i];
+	if (strlen(value->value_name) == key->max_value_name ||
+	    value->value_size == key->max_value_size)
+		key->info_stale = 1;
+	key->last_write = time(NULL);
+
+	reg_free_value(value);
+	key->nr_values--;
+	memmove(&key->values[i], &key->values[i + 1],
+			(key->nr_values - i) * sizeof(struct registry_value *));
+	reg_notify(key, REG_NOTIFY_CHANGE_LAST_SET);
+	return 0;
+}
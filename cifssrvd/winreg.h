@@ -45,29 +45,83 @@
 #define WINREG_GETVERSION		0x1a
 
 /* Registry structure*/
+#define REG_MAX_KEY_NAME	255
+#define REG_MAX_VALUE_NAME	16383
+
+/* value types */
+#define REG_NONE		0
+#define REG_SZ			1
+#define REG_EXPAND_SZ		2
+#define REG_BINARY		3
+#define REG_DWORD		4
+#define REG_MULTI_SZ		7
+#define REG_QWORD		11
+
+/*
+ * Responses are not fragmented, value data is limited to what fits in
+ * one QueryValue response next to its other fields and an auth trailer
+ */
+#define REG_MAX_VALUE_SIZE	(NETLINK_CIFSSRV_MAX_PAYLOAD - 128)
+
+/* data up to this size is kept in the value itself */
+#define REG_VALUE_INLINE	16
+
 struct registry_value {
-	char value_name[40];
+	/* interned, see reg_name_get() */
+	const char *value_name;
 	__u32 value_type;
 	__u32 value_size;
-	char *value_buffer;
-	struct registry_value *neighbour;
+	union {
+		/* shared with values of the same data, see reg_blob_get() */
+		const char *value_buffer;
+		char value_inline[REG_VALUE_INLINE];
+	};
 };
 
+static inline const char *reg_value_data(const struct registry_value *value)
+{
+	if (value->value_size <= REG_VALUE_INLINE)
+		return value->value_inline;
+	return value->value_buffer;
+}
+
 struct registry_node {
-	char key_name[40];
-	struct registry_value *value_list;
-	struct registry_node *child;
-	struct registry_node *neighbour;
-	__u8 open_status;
+	/* interned, see reg_name_get() */
+	const char *key_name;
+	/* values in the order they were set, EnumValue indexes this */
+	struct registry_value **values;
+	/* child nodes in the order they were added, EnumKey indexes this */
+	struct registry_node **children;
+	struct registry_node *parent;
+	/* children hashed on case-folded name, see reg_find_child() */
+	struct registry_node **child_hash;
+	struct registry_node *hash_next;
+	unsigned int name_hash;
+	/* predefined children not made nodes yet, see reg_lookup_child() */
+	const struct reg_base_key *base;
+	unsigned int nr_children;
+	/* entries of both children and child_hash */
+	unsigned int hash_size;
+	unsigned int nr_values;
+	unsigned int values_size;
+	/* open handles referring to the key */
+	unsigned int nr_handles;
+	/* armed NotifyChangeKeyValue watches on the key, see reg_notify() */
+	unsigned int nr_watches;
+	/* QueryInfoKey, kept up to date by the tree operations */
+	__u32 max_value_size;
+	__u32 last_write;
+	__u16 max_value_name;
+	__u16 max_child_name;
+	/* a maximum was removed, see reg_update_info() */
+	__u8 info_stale;
 	__u8 access_status;
 };
 
+/* policy_handle, the uuid is random and only means something here */
 typedef struct handle_to_key {
-	__u32 addr;
-	__u32 time_hi;
-	__u32 time_mi;
-	__u32 time_lo;
-	__u32 reserved;
+	__u32 handle_type;
+	__u8 uuid[16];
 } __attribute__((packed)) KEY_HANDLE;
 
 typedef struct name_info {
@@ -114,36 +168,12 @@ typedef struct query_info {
 	DATA_INFO length_info;
 } __attribute__((packed)) QUERY_INFO;
 
-typedef struct value_buffer {
-	__u32 value_type;
-	__u32 buffer_count;
-	__u8 Buffer[0];
-} __attribute__((packed)) VALUE_BUFFER;
-
-/* Winreg response structure */
-typedef struct enum_key_rsp {
-	RPC_REQUEST_RSP rpc_request_rsp;
-	CLASSNAME_INFO key_name;
-	__u32 key_class_ref_id;
-	NAME_INFO key_class;
-	__u32 last_changed_time_ref_id;
-	__u64 last_changed_time;
-	__u32 werror;
-} __attribute__((packed)) ENUM_KEY_RSP;
-
-typedef struct enum_value_rsp {
-	RPC_REQUEST_RSP rpc_request_rsp;
-	__u16 name_len;
-	__u16 name_size;
-	__u32 name_ref_id;
-	UNISTR_INFO name_str_info;
-	__u16 *Buffer;
-	DATA_INFO type_info;
-	__u32 value_ptr;
-	DATA_INFO size_info;
-	DATA_INFO length_info;
-	__u32 werror;
-} __attribute__((packed)) ENUM_VALUE_RSP;
+/* Winreg response structures, see rpc_idl.h for the layouts */
+NDR_STRUCT(query_info_key_rsp, QUERY_INFO_KEY_RSP)
+NDR_STRUCT(get_version_rsp, GET_VERSION_RSP)
+NDR_STRUCT(openhkey_rsp, OPENHKEY_RSP)
+NDR_STRUCT(winreg_common_rsp, WINREG_COMMON_RSP)
+NDR_STRUCT(create_key_rsp, CREATE_KEY_RSP)
 
 typedef struct query_value_rsp {
 	RPC_REQUEST_RSP rpc_request_rsp;
@@ -151,38 +181,46 @@ typedef struct query_value_rsp {
 	__u32 werror;
 } __attribute__((packed)) QUERY_VALUE_RSP;
 
-typedef struct query_info_key_rsp {
-	RPC_REQUEST_RSP rpc_request_rsp;
-	CLASSNAME_INFO class_info;
-	KEY_INFO key_info;
-	__u32 werror;
-} __attribute__((packed)) QUERY_INFO_KEY_RSP;
-
-typedef struct getversion_rsp {
+/*
+ * EnumKey and EnumValue responses, host order. The name is NULL after
+ * an error; the sizes of the client buffers are echoed back.
+ */
+typedef struct enum_key_rsp {
 	RPC_REQUEST_RSP rpc_request_rsp;
-	__u32 version;
+	__le16 *name;
+	__u16 name_len;
+	__u16 name_size;
+	__u32 class_ptr;
+	__u16 class_size;
+	__u32 time_ptr;
 	__u32 werror;
-} __attribute__((packed)) GET_VERSION_RSP;
+} ENUM_KEY_RSP;
 
-typedef struct openhkey_rsp {
+typedef struct enum_value_rsp {
 	RPC_REQUEST_RSP rpc_request_rsp;
-	KEY_HANDLE key_handle;
+	__le16 *name;
+	__u16 name_len;
+	__u16 name_size;
+	__u32 type_ptr;
+	__u32 type;
+	/* data is sent only if it fits in data_size */
+	__u32 data_ptr;
+	__u32 data_size;
+	__u32 data_len;
+	char *data;
+	__u32 size_ptr;
+	__u32 length_ptr;
+	__u32 value_size;
 	__u32 werror;
-} __attribute__((packed)) OPENHKEY_RSP;
+} ENUM_VALUE_RSP;
 
-typedef struct winreg_common_rsp {
-	RPC_REQUEST_RSP rpc_request_rsp;
-	__u32	werror;
-} __attribute__((packed)) WINREG_COMMON_RSP;
-
-typedef struct create_key_rsp {
-	RPC_REQUEST_RSP rpc_request_rsp;
-	KEY_HANDLE key_handle;
-	__u32	ref_id;
-	__u32	action_taken;
-	__u32   werror;
-} __attribute__((packed)) CREATE_KEY_RSP;
 
+/* NotifyChangeKeyValue filter */
+#define REG_NOTIFY_CHANGE_NAME		0x00000001
+#define REG_NOTIFY_CHANGE_ATTRIBUTES	0x00000002
+#define REG_NOTIFY_CHANGE_LAST_SET	0x00000004
+#define REG_NOTIFY_CHANGE_SECURITY	0x00000008
+#define REG_NOTIFY_CHANGE_ALL		0x0000000f
 
 #define REG_ACTION_NONE			0x00000000
 #define REG_CREATED_NEW_KEY		0x00000001
@@ -197,44 +235,67 @@ typedef struct create_key_rsp {
 #define WINREG_KEY_SET_VALUE		0x00000002
 #define WINREG_KEY_QUERY_VALUE		0x00000001
 
-int winreg_open_root_key(struct cifssrv_pipe *pipe, int opnum,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+int winreg_open_root_key(struct cifssrv_pipe *pipe,
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_open_key(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_get_version(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_delete_key(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_create_key(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_close_key(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_open_key(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_flush_key(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_set_value(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_delete_value(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_query_value(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_query_info_key(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_notify_change_key_value(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_enum_key(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
 int winreg_enum_value(struct cifssrv_pipe *pipe,
-			RPC_REQUEST_REQ *rpc_request_req, char *in_data);
+			RPC_REQUEST_REQ *rpc_request_req, struct ndr_cursor *ndr);
+
+extern struct registry_node *reg_openhkcr;
+extern struct registry_node *reg_openhkcu;
+extern struct registry_node *reg_openhklm;
+extern struct registry_node *reg_openhku;
 
 struct registry_node *init_root_key(char *name);
 int init_predefined_registry(void);
 void free_registry(struct registry_node *key_addr);
 struct registry_node *search_registry(char *name,
 						struct registry_node *key_addr);
-struct registry_node *create_key(char *name, struct registry_node *key_addr);
-struct registry_value *search_value(char *name, struct registry_node *key_addr);
-struct registry_value *set_value(char *name, VALUE_BUFFER *buffer_info,
-					struct registry_node *key_addr);
+struct registry_node *create_key(char *name, struct registry_node *key_addr,
+						int *created);
+struct registry_node *reg_create_child(struct registry_node *key,
+						const char *name, int *created);
+int reg_materialize(struct registry_node *key);
+int delete_key(struct registry_node *key);
+int delete_value(const char *name, struct registry_node *key);
+struct registry_value *search_value(const char *name,
+				struct registry_node *key_addr);
+struct registry_value *set_value(const char *name, __u32 type,
+				const char *data, __u32 size,
+				struct registry_node *key_addr);
+
+/* persistent registry, see regdb.c */
+int reg_db_open(const char *path);
+int reg_db_start_log(void);
+void reg_db_close(void);
+int reg_db_checkpoint(void);
+void reg_db_create_key(struct registry_node *key);
+void reg_db_delete_key(struct registry_node *key);
+void reg_db_set_value(struct registry_node *key, struct registry_value *value);
+void reg_db_delete_value(struct registry_node *key, const char *name);
 #endif /* __CIFSSRV_WINREG_H  */
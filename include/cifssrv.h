@@ -73,6 +73,7 @@
 #define CIFSSRV_MINOR_VERSION 0
 
 #define CIFSSRV_CODEPAGE_LEN    32
+#define CIFSSRV_DEFAULT_CODEPAGE	"utf8"
 #define CIFSSRV_USERNAME_LEN	33
 
 enum cifssrv_pipe_type {
@@ -101,6 +102,26 @@ struct cifssrv_pipe {
         int sent;
 	char codepage[CIFSSRV_CODEPAGE_LEN];
 	char username[CIFSSRV_USERNAME_LEN];
+	/* fragmented request being reassembled, see process_rpc() */
+	char *frag_buf;
+	int frag_len;
+	int frag_size;
+	__u32 frag_call_id;
+	/* NTLMSSP security context set up at bind, see rpc_auth3() */
+	struct ntlmssp_ctx *ntlmssp;
+	int auth_level;
+	__u32 auth_ctx_id;
+	struct cifssrvd_client_info *client;
+	/* winreg handles opened on the pipe, see winreg_release_pipe() */
+	struct list_head reg_handles;
+	unsigned int nr_reg_handles;
+	/* response held back by the handler, see cifssrv_pipe_complete() */
+	int rsp_deferred;
+	/* read parked until then, its response event and buffer length */
+	unsigned int rsp_event;
+	unsigned int rsp_buflen;
+	/* armed NotifyChangeKeyValue, see winreg_run_watches() */
+	struct reg_watch *reg_watch;
 };
 
 struct cifssrvd_client_info {
@@ -108,6 +129,8 @@ struct cifssrvd_client_info {
         __u64 hash;
 	void *local_nls; // To be replaced with actual encoding logic
         struct list_head pipelist;
+	/* winreg handles open on all pipes of the client */
+	unsigned int nr_reg_handles;
 };
 
 /* max string size for share and parameters */
@@ -115,6 +138,8 @@ struct cifssrvd_client_info {
 #define SHARE_MAX_COMMENT_LEN   100
 
 #define MAX_SERVER_NAME_LEN	100
+/* NetBIOS names are at most 15 characters */
+#define MAX_NETBIOS_NAME_LEN	16
 #define MAX_SERVER_WRKGRP_LEN	100
 
 #define STR_IPC		"IPC$"
@@ -132,6 +157,18 @@ struct share_config {
 	unsigned int max_connections;
 };
 
+/* share name, comment and path pre-encoded in UTF-16LE for one codepage */
+struct cifssrv_share_utf16 {
+	struct list_head list;
+	char	codepage[CIFSSRV_CODEPAGE_LEN];
+	__le16	*name;
+	int	name_len;	/* in UTF-16 code units, including NUL */
+	__le16	*comment;
+	int	comment_len;	/* in UTF-16 code units, including NUL */
+	__le16	*path;		/* DOS form of share path, e.g. C:\srv */
+	int	path_len;	/* in UTF-16 code units, including NUL */
+};
+
 struct cifssrv_share {
 	char    *path;
 	__u16   tid;
@@ -141,27 +178,31 @@ struct cifssrv_share {
 
 	/* global list of shares */
 	struct list_head list;
+	/* list of cifssrv_share_utf16, one entry per client codepage */
+	struct list_head utf16_list;
 };
 
 extern struct list_head cifssrv_share_list;
 extern int cifssrv_num_shares;
+extern unsigned int cifssrv_share_gen;
+extern unsigned int cifssrv_global_gen;
 
 char *guestAccountName;
 //char *server_string;
 //char *workgroup;
-char *netbios_name;
+extern char netbios_name[MAX_NETBIOS_NAME_LEN];
 
 
 struct cifssrv_usr {
         char    *name;
-#if 0
         char    passkey[CIFS_NTHASH_SIZE];
+        /* global list of cifssrv users */
+        struct  list_head list;
+#if 0
         kuid_t  uid;
         kgid_t  gid;
         __le32  sess_uid;
         bool    guest;
-        /* global list of cifssrv users */
-        struct  list_head list;
         __u16   vuid;
         /* how many server have this user */
         int     ucount;
@@ -190,7 +231,16 @@ int get_entry(int fd, char **buf, int *isEOF);
 void tlws(char *src, char *dst, int *sz);
 
 int process_rpc_rsp(struct cifssrv_pipe *pipe, char *data_buf, int size);
-int process_rpc(struct cifssrv_pipe *pipe, char *data);
+int process_rpc(struct cifssrv_pipe *pipe, char *data, int len);
+void rpc_frag_release(struct cifssrv_pipe *pipe);
+void winreg_release_pipe(struct cifssrv_pipe *pipe);
+void winreg_cancel_watch(struct cifssrv_pipe *pipe);
+int winreg_run_watches(void);
+void cifssrv_pipe_complete(struct cifssrv_pipe *pipe);
+int cifssrv_init_registry(const char *path);
+int cifssrv_import_registry(const char *path);
+void cifssrv_free_registry(void);
+void exit_dcerpc(void);
 int handle_lanman_pipe(struct cifssrv_pipe *pipe, char *in_data,
 		char *out_data, int *param_len);
 
@@ -198,6 +248,16 @@ int smbConvertToUTF16(__le16 *target, char *source, int slen,
                 int targetlen, const char *codepage);
 char *smb_strndup_from_utf16(char *src, const int maxlen,
                 const int is_unicode, const char *codepage);
+__le16 *smb_utf16_encode(char *src, const char *codepage, int *len);
+void exit_conversion(void);
+int get_random_bytes(void *buf, size_t bytes);
+
+char *share_dos_path(struct cifssrv_share *share);
+struct cifssrv_share_utf16 *get_share_utf16(struct cifssrv_share *share,
+		const char *codepage);
+void update_share_index(void);
+struct cifssrv_share *lookup_share(const char *name);
+struct cifssrv_usr *lookup_user(const char *name);
 
 #define __constant_cpu_to_le64(x) ((__le64)(__u64)(x))
 #define __constant_le64_to_cpu(x) ((__u64)(__le64)(x))
@@ -214,8 +274,10 @@ char *smb_strndup_from_utf16(char *src, const int maxlen,
 #define __cpu_to_be16(x) (__swab16((x)))
 #define __be16_to_cpu(x) __swab16((__be16)(x))
 
+#define cpu_to_le64(x)	__cpu_to_le64(x)
 #define cpu_to_le32(x)	__cpu_to_le32(x)
 #define cpu_to_le16(x)	__cpu_to_le16(x)
+#define le64_to_cpu(x)	__le64_to_cpu(x)
 #define le32_to_cpu(x)	__le32_to_cpu(x)
 #define le16_to_cpu(x)	__le16_to_cpu(x)
 
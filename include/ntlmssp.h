@@ -159,7 +159,32 @@ struct ntlmv2_resp {
 	/* array of name entries could follow ending in minimum 4 byte struct */
 } __attribute__((packed));
 
-unsigned int build_ntlmssp_challenge_blob(CHALLENGE_MESSAGE *chgblob,
-		char *codepage);
+/* NTLMSSP_MESSAGE_SIGNATURE with extended session security */
+typedef struct _NTLMSSP_MESSAGE_SIGNATURE {
+	__le32 Version;		/* NTLMSSP_SIGNATURE_VERSION */
+	__u8 Checksum[8];
+	__le32 SeqNum;
+} __attribute__((packed)) NTLMSSP_MESSAGE_SIGNATURE;
+
+#define NTLMSSP_SIGNATURE_VERSION	1
+#define NTLMSSP_SIGNATURE_SIZE		sizeof(NTLMSSP_MESSAGE_SIGNATURE)
+
+/* security context of a pipe, private to ntlmssp.c */
+struct ntlmssp_ctx;
+
+CHALLENGE_MESSAGE *build_ntlmssp_challenge_blob(char *codepage,
+		unsigned int *len);
+void exit_ntlmssp(void);
+
+struct ntlmssp_ctx *ntlmssp_ctx_new(NEGOTIATE_MESSAGE *negblob,
+		CHALLENGE_MESSAGE *chgblob);
+void ntlmssp_ctx_free(struct ntlmssp_ctx *ctx);
+int ntlmssp_authenticate(struct ntlmssp_ctx *ctx, char *blob, int len,
+		const char *codepage);
+int ntlmssp_established(struct ntlmssp_ctx *ctx);
+int ntlmssp_seal(struct ntlmssp_ctx *ctx, int seal, char *data, int data_len,
+		char *pdu, int pdu_len, char *sig);
+int ntlmssp_unseal(struct ntlmssp_ctx *ctx, int seal, char *data,
+		int data_len, char *pdu, int pdu_len, char *sig);
 
 #endif /* __CIFSSRV_NTLMSSP_H */